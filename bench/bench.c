@@ -0,0 +1,470 @@
+#include <sys/resource.h>
+#include <time.h>
+#include <algorithm>
+#include "64drive.h"
+#include "crc32.h"
+#include "transfer.h"
+#include "transport.h"
+
+/** Transfer benchmark.
+ *  Runs uploads, downloads and standalone reads over a matrix of chunk
+ *  sizes, queue depths and transfer sizes, against the real device or the
+ *  simulator, and writes one JSON record per run so results from
+ *  different builds can be compared. With --crc, it instead times each
+ *  CRC32 engine this CPU can run against the bytewise one.
+ */
+
+#define BENCH_MAX_LIST 16
+
+enum {
+    MODE_UP,
+    MODE_DOWN,
+    MODE_STD,
+    MODE_LAST
+};
+
+static const char *modeNames[MODE_LAST] = {"up", "down", "std"};
+
+typedef struct {
+    int n;
+    uint32_t val[BENCH_MAX_LIST];
+} benchList;
+
+typedef struct {
+    int mode;
+    uint32_t size, chunk;
+    uint32_t burst; //PI_RD_BURST size of standalone reads, else 0
+    int depth, rep;
+
+    //results
+    int result;
+    double seconds, cpu;
+    double mbps;
+    double p50, p90, p99, pmax; //chunk latency, seconds
+    uint32_t chunks;
+    int retries;
+} benchRun;
+
+static struct option long_options[] = {
+    {"chunks",    required_argument, 0, 'c'},
+    {"crc",       no_argument,       0, 'C'},
+    {"depths",    required_argument, 0, 'd'},
+    {"help",      no_argument,       0, 'h'},
+    {"modes",     required_argument, 0, 'm'},
+    {"output",    required_argument, 0, 'o'},
+    {"repeat",    required_argument, 0, 'r'},
+    {"sizes",     required_argument, 0, 's'},
+    {"std-size",  required_argument, 0, 'S'},
+    {"transport", required_argument, 0, 'T'},
+    {"verbose",   no_argument,       0, 'v'},
+    {0, 0, 0, 0}
+};
+
+
+static void show_help() {
+    printf(
+        "64drive transfer benchmark\n"
+        "\n"
+        "usage: 64drive-bench options...\n"
+        "options:\n"
+        "  -c, --chunks LIST    chunk sizes (default: 256K,1M,4M)\n"
+        "  -C, --crc            benchmark the CRC32 engines over the largest\n"
+        "                       size, instead of transfers\n"
+        "  -d, --depths LIST    queue depths (default: 1,4,8)\n"
+        "  -h, --help           show help and exit\n"
+        "  -m, --modes LIST     any of up,down,std (default: all)\n"
+        "  -o, --output FILE    write JSON results to FILE "
+        "(default: stdout)\n"
+        "  -r, --repeat N       runs of each combination (default: 3)\n"
+        "  -s, --sizes LIST     transfer sizes for up/down "
+        "(default: 4M,32M)\n"
+        "  -S, --std-size SIZE  standalone read size (default: 256K)\n"
+        "  -T, --transport NAME transport to benchmark (default: sim)\n"
+        "  -v, --verbose        show device messages\n"
+        "\n"
+        "Sizes may end in K or M. Standalone reads always use %uK chunks "
+        "(or one\nchunk, if smaller), read in the largest bursts the "
+        "cartridge answers, so\nonly their queue depth varies.\n"
+        "Uploads go to the start of ROM, overwriting it.\n",
+        STD_CHUNK / 1024
+    );
+}
+
+
+static int parse_size(const char *str, uint32_t *out) {
+    char *end;
+    unsigned long val = strtoul(str, &end, 0);
+    if(*end == 'K' || *end == 'k') { val *= 1024; end++; }
+    else if(*end == 'M' || *end == 'm') { val *= 1024 * 1024; end++; }
+    if(end == str || *end || val == 0 || val > 0xFFFFFFFFUL) return -1;
+    *out = val;
+    return 0;
+}
+
+
+static int parse_list(const char *str, benchList *list, const char *what) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", str);
+    list->n = 0;
+    char *save = NULL;
+    for(char *tok = strtok_r(buf, ",", &save); tok;
+    tok = strtok_r(NULL, ",", &save)) {
+        if(list->n >= BENCH_MAX_LIST || parse_size(tok, &list->val[list->n])) {
+            fprintf(stderr, "Invalid %s list \"%s\"\n", what, str);
+            return -1;
+        }
+        list->n++;
+    }
+    return list->n ? 0 : -1;
+}
+
+
+static double cpu_seconds() {
+    //all threads, so the reader and sink count too
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + (ru.ru_utime.tv_usec / 1e6)
+        + ru.ru_stime.tv_sec + (ru.ru_stime.tv_usec / 1e6);
+}
+
+
+static FILE* make_source(uint32_t size) {
+    //a temporary file of pseudo-random data to upload
+    FILE *file = tmpfile();
+    if(!file) return NULL;
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    uint64_t buf[8192];
+    for(uint32_t pos=0; pos<size; pos += sizeof(buf)) {
+        for(size_t i=0; i<sizeof(buf)/sizeof(buf[0]); i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = x;
+        }
+        size_t len = std::min((size_t)(size - pos), sizeof(buf));
+        if(fwrite(buf, 1, len, file) != len) {
+            fclose(file);
+            return NULL;
+        }
+    }
+    fflush(file);
+    return file;
+}
+
+
+static void fill_random(uint8_t *buf, uint32_t size) {
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for(uint32_t pos=0; pos<size; pos += sizeof(x)) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + pos, &x, std::min((size_t)(size - pos), sizeof(x)));
+    }
+}
+
+
+static int bench_crc(FILE *out, uint32_t size, int repeat) {
+    /** Check each CRC32 engine against the bytewise one, over every
+     *  alignment and short length and then the whole buffer, and time it.
+     *  Returns the number of engines that got a wrong answer.
+     */
+    uint8_t *buf = (uint8_t*)malloc(size);
+    if(!buf) return -1;
+    fill_random(buf, size);
+    crc32Func reference = crc32_engines[0].update;
+    uint32_t expect = reference(0, buf, size);
+
+    fprintf(out, "{\"crc32\": \"%08x\", \"size\": %u, \"selected\": "
+        "\"%s\", \"engines\": [", expect, size, crc32_engine()->name);
+    double baseline = 0;
+    int failures = 0;
+    for(int i=0; crc32_engines[i].name; i++) {
+        const crc32Engine *e = &crc32_engines[i];
+        if(e->supported && !e->supported()) continue;
+
+        bool ok = (e->update(0, buf, size) == expect);
+        for(uint32_t off=0; ok && off<16 && off<size; off++)
+        for(uint32_t len=0; ok && len<=512 && off+len<=size; len++) {
+            uint32_t part = e->update(0x12345678, buf + off, len);
+            ok = (part == reference(0x12345678, buf + off, len));
+        }
+        if(!ok) failures++;
+
+        double best = 0;
+        for(int rep=0; rep<repeat; rep++) {
+            double start = now_seconds();
+            volatile uint32_t crc = e->update(0, buf, size);
+            (void)crc;
+            double t = now_seconds() - start;
+            if(!rep || t < best) best = t;
+        }
+        if(!i) baseline = best;
+        double mbps = (size / (1024.0 * 1024.0)) / best;
+
+        fprintf(out, "%s\n    {\"engine\": \"%s\", \"ok\": %s, "
+            "\"seconds\": %.6f, \"mbps\": %.1f, \"speedup\": %.2f}",
+            i ? "," : "", e->name, ok ? "true" : "false", best, mbps,
+            baseline / best);
+        fprintf(stderr, "crc32 %-8s %9.1f MB/s  x%6.2f%s\n", e->name, mbps,
+            baseline / best, ok ? "" : " WRONG");
+    }
+    fprintf(out, "\n]}\n");
+    free(buf);
+    return failures;
+}
+
+
+static double percentile(float *sorted, uint32_t n, double p) {
+    if(!n) return 0;
+    uint32_t i = (uint32_t)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+
+static void run_one(sixtyfourDrive *device, benchRun *run, FILE *source,
+FILE *sink) {
+    transferStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.maxChunks = (run->size / run->chunk) + 2;
+    stats.latency = (float*)malloc(stats.maxChunks * sizeof(float));
+    if(!stats.latency) {
+        run->result = -ENOMEM;
+        return;
+    }
+
+    transfer_opts.chunkSize = run->chunk;
+    transfer_opts.queueDepth = run->depth;
+    transfer_opts.autotune = false;
+    transfer_stats = &stats;
+
+    double cpu = cpu_seconds();
+    double start = now_seconds();
+    switch(run->mode) {
+        case MODE_UP: {
+            romSource rom;
+            rewind(source);
+            run->result = source_open(&rom, source, run->size);
+            if(run->result) break;
+            run->result = device_upload(device, &rom, 0, BANK_CARTROM);
+            source_close(&rom);
+            break;
+        }
+        case MODE_DOWN:
+        case MODE_STD:
+            rewind(sink);
+            run->result = device_download(device, sink, run->size, 0,
+                BANK_CARTROM, run->mode == MODE_STD, NULL, NULL);
+            break;
+    }
+    run->seconds = now_seconds() - start;
+    if(run->mode == MODE_STD) run->burst = device->stdBurst;
+    run->cpu = cpu_seconds() - cpu;
+    transfer_stats = NULL;
+
+    run->mbps = (run->size / (1024.0 * 1024.0)) / run->seconds;
+    run->chunks = stats.nChunks;
+    run->retries = stats.retries;
+    uint32_t n = std::min(stats.nChunks, stats.maxChunks);
+    std::sort(stats.latency, stats.latency + n);
+    run->p50 = percentile(stats.latency, n, 0.50);
+    run->p90 = percentile(stats.latency, n, 0.90);
+    run->p99 = percentile(stats.latency, n, 0.99);
+    run->pmax = n ? stats.latency[n - 1] : 0;
+    free(stats.latency);
+}
+
+
+static void write_run(FILE *out, benchRun *run, bool first) {
+    fprintf(out,
+        "%s\n    {\"mode\": \"%s\", \"size\": %u, \"chunk\": %u, "
+        "\"burst\": %u, \"depth\": %d, \"rep\": %d, \"ok\": %s,\n"
+        "     \"seconds\": %.6f, \"mbps\": %.3f, \"cpu_seconds\": %.6f, "
+        "\"chunks\": %u, \"retries\": %d,\n"
+        "     \"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, "
+        "\"p99\": %.3f, \"max\": %.3f}}",
+        first ? "" : ",", modeNames[run->mode], run->size, run->chunk,
+        run->burst, run->depth, run->rep, run->result ? "false" : "true",
+        run->seconds, run->mbps, run->cpu, run->chunks, run->retries,
+        run->p50 * 1e3, run->p90 * 1e3, run->p99 * 1e3, run->pmax * 1e3);
+    fflush(out);
+}
+
+
+int main(int argc, char **argv) {
+    const char *spec = "sim", *outPath = NULL;
+    bool modes[MODE_LAST] = {true, true, true};
+    benchList chunks = {3, {256 * 1024, 1024 * 1024, 4096 * 1024}};
+    benchList depths = {3, {1, 4, 8}};
+    benchList sizes = {2, {4 * 1024 * 1024, 32 * 1024 * 1024}};
+    uint32_t stdSize = 256 * 1024;
+    int repeat = 3;
+    bool crc = false;
+    verbosity = -1;
+
+    while(1) {
+        int c = getopt_long(argc, argv, "c:Cd:hm:o:r:s:S:T:v",
+            long_options, NULL);
+        if(c < 0) break;
+        switch(c) {
+            case 'c':
+                if(parse_list(optarg, &chunks, "chunk size")) return EXIT_FAILURE;
+                for(int i=0; i<chunks.n; i++) {
+                    if(chunks.val[i] % 512
+                    || chunks.val[i] > TRANSFER_MAX_CHUNK) {
+                        fprintf(stderr, "Chunk sizes must be multiples of "
+                            "512, up to %d\n", TRANSFER_MAX_CHUNK);
+                        return EXIT_FAILURE;
+                    }
+                }
+                break;
+
+            case 'C':
+                crc = true;
+                break;
+
+            case 'd':
+                if(parse_list(optarg, &depths, "depth")) return EXIT_FAILURE;
+                for(int i=0; i<depths.n; i++) {
+                    if(depths.val[i] > TRANSFER_MAX_DEPTH) {
+                        fprintf(stderr, "Depths must be 1 to %d\n",
+                            TRANSFER_MAX_DEPTH);
+                        return EXIT_FAILURE;
+                    }
+                }
+                break;
+
+            case 'h':
+                show_help();
+                return EXIT_SUCCESS;
+
+            case 'm': {
+                char buf[64];
+                snprintf(buf, sizeof(buf), "%s", optarg);
+                memset(modes, 0, sizeof(modes));
+                char *save = NULL;
+                for(char *tok = strtok_r(buf, ",", &save); tok;
+                tok = strtok_r(NULL, ",", &save)) {
+                    int m;
+                    for(m=0; m<MODE_LAST && strcmp(tok, modeNames[m]); m++);
+                    if(m == MODE_LAST) {
+                        fprintf(stderr, "Unknown mode \"%s\"\n", tok);
+                        return EXIT_FAILURE;
+                    }
+                    modes[m] = true;
+                }
+                break;
+            }
+
+            case 'o':
+                outPath = optarg;
+                break;
+
+            case 'r':
+                repeat = atoi(optarg);
+                if(repeat < 1) {
+                    fprintf(stderr, "Invalid repeat count\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 's':
+                if(parse_list(optarg, &sizes, "size")) return EXIT_FAILURE;
+                break;
+
+            case 'S':
+                if(parse_size(optarg, &stdSize) || stdSize % 512) {
+                    fprintf(stderr, "Invalid standalone size\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'T':
+                spec = optarg;
+                break;
+
+            case 'v':
+                verbosity = 0;
+                break;
+
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t maxSize = 0;
+    for(int i=0; i<sizes.n; i++) maxSize = std::max(maxSize, sizes.val[i]);
+    if(crc) {
+        FILE *out = outPath ? fopen(outPath, "w") : stdout;
+        if(!out) {
+            fprintf(stderr, "Can't open %s: %s\n", outPath, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        int failures = bench_crc(out, maxSize, repeat);
+        if(out != stdout) fclose(out);
+        return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    sixtyfourDrive device;
+    memset(&device, 0, sizeof(device));
+    device.transport = transport_find(spec, &device.transportArgs);
+    if(!device.transport) {
+        fprintf(stderr, "Unknown transport \"%s\"\n", spec);
+        return EXIT_FAILURE;
+    }
+    if(setup_device(&device)) return EXIT_FAILURE;
+
+    FILE *source = modes[MODE_UP] ? make_source(maxSize) : NULL;
+    FILE *sink = fopen("/dev/null", "wb");
+    FILE *out = outPath ? fopen(outPath, "w") : stdout;
+    if((modes[MODE_UP] && !source) || !sink || !out) {
+        fprintf(stderr, "Can't set up benchmark files: %s\n",
+            strerror(errno));
+        shutdown_device(&device);
+        return EXIT_FAILURE;
+    }
+
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(out, "{\"transport\": \"%s\", \"date\": \"%s\", "
+        "\"serial\": \"%s\", \"runs\": [", spec, date, device.serial);
+
+    bool first = true;
+    int failures = 0;
+    for(int mode=0; mode<MODE_LAST; mode++) {
+        if(!modes[mode]) continue;
+        bool standalone = (mode == MODE_STD);
+        int nSizes = standalone ? 1 : sizes.n;
+        int nChunks = standalone ? 1 : chunks.n;
+        for(int s=0; s<nSizes; s++)
+        for(int c=0; c<nChunks; c++)
+        for(int d=0; d<depths.n; d++)
+        for(int rep=0; rep<repeat; rep++) {
+            benchRun run;
+            memset(&run, 0, sizeof(run));
+            run.mode = mode;
+            run.size = standalone ? stdSize : sizes.val[s];
+            run.chunk = standalone ? STD_CHUNK : chunks.val[c];
+            if(run.chunk > run.size) run.chunk = run.size;
+            run.depth = depths.val[d];
+            run.rep = rep;
+            run_one(&device, &run, source, sink);
+            if(run.result) failures++;
+
+            write_run(out, &run, first);
+            first = false;
+            fprintf(stderr, "%-4s %7u K %6.1f K x%-2d #%d: %8.2f MB/s, "
+                "p50 %7.3f ms, p99 %7.3f ms, cpu %5.2f s, %d retries%s\n",
+                modeNames[mode], run.size / 1024, run.chunk / 1024.0,
+                run.depth, rep, run.mbps, run.p50 * 1e3, run.p99 * 1e3,
+                run.cpu, run.retries, run.result ? " FAILED" : "");
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if(out != stdout) fclose(out);
+    if(source) fclose(source);
+    fclose(sink);
+    shutdown_device(&device);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -10,6 +10,7 @@
 #include <getopt.h> //getopt_long
 #include <errno.h>
 #include <libftdi1/ftdi.h>
+#include <libusb-1.0/libusb.h>
 
 #define DEV_MAGIC                  0x55444556 // "UDEV"
 #define	DEV_CMD_LOADRAM            0x20
@@ -63,10 +64,47 @@ enum {
     CIC_LAST
 };
 
+struct deviceTransport;
+
+typedef struct {
+    int num;
+    int cic;
+    uint32_t crc32; //of bootcode
+    const char *desc;
+} cicType;
+
 typedef struct {
-    struct ftdi_context* ftdi;
+    const struct deviceTransport *transport;
+    const char *transportArgs; //options given after the transport name
+    void *ctx; //transport state, or NULL if not open
     int version;
     char variant[3];
+    char serial[64]; //USB serial number, or empty if unknown
+    uint32_t stdBurst; //largest PI_RD_BURST accepted, or 0 if not yet known
 } sixtyfourDrive;
 
+extern int verbosity;
+extern const cicType cic_types[];
+extern const uint32_t bank_capacity[BANK_LAST];
+
+uint32_t swap_endian(uint32_t val);
+double now_seconds();
+uint32_t crc32(const uint8_t *data, size_t len);
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+int cic_from_bootcode(const uint8_t *bootcode);
+int fail_ftdi(struct ftdi_context* ftdi, const char *msg);
+int device_build_cmd(uint8_t *buf, uint8_t cmd, uint8_t nParams,
+    uint32_t *params);
+int device_send_cmd(sixtyfourDrive *device, uint8_t cmd, uint8_t nParams,
+    uint32_t *params, uint8_t *resp, uint32_t respLen);
+int device_write_all(sixtyfourDrive *device, const uint8_t *buf, int len);
+int device_read_all(sixtyfourDrive *device, uint8_t *buf, int len);
+int device_resync(sixtyfourDrive *device);
+int device_get_version(sixtyfourDrive *device);
+int device_set_cic(sixtyfourDrive *device, int cic);
+int setup_device(sixtyfourDrive *device);
+void shutdown_device(sixtyfourDrive *device);
+int load_file(sixtyfourDrive *device, FILE *file, int64_t size,
+    uint32_t offset, int bank, bool autoCIC);
+
 #endif //_64DRIVE_H_
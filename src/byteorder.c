@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include "byteorder.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BYTEORDER_SSSE3
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define BYTEORDER_NEON
+#include <arm_neon.h>
+#endif
+
+/** Conversion between the byte orders ROM images turn up in. Each is its
+ *  own inverse, so the same shuffle goes to or from big-endian.
+ */
+
+static const char *orderNames[BYTEORDER_LAST] = {"auto", "z64", "v64", "n64"};
+
+//first word of a ROM as it reads in each byte order
+static const uint8_t orderMagic[BYTEORDER_LAST][4] = {
+    {0, 0, 0, 0},
+    {0x80, 0x37, 0x12, 0x40},
+    {0x37, 0x80, 0x40, 0x12},
+    {0x40, 0x12, 0x37, 0x80},
+};
+
+
+int byteorder_parse(const char *name) {
+    //BYTEORDER_* for a name, or -1
+    for(int i=0; i<BYTEORDER_LAST; i++) {
+        if(!strcmp(name, orderNames[i])) return i;
+    }
+    return -1;
+}
+
+
+const char* byteorder_name(int order) {
+    return (order >= 0 && order < BYTEORDER_LAST) ? orderNames[order] : "?";
+}
+
+
+int byteorder_detect(const uint8_t *header, size_t len) {
+    //byte order of a ROM from its first word; BYTEORDER_Z64, meaning
+    //leave it alone, if it doesn't look like one
+    for(int i=BYTEORDER_Z64; len >= 4 && i<BYTEORDER_LAST; i++) {
+        if(!memcmp(header, orderMagic[i], 4)) return i;
+    }
+    return BYTEORDER_Z64;
+}
+
+
+static void convert_scalar(uint8_t *dest, const uint8_t *src, size_t len,
+int order) {
+    size_t i = 0;
+    if(order == BYTEORDER_V64) {
+        for(; i + 2 <= len; i += 2) {
+            uint8_t a = src[i];
+            dest[i] = src[i + 1];
+            dest[i + 1] = a;
+        }
+    }
+    else {
+        for(; i + 4 <= len; i += 4) {
+            uint32_t w;
+            memcpy(&w, src + i, sizeof(w));
+            w = __builtin_bswap32(w);
+            memcpy(dest + i, &w, sizeof(w));
+        }
+    }
+    if(dest != src) memmove(dest + i, src + i, len - i); //odd bytes at the end
+}
+
+
+#ifdef BYTEORDER_SSSE3
+static bool ssse3_supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+
+__attribute__((target("ssse3")))
+static void convert_ssse3(uint8_t *dest, const uint8_t *src, size_t len,
+int order) {
+    const __m128i mask = (order == BYTEORDER_V64)
+        ? _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+        : _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for(; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128((__m128i*)(dest + i + 16), _mm_shuffle_epi8(b, mask));
+        _mm_storeu_si128((__m128i*)(dest + i + 32), _mm_shuffle_epi8(c, mask));
+        _mm_storeu_si128((__m128i*)(dest + i + 48), _mm_shuffle_epi8(d, mask));
+    }
+    convert_scalar(dest + i, src + i, len - i, order);
+}
+#endif //BYTEORDER_SSSE3
+
+
+#ifdef BYTEORDER_NEON
+static void convert_neon(uint8_t *dest, const uint8_t *src, size_t len,
+int order) {
+    size_t i = 0;
+    if(order == BYTEORDER_V64) {
+        for(; i + 16 <= len; i += 16) {
+            vst1q_u8(dest + i, vrev16q_u8(vld1q_u8(src + i)));
+        }
+    }
+    else {
+        for(; i + 16 <= len; i += 16) {
+            vst1q_u8(dest + i, vrev32q_u8(vld1q_u8(src + i)));
+        }
+    }
+    convert_scalar(dest + i, src + i, len - i, order);
+}
+#endif //BYTEORDER_NEON
+
+
+typedef void (*convertFunc)(uint8_t *dest, const uint8_t *src, size_t len,
+    int order);
+static convertFunc convert = convert_scalar;
+static pthread_once_t convertOnce = PTHREAD_ONCE_INIT;
+
+
+static void convert_select() {
+#if defined(BYTEORDER_SSSE3)
+    if(ssse3_supported()) convert = convert_ssse3;
+#elif defined(BYTEORDER_NEON)
+    convert = convert_neon;
+#endif
+}
+
+
+void byteorder_convert(uint8_t *dest, const uint8_t *src, size_t len,
+int order) {
+    /** Convert len bytes between order and big-endian (BYTEORDER_Z64).
+     *  dest may be src, to convert in place. src must start on a word of
+     *  the image; bytes of a partial word at the end are copied as is.
+     */
+    if(order != BYTEORDER_V64 && order != BYTEORDER_N64) {
+        if(dest != src) memmove(dest, src, len);
+        return;
+    }
+    pthread_once(&convertOnce, convert_select);
+    convert(dest, src, len, order);
+}
@@ -0,0 +1,21 @@
+#ifndef _BYTEORDER_H_
+#define _BYTEORDER_H_
+
+#include "64drive.h"
+
+//how the words of a ROM image are laid out in a file
+enum {
+    BYTEORDER_AUTO, //find out from the header
+    BYTEORDER_Z64,  //big-endian, as the N64 sees it
+    BYTEORDER_V64,  //each 16-bit half swapped
+    BYTEORDER_N64,  //each 32-bit word little-endian
+    BYTEORDER_LAST
+};
+
+int byteorder_parse(const char *name);
+const char* byteorder_name(int order);
+int byteorder_detect(const uint8_t *header, size_t len);
+void byteorder_convert(uint8_t *dest, const uint8_t *src, size_t len,
+    int order);
+
+#endif //_BYTEORDER_H_
@@ -0,0 +1,297 @@
+#include "compress.h"
+#include "romend.h"
+
+#define COMPRESS_XZ_BLOCK (4 * 1024 * 1024) //xz block, the unit of threading
+
+/** Compressed dump output: zstd or xz, compressed as the dump comes in.
+ *  The sink thread only feeds the library; the compressing itself is done
+ *  on the library's worker threads (zstd's nbWorkers, xz's multithreaded
+ *  encoder), so a slow level holds up neither the sink nor the transfer
+ *  loop behind it until the library's own queue is full.
+ *  A frame ends at each power of two from ROMEND_MIN, where romend may
+ *  find the ROM ends; the file can then be cut after that frame, and the
+ *  frames before it still decompress, since both formats allow several
+ *  back to back.
+ */
+
+static const char *formatNames[COMPRESS_LAST] = {"none", "zstd", "xz", "auto"};
+
+
+const char* compress_name(int format) {
+    return (format >= 0 && format < COMPRESS_LAST) ? formatNames[format] : "?";
+}
+
+
+static bool supported(int format) {
+    switch(format) {
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: return true;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ: return true;
+#endif
+        case COMPRESS_NONE:
+        case COMPRESS_AUTO: return true;
+        default: return false;
+    }
+}
+
+
+int compress_parse(const char *arg, int *format, int *level) {
+    //"FORMAT[:LEVEL]"; returns 0, or -1 if it's not a format this build has
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    *level = colon ? atoi(colon + 1) : 0;
+    if(colon && *level <= 0) return -1;
+    for(int i=0; i<COMPRESS_LAST; i++) {
+        if(strlen(formatNames[i]) == len
+        && !strncmp(arg, formatNames[i], len)) {
+            *format = i;
+            return supported(i) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+
+int compress_from_name(const char *path) {
+    //COMPRESS_* a dump should use going by its file name
+    size_t len = strlen(path);
+    if(len > 4 && !strcmp(path + len - 4, ".zst")) return COMPRESS_ZSTD;
+    if(len > 3 && !strcmp(path + len - 3, ".xz")) return COMPRESS_XZ;
+    return COMPRESS_NONE;
+}
+
+
+int compress_init(compressor *comp, int format, int level) {
+    /** Set up to compress a dump.
+     *  format: COMPRESS_ZSTD or COMPRESS_XZ.
+     *  level:  Compression level, or 0 for the format's default.
+     *  Returns 0, or -1 if the format or level can't be used.
+     */
+    memset(comp, 0, sizeof(*comp));
+    comp->format = format;
+    comp->level = level;
+#ifdef HAVE_LZMA
+    lzma_stream init = LZMA_STREAM_INIT;
+    comp->xz = init;
+#endif
+    long nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    comp->threads = (nCPUs > 1) ? nCPUs : 1;
+
+    int maxLevel = 0;
+    switch(format) {
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            maxLevel = ZSTD_maxCLevel();
+            comp->zstd = ZSTD_createCCtx();
+            if(!comp->zstd) break;
+            if(level) {
+                ZSTD_CCtx_setParameter(comp->zstd, ZSTD_c_compressionLevel,
+                    level);
+            }
+            ZSTD_CCtx_setParameter(comp->zstd, ZSTD_c_checksumFlag, 1);
+            //a library built without threads compresses on the sink thread
+            if(ZSTD_isError(ZSTD_CCtx_setParameter(comp->zstd,
+            ZSTD_c_nbWorkers, comp->threads))) comp->threads = 0;
+            break;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ:
+            maxLevel = 9;
+            break; //the encoder is started with each frame
+#endif
+        default:
+            fprintf(stderr, "%s output isn't supported by this build\n",
+                compress_name(format));
+            return -1;
+    }
+
+    if(level > maxLevel) {
+        fprintf(stderr, "%s level %d is too high (at most %d)\n",
+            compress_name(format), level, maxLevel);
+        compress_free(comp);
+        return -1;
+    }
+    comp->outBuf = (uint8_t*)malloc(COMPRESS_OUT_SIZE);
+    bool ok = (comp->outBuf != NULL);
+#ifdef HAVE_ZSTD
+    if(format == COMPRESS_ZSTD && !comp->zstd) ok = false;
+#endif
+    if(!ok) {
+        fprintf(stderr, "Can't compress output: out of memory\n");
+        compress_free(comp);
+        return -1;
+    }
+
+    if(verbosity > 0) {
+        printf(" * Compressing dump with %s", compress_name(format));
+        if(comp->threads) {
+            printf(" on %d thread%s", comp->threads,
+                comp->threads == 1 ? "" : "s");
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+
+void compress_free(compressor *comp) {
+#ifdef HAVE_LZMA
+    lzma_end(&comp->xz);
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(comp->zstd);
+    comp->zstd = NULL;
+#endif
+    free(comp->outBuf);
+    comp->outBuf = NULL;
+}
+
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZMA)
+static int fail(compressor *comp, const char *why) {
+    fprintf(stderr, "\nCan't compress %s output: %s\n",
+        compress_name(comp->format), why);
+    return -EIO;
+}
+
+
+static int emit(dumpSink *sink, compressor *comp, uint32_t len) {
+    //write out len bytes of outBuf
+    comp->out += len;
+    return len ? sink_file.write(sink, comp->outBuf, len) : 0;
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static int feed_zstd(dumpSink *sink, compressor *comp, const uint8_t *data,
+uint32_t len, bool end) {
+    ZSTD_inBuffer in = {data, len, 0};
+    while(1) {
+        ZSTD_outBuffer out = {comp->outBuf, COMPRESS_OUT_SIZE, 0};
+        size_t left = ZSTD_compressStream2(comp->zstd, &out, &in,
+            end ? ZSTD_e_end : ZSTD_e_continue);
+        if(ZSTD_isError(left)) return fail(comp, ZSTD_getErrorName(left));
+        int err = emit(sink, comp, out.pos);
+        if(err) return err;
+        if(end ? !left : in.pos == in.size) return 0;
+    }
+}
+#endif
+
+
+#ifdef HAVE_LZMA
+static int feed_xz(dumpSink *sink, compressor *comp, const uint8_t *data,
+uint32_t len, bool end) {
+    if(!comp->open) { //each frame is a whole .xz stream
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = comp->threads;
+        mt.block_size = COMPRESS_XZ_BLOCK;
+        mt.preset = comp->level ? comp->level : LZMA_PRESET_DEFAULT;
+        mt.check = LZMA_CHECK_CRC64;
+        lzma_ret ret = lzma_stream_encoder_mt(&comp->xz, &mt);
+        if(ret != LZMA_OK) {
+            return fail(comp, ret == LZMA_MEM_ERROR ? "out of memory"
+                : "can't start encoder");
+        }
+    }
+
+    comp->xz.next_in = data;
+    comp->xz.avail_in = len;
+    while(1) {
+        comp->xz.next_out = comp->outBuf;
+        comp->xz.avail_out = COMPRESS_OUT_SIZE;
+        lzma_ret ret = lzma_code(&comp->xz, end ? LZMA_FINISH : LZMA_RUN);
+        if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            return fail(comp, ret == LZMA_MEM_ERROR ? "out of memory"
+                : "encoder failed");
+        }
+        int err = emit(sink, comp, COMPRESS_OUT_SIZE - comp->xz.avail_out);
+        if(err) return err;
+        if(end ? ret == LZMA_STREAM_END : !comp->xz.avail_in) return 0;
+    }
+}
+#endif
+
+
+static int feed(dumpSink *sink, compressor *comp, const uint8_t *data,
+uint32_t len, bool end) {
+    //compress len bytes, ending the frame after them if end is set
+    if(!len && !end) return 0;
+    int err = -EINVAL;
+    switch(comp->format) {
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            err = feed_zstd(sink, comp, data, len, end);
+            break;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ:
+            err = feed_xz(sink, comp, data, len, end);
+            break;
+#endif
+        default: //compress_init() wouldn't have allowed it
+            (void)sink;
+            (void)data;
+            break;
+    }
+    if(err) return err;
+
+    comp->in += len;
+    comp->open = !end;
+    if(end && comp->nCuts < COMPRESS_MAX_CUTS) {
+        compressCut *cut = &comp->cuts[comp->nCuts++];
+        cut->in = comp->in;
+        cut->out = comp->out;
+    }
+    return 0;
+}
+
+
+static int compress_write(dumpSink *sink, const uint8_t *data, uint32_t len) {
+    compressor *comp = (compressor*)sink->ctx;
+    while(len > 0) {
+        //end the frame at the next size the ROM could turn out to be
+        int64_t next = ROMEND_MIN;
+        while(next <= comp->in) next *= 2;
+        uint32_t n = len;
+        bool end = (comp->in + n >= next);
+        if(end) n = next - comp->in;
+
+        int err = feed(sink, comp, data, n, end);
+        if(err) return err;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int compress_finish(dumpSink *sink) {
+    compressor *comp = (compressor*)sink->ctx;
+    if(!comp->open || sink->error.load()) return 0;
+    return feed(sink, comp, NULL, 0, true);
+}
+
+const sinkBackend sink_compress = {"compressed", NULL, compress_write,
+    compress_finish};
+
+
+int64_t compress_cut(compressor *comp, int64_t size) {
+    /** Find where to cut off a finished dump so it holds only its first
+     *  size bytes, and forget everything after them.
+     *  Returns the compressed length to keep, or -1 if no frame ends at
+     *  size, leaving the dump as it is.
+     */
+    for(int i=0; i<comp->nCuts; i++) {
+        if(comp->cuts[i].in != size) continue;
+        comp->in = size;
+        comp->out = comp->cuts[i].out;
+        comp->nCuts = i + 1;
+        return comp->out;
+    }
+    return -1;
+}
@@ -0,0 +1,60 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "64drive.h"
+#include "sink.h"
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_OUT_SIZE (256 * 1024) //compressed bytes written at a time
+#define COMPRESS_MAX_CUTS 40 //frame ends kept, one per power of two
+
+enum {
+    COMPRESS_NONE,
+    COMPRESS_ZSTD,
+    COMPRESS_XZ,
+    COMPRESS_AUTO, //by the dump's file name
+    COMPRESS_LAST
+};
+
+//where a frame ends, so the dump can be cut off there
+typedef struct {
+    int64_t in;  //uncompressed bytes before it
+    int64_t out; //compressed bytes before it
+} compressCut;
+
+//compresses a dump on the sink thread as it's written, handing the work
+//to the library's own worker threads
+typedef struct {
+    int format;   //COMPRESS_*
+    int level;    //0 for the format's default
+    int threads;  //worker threads the library was given
+    int64_t in;   //uncompressed bytes taken so far
+    int64_t out;  //compressed bytes written so far
+    bool open;    //a frame has been started and not ended
+    compressCut cuts[COMPRESS_MAX_CUTS];
+    int nCuts;
+    uint8_t *outBuf;
+
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} compressor;
+
+int compress_parse(const char *arg, int *format, int *level);
+int compress_from_name(const char *path);
+const char* compress_name(int format);
+int compress_init(compressor *comp, int format, int level);
+int64_t compress_cut(compressor *comp, int64_t size);
+void compress_free(compressor *comp);
+
+extern const sinkBackend sink_compress;
+
+#endif //_COMPRESS_H_
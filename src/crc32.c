@@ -0,0 +1,264 @@
+#include <pthread.h>
+#include "crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) \
+&& __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/** CRC32 engines, from a byte at a time up to hardware folding.
+ *  The tables are computed by the compiler: entry i of table j is the CRC
+ *  register after byte i followed by j zero bytes, which is what lets
+ *  slice-by-N look up N bytes independently and XOR the results.
+ */
+
+
+constexpr uint32_t crc_shift(uint32_t crc, int bits) {
+    return bits ? crc_shift((crc >> 1) ^ ((crc & 1) ? CRC32_POLY : 0),
+        bits - 1) : crc;
+}
+
+#define CRC_T1(j, i)  crc_shift(i, 8 * ((j) + 1))
+#define CRC_T4(j, i)  CRC_T1(j, i), CRC_T1(j, i + 1), CRC_T1(j, i + 2), \
+    CRC_T1(j, i + 3)
+#define CRC_T16(j, i) CRC_T4(j, i), CRC_T4(j, i + 4), CRC_T4(j, i + 8), \
+    CRC_T4(j, i + 12)
+#define CRC_T64(j, i) CRC_T16(j, i), CRC_T16(j, i + 16), \
+    CRC_T16(j, i + 32), CRC_T16(j, i + 48)
+#define CRC_TABLE(j)  {CRC_T64(j, 0), CRC_T64(j, 64), CRC_T64(j, 128), \
+    CRC_T64(j, 192)}
+
+static constexpr uint32_t crc_table[16][256] = {
+    CRC_TABLE(0),  CRC_TABLE(1),  CRC_TABLE(2),  CRC_TABLE(3),
+    CRC_TABLE(4),  CRC_TABLE(5),  CRC_TABLE(6),  CRC_TABLE(7),
+    CRC_TABLE(8),  CRC_TABLE(9),  CRC_TABLE(10), CRC_TABLE(11),
+    CRC_TABLE(12), CRC_TABLE(13), CRC_TABLE(14), CRC_TABLE(15),
+};
+
+static_assert(crc_table[0][1] == 0x77073096, "bad CRC32 table");
+static_assert(crc_table[15][255] == crc_shift(255, 128), "bad CRC32 table");
+
+
+static inline uint32_t load_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline uint32_t crc_bytes(uint32_t crc, const uint8_t *data,
+size_t len) {
+    //on the inverted register, like the rest of the internals
+    for(size_t i = 0; i < len; i++) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+
+static uint32_t crc_slice16(uint32_t crc, const uint8_t *data, size_t len) {
+    const uint32_t (*t)[256] = crc_table;
+    for(; len >= 16; data += 16, len -= 16) {
+        uint32_t a = crc ^ load_le32(data);
+        crc = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF]
+            ^ t[13][(a >> 16) & 0xFF] ^ t[12][a >> 24]
+            ^ t[11][data[4]] ^ t[10][data[5]] ^ t[9][data[6]] ^ t[8][data[7]]
+            ^ t[7][data[8]]  ^ t[6][data[9]]  ^ t[5][data[10]]
+            ^ t[4][data[11]] ^ t[3][data[12]] ^ t[2][data[13]]
+            ^ t[1][data[14]] ^ t[0][data[15]];
+    }
+    return crc_bytes(crc, data, len);
+}
+
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *data,
+size_t len) {
+    return ~crc_bytes(~crc, data, len);
+}
+
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *data, size_t len) {
+    const uint32_t (*t)[256] = crc_table;
+    crc = ~crc;
+    for(; len >= 8; data += 8, len -= 8) {
+        uint32_t a = crc ^ load_le32(data);
+        crc = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF]
+            ^ t[5][(a >> 16) & 0xFF] ^ t[4][a >> 24]
+            ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    return ~crc_bytes(crc, data, len);
+}
+
+
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t *data,
+size_t len) {
+    return ~crc_slice16(~crc, data, len);
+}
+
+
+#ifdef CRC32_PCLMUL
+static bool pclmul_supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold(uint32_t crc, const uint8_t *data, size_t len) {
+    /** Fold 64 bytes at a time with carry-less multiplies, then reduce.
+     *  From Intel's "Fast CRC Computation for Generic Polynomials Using
+     *  PCLMULQDQ Instruction", with the constants for CRC32_POLY.
+     *  len must be a multiple of 16, and at least 64.
+     */
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    data += 64;
+    len -= 64;
+
+    //four lanes in parallel
+    for(; len >= 64; data += 64, len -= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+            _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+            _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+            _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+            _mm_loadu_si128((const __m128i*)(data + 0x30)));
+    }
+
+    //fold the lanes into one, then any 16 byte blocks left
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    const __m128i lanes[3] = {x2, x3, x4};
+    for(int i = 0; i < 3; i++) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+    }
+    for(; len >= 16; data += 16, len -= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+            _mm_loadu_si128((const __m128i*)data));
+    }
+
+    //128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    //Barrett reduction to 32
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    if(len >= 64) {
+        size_t n = len & ~(size_t)15;
+        crc = crc_fold(crc, data, n);
+        data += n;
+        len -= n;
+    }
+    return ~crc_slice16(crc, data, len);
+}
+#endif //CRC32_PCLMUL
+
+
+#ifdef CRC32_ARMV8
+static bool armv8_supported() {
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    for(; len && ((uintptr_t)data & 7); data++, len--) {
+        crc = __crc32b(crc, *data);
+    }
+    for(; len >= 8; data += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, data, sizeof(v));
+        crc = __crc32d(crc, v);
+    }
+    for(; len; data++, len--) crc = __crc32b(crc, *data);
+    return ~crc;
+}
+#endif //CRC32_ARMV8
+
+
+const crc32Engine crc32_engines[] = {
+    {"bytewise", crc32_bytewise, NULL},
+    {"slice8",   crc32_slice8,   NULL},
+    {"slice16",  crc32_slice16,  NULL},
+#ifdef CRC32_PCLMUL
+    {"pclmul",   crc32_pclmul,   pclmul_supported},
+#endif
+#ifdef CRC32_ARMV8
+    {"armv8",    crc32_armv8,    armv8_supported},
+#endif
+    {NULL, NULL, NULL}
+};
+
+static const crc32Engine *engine = NULL;
+static pthread_once_t engineOnce = PTHREAD_ONCE_INIT;
+
+
+static void crc32_select() {
+    //the last engine this CPU can run, since they're listed slowest first
+    for(int i = 0; crc32_engines[i].name; i++) {
+        const crc32Engine *e = &crc32_engines[i];
+        if(!e->supported || e->supported()) engine = e;
+    }
+    if(verbosity > 1) printf(" * CRC32 engine: %s\n", engine->name);
+}
+
+
+const crc32Engine* crc32_engine() {
+    pthread_once(&engineOnce, crc32_select);
+    return engine;
+}
+
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    //continue a CRC32 of earlier data (0 for none) over more data
+    return crc32_engine()->update(crc, data, len);
+}
+
+
+uint32_t crc32(const uint8_t *data, size_t len) {
+    return crc32_update(0, data, len);
+}
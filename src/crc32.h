@@ -0,0 +1,22 @@
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include "64drive.h"
+
+#define CRC32_POLY 0xEDB88320 //reflected, as used by zlib and n64crc
+
+typedef uint32_t (*crc32Func)(uint32_t crc, const uint8_t *data, size_t len);
+
+//one way of computing the CRC32, which crc32_update() picks the fastest
+//of for this CPU the first time it's called
+typedef struct {
+    const char *name;
+    crc32Func update; //same as crc32_update()
+    bool (*supported)(); //NULL if it runs everywhere
+} crc32Engine;
+
+extern const crc32Engine crc32_engines[]; //slowest first, NULL terminated
+
+const crc32Engine* crc32_engine();
+
+#endif //_CRC32_H_
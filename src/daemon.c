@@ -0,0 +1,319 @@
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "delta.h"
+#include "sparse.h"
+
+static volatile sig_atomic_t quit = 0;
+
+
+static void on_signal(int sig) {
+    (void)sig;
+    quit = 1;
+}
+
+
+int daemon_socket_path(char *buf, size_t len) {
+    //default socket path: $XDG_RUNTIME_DIR/64drive.sock
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+    if(dir && dir[0]) n = snprintf(buf, len, "%s/64drive.sock", dir);
+    else n = snprintf(buf, len, "/tmp/64drive-%d.sock", (int)getuid());
+    return (n < 0 || n >= (int)len) ? -1 : 0;
+}
+
+
+static int make_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+
+static int send_msg(int sock, const void *data, size_t len, const int *fds,
+int nFds) {
+    struct iovec iov = {(void*)data, len};
+    struct msghdr msg;
+    char control[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(nFds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nFds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nFds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nFds * sizeof(int));
+    }
+
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    return (n == (ssize_t)len) ? 0 : -1;
+}
+
+
+static int recv_msg(int sock, void *data, size_t len, int *fds, int *nFds) {
+    //receive exactly len bytes, and up to DAEMON_MAX_FDS fds sent with them
+    struct iovec iov = {data, len};
+    struct msghdr msg;
+    char control[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if(nFds) *nFds = 0;
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int*)CMSG_DATA(cmsg);
+        for(int i=0; i<count; i++) {
+            if(fds && nFds && *nFds < DAEMON_MAX_FDS) {
+                fds[(*nFds)++] = received[i];
+            }
+            else close(received[i]);
+        }
+    }
+    return (n == (ssize_t)len) ? 0 : -1;
+}
+
+
+static int handle_request(sixtyfourDrive *device, daemonRequest *req,
+int *fds, int nFds, bool *ready, daemonResponse *resp) {
+    /** Run one client request with our stdout/stderr pointed at the
+     *  client's, so it sees the same messages as a local run.
+     */
+    fflush(stdout);
+    fflush(stderr);
+    int savedOut = dup(STDOUT_FILENO), savedErr = dup(STDERR_FILENO);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    int savedVerbosity = verbosity;
+    transferOptions savedOpts = transfer_opts;
+    verbosity = req->verbosity;
+    transfer_opts = req->opts;
+    transfer_digest = &resp->digest;
+
+    int result = 0;
+    if(!*ready) { //bring the device back after losing it
+        shutdown_device(device);
+        if(setup_device(device) == EXIT_SUCCESS) *ready = true;
+        else result = -ENODEV;
+    }
+
+    FILE *file = NULL, *journal = NULL, *map = NULL;
+    bool needFile = (req->op == DAEMON_OP_UPLOAD
+        || req->op == DAEMON_OP_DOWNLOAD);
+    //these index tables and size buffers, so don't trust them
+    if(!result && ((needFile && (req->bank <= BANK_INVALID
+    || req->bank >= BANK_LAST)) || (req->op == DAEMON_OP_SETCIC
+    && (req->arg < 0 || req->arg >= CIC_LAST)))) {
+        fprintf(stderr, "Daemon: bad %s in request\n",
+            needFile ? "bank" : "CIC");
+        result = -EINVAL;
+    }
+    if(!result && transfer_check_opts(&req->opts)) result = -EINVAL;
+    if(!result && req->op == DAEMON_OP_DOWNLOAD && nFds > 3) {
+        int fd = dup(fds[3]);
+        if(req->opts.sparse == SPARSE_FF) {
+            if(fd >= 0 && !(map = fdopen(fd, "w"))) close(fd);
+        }
+        else if(fd >= 0 && !(journal = fdopen(fd, "r+"))) close(fd);
+        if(!journal && !map) {
+            fprintf(stderr, "Daemon: can't use %s: %s\n",
+                (req->opts.sparse == SPARSE_FF) ? "0xFF map" : "journal",
+                strerror(errno));
+            result = -EPROTO;
+        }
+    }
+    if(!result && needFile) {
+        int fd = (nFds > 2) ? dup(fds[2]) : -1;
+        if(fd >= 0) {
+            file = fdopen(fd, req->op == DAEMON_OP_UPLOAD ? "rb"
+                : journal ? "r+b" : "wb");
+        }
+        if(!file) {
+            fprintf(stderr, "Daemon: no file received\n");
+            if(fd >= 0) close(fd);
+            result = -EPROTO;
+        }
+    }
+
+    if(!result) switch(req->op) {
+        case DAEMON_OP_INFO:
+            result = (device_get_version(device) > 0) ? 0 : -1;
+            break;
+
+        case DAEMON_OP_SETCIC:
+            result = (device_set_cic(device, req->arg) > 0) ? 0 : -1;
+            break;
+
+        case DAEMON_OP_UPLOAD:
+            result = load_file(device, file, req->size, req->offset,
+                req->bank, req->arg);
+            break;
+
+        case DAEMON_OP_DOWNLOAD:
+            result = device_download(device, file, req->size, req->offset,
+                req->bank, req->arg, journal, map);
+            break;
+
+        case DAEMON_OP_FORGET:
+            result = delta_forget(device);
+            break;
+    }
+    if(file) fclose(file);
+    if(journal) fclose(journal);
+    if(map) fclose(map);
+
+    if(result && *ready && device_get_version(device) <= 0) {
+        fprintf(stderr, " ! Lost contact with 64drive; "
+            "will reconnect on the next request\n");
+        *ready = false;
+    }
+    resp->version = device->version;
+    memcpy(resp->variant, device->variant, sizeof(resp->variant));
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(savedOut, STDOUT_FILENO);
+    dup2(savedErr, STDERR_FILENO);
+    close(savedOut);
+    close(savedErr);
+    verbosity = savedVerbosity;
+    transfer_opts = savedOpts;
+    transfer_digest = NULL;
+    return result;
+}
+
+
+static void serve_client(sixtyfourDrive *device, int sock, bool *ready) {
+    //handle requests until the client disconnects
+    daemonRequest req;
+    int fds[DAEMON_MAX_FDS], nFds;
+    while(!quit && recv_msg(sock, &req, sizeof(req), fds, &nFds) == 0) {
+        daemonResponse resp;
+        memset(&resp, 0, sizeof(resp));
+        if(req.magic != DAEMON_MAGIC || req.op >= DAEMON_OP_LAST
+        || nFds < 2) {
+            resp.result = -EPROTO;
+        }
+        else {
+            if(verbosity > 0) printf(" * Client request %u\n", req.op);
+            resp.result = handle_request(device, &req, fds, nFds, ready,
+                &resp);
+        }
+        for(int i=0; i<nFds; i++) close(fds[i]);
+        if(send_msg(sock, &resp, sizeof(resp), NULL, 0)) break;
+    }
+}
+
+
+int daemon_run(sixtyfourDrive *device, const char *path) {
+    /** Serve requests for an already set up device on a Unix socket
+     *  at path, until interrupted. Clients are served one at a time.
+     */
+    struct sockaddr_un addr;
+    if(make_addr(&addr, path)) return EXIT_FAILURE;
+
+    int other = daemon_connect(path);
+    if(other >= 0) {
+        close(other);
+        fprintf(stderr, "A 64drive daemon is already running on %s\n", path);
+        return EXIT_FAILURE;
+    }
+    unlink(path); //stale socket
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr))
+    || chmod(path, 0600) || listen(sock, 4)) {
+        fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+        if(sock >= 0) close(sock);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; //no SA_RESTART, so accept() returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(verbosity >= 0) printf(" * Daemon listening on %s\n", path);
+    fflush(stdout);
+
+    bool ready = true;
+    while(!quit) {
+        int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if(client < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            break;
+        }
+        serve_client(device, client, &ready);
+        close(client);
+    }
+
+    if(verbosity >= 0) printf(" * Daemon shutting down\n");
+    close(sock);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+
+int daemon_connect(const char *path) {
+    //connect to a running daemon; returns the socket or -1
+    struct sockaddr_un addr;
+    if(make_addr(&addr, path)) return -1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0) return -1;
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+int daemon_call(int sock, daemonRequest *req, int fileFd, int sideFd,
+daemonResponse *resp) {
+    /** Send a request to the daemon and wait for it to finish.
+     *  fileFd:    File to up/download, or -1.
+     *  sideFd:    Journal for a resumable download, 0xFF map for one
+     *             with 0xFF left out, or -1.
+     *  Returns the request's result.
+     */
+    int fds[DAEMON_MAX_FDS] = {STDOUT_FILENO, STDERR_FILENO, fileFd,
+        sideFd};
+    int nFds = (sideFd >= 0) ? 4 : (fileFd >= 0) ? 3 : 2;
+    fflush(stdout);
+    fflush(stderr);
+
+    req->magic = DAEMON_MAGIC;
+    if(send_msg(sock, req, sizeof(*req), fds, nFds)
+    || recv_msg(sock, resp, sizeof(*resp), NULL, NULL)) {
+        fprintf(stderr, "Lost connection to 64drive daemon\n");
+        return -1;
+    }
+    if(resp->result == -EPROTO) {
+        fprintf(stderr, "64drive daemon rejected request "
+            "(different version?)\n");
+    }
+    return resp->result;
+}
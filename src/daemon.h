@@ -0,0 +1,47 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include "64drive.h"
+#include "transfer.h"
+
+#define DAEMON_MAGIC 0x36344442 //"64DB", bump when the protocol changes
+
+enum {
+    DAEMON_OP_INFO,
+    DAEMON_OP_SETCIC,
+    DAEMON_OP_UPLOAD,
+    DAEMON_OP_DOWNLOAD,
+    DAEMON_OP_FORGET,
+    DAEMON_OP_LAST
+};
+
+#define DAEMON_MAX_FDS 4
+
+//sent by the client along with its stdout, stderr and (for up/downloads)
+//the file and (for resumable downloads) the journal or (for downloads with
+//0xFF left out, which can't be resumed) the 0xFF map, as SCM_RIGHTS
+typedef struct {
+    uint32_t magic;
+    uint32_t op;
+    int32_t verbosity;
+    int32_t bank;
+    int64_t size;
+    uint32_t offset;
+    int32_t arg; //CIC for SETCIC, auto CIC for UPLOAD, standalone for DOWNLOAD
+    transferOptions opts;
+} daemonRequest;
+
+typedef struct {
+    int32_t result;
+    int32_t version;
+    char variant[3];
+    digestResult digest; //of the file up/downloaded, if asked for
+} daemonResponse;
+
+int daemon_socket_path(char *buf, size_t len);
+int daemon_run(sixtyfourDrive *device, const char *path);
+int daemon_connect(const char *path);
+int daemon_call(int sock, daemonRequest *req, int fileFd, int sideFd,
+    daemonResponse *resp);
+
+#endif //_DAEMON_H_
@@ -0,0 +1,501 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "decompress.h"
+
+/** Compressed inputs: gzip, xz, zstd, or the first file in a zip.
+ *  The decompressor sits behind a stdio stream (fopencookie), so the
+ *  upload's reader thread decompresses as it reads chunks, the same as it
+ *  would read a pipe. Which formats work depends on the libraries the
+ *  build found (HAVE_ZLIB, HAVE_LZMA, HAVE_ZSTD); zip needs zlib for
+ *  anything but stored files.
+ */
+
+static const char *formatNames[DECOMP_LAST] = {
+    "uncompressed", "gzip", "xz", "zstd", "zip"};
+
+
+const char* decomp_name(int format) {
+    return (format >= 0 && format < DECOMP_LAST) ? formatNames[format] : "?";
+}
+
+
+static inline uint32_t load_le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+
+static inline uint32_t load_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static int detect(const uint8_t *magic, size_t len) {
+    if(len >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) return DECOMP_GZIP;
+    if(len >= 6 && !memcmp(magic, "\xFD" "7zXZ", 6)) return DECOMP_XZ;
+    if(len >= 4 && !memcmp(magic, "\x28\xB5\x2F\xFD", 4)) return DECOMP_ZSTD;
+    if(len >= 4 && !memcmp(magic, "PK\x03\x04", 4)) return DECOMP_ZIP;
+    return DECOMP_NONE;
+}
+
+
+static int fail(decompressor *dc, const char *why) {
+    fprintf(stderr, "Can't decompress %s input: %s\n",
+        decomp_name(dc->format), why);
+    return -1;
+}
+
+
+static int64_t gzip_size(int fd, off_t start, off_t end) {
+    //the members' sizes added up; each trailer only has its own member's,
+    //mod 4G, so they're decompressed once here to count them
+#ifdef HAVE_ZLIB
+    if(end <= start || end - start > UINT32_MAX) return -1;
+    void *map = mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) return -1;
+    const uint8_t *data = (const uint8_t*)map;
+    uint8_t *out = (uint8_t*)malloc(DECOMP_IN_SIZE);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int64_t size = -1;
+    if(out && inflateInit2(&zs, 16 + MAX_WBITS) == Z_OK) {
+        zs.next_in = (Bytef*)data + start;
+        zs.avail_in = end - start;
+        size = 0;
+        while(size >= 0) {
+            zs.next_out = out;
+            zs.avail_out = DECOMP_IN_SIZE;
+            int err = inflate(&zs, Z_NO_FLUSH);
+            size += DECOMP_IN_SIZE - zs.avail_out;
+            if(err == Z_STREAM_END) {
+                //done, unless another member follows
+                if(!zs.avail_in) break;
+                if(zs.avail_in < 2 || zs.next_in[0] != 0x1F
+                || zs.next_in[1] != 0x8B) size = -1;
+                else inflateReset(&zs);
+            }
+            else if(err != Z_OK || (!zs.avail_in && zs.avail_out)) {
+                size = -1; //bad or truncated; the decoder will say so
+            }
+        }
+        inflateEnd(&zs);
+    }
+    free(out);
+    munmap(map, end);
+    return size;
+#else
+    (void)fd;
+    (void)start;
+    (void)end;
+    return -1;
+#endif
+}
+
+
+static int64_t xz_size(int fd, off_t end) {
+    //from the index before the stream footer
+#ifdef HAVE_LZMA
+    uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+    lzma_stream_flags flags;
+    if(end < 2 * LZMA_STREAM_HEADER_SIZE
+    || pread(fd, footer, sizeof(footer), end - sizeof(footer))
+    != sizeof(footer)
+    || lzma_stream_footer_decode(&flags, footer) != LZMA_OK
+    || flags.backward_size > (uint64_t)end - sizeof(footer)) return -1;
+
+    size_t len = flags.backward_size;
+    uint8_t *buf = (uint8_t*)malloc(len);
+    int64_t size = -1;
+    lzma_index *index = NULL;
+    uint64_t memLimit = UINT64_MAX;
+    size_t pos = 0;
+    if(buf && pread(fd, buf, len, end - sizeof(footer) - len) == (ssize_t)len
+    && lzma_index_buffer_decode(&index, &memLimit, NULL, buf, &pos, len)
+    == LZMA_OK) {
+        size = lzma_index_uncompressed_size(index);
+        lzma_index_end(index, NULL);
+    }
+    free(buf);
+    return size;
+#else
+    (void)fd;
+    (void)end;
+    return -1;
+#endif
+}
+
+
+static int64_t zstd_size(int fd, off_t start, off_t end) {
+    //the content sizes in the frame headers, if they all have one
+#ifdef HAVE_ZSTD
+    void *map = mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) return -1;
+    int64_t size = 0;
+    for(off_t pos = start; pos < end && size >= 0;) {
+        const uint8_t *frame = (const uint8_t*)map + pos;
+        unsigned long long n = ZSTD_getFrameContentSize(frame, end - pos);
+        size_t frameLen = ZSTD_findFrameCompressedSize(frame, end - pos);
+        if(n == ZSTD_CONTENTSIZE_UNKNOWN || n == ZSTD_CONTENTSIZE_ERROR
+        || ZSTD_isError(frameLen)) size = -1;
+        else {
+            size += n;
+            pos += frameLen;
+        }
+    }
+    munmap(map, end);
+    return size;
+#else
+    (void)fd;
+    (void)start;
+    (void)end;
+    return -1;
+#endif
+}
+
+
+static int zip_central(int fd, off_t end, int64_t *compSize,
+int64_t *size) {
+    //sizes of the first file, from the central directory
+    uint8_t buf[0x10000 + 22];
+    off_t from = (end > (off_t)sizeof(buf)) ? end - sizeof(buf) : 0;
+    ssize_t len = pread(fd, buf, end - from, from);
+    if(len < 22) return -1;
+    for(ssize_t i = len - 22; i >= 0; i--) { //end of central directory
+        if(load_le32(buf + i) != 0x06054B50) continue;
+        uint8_t entry[46];
+        if(pread(fd, entry, sizeof(entry), load_le32(buf + i + 16))
+        != sizeof(entry) || load_le32(entry) != 0x02014B50) return -1;
+        *compSize = load_le32(entry + 20);
+        *size = load_le32(entry + 24);
+        return 0;
+    }
+    return -1;
+}
+
+
+static void fill(decompressor *dc) {
+    //read more input once what's buffered is used up
+    if(dc->inPos < dc->inLen || dc->inEnd) return;
+    size_t want = DECOMP_IN_SIZE;
+    if(dc->format == DECOMP_ZIP && (int64_t)want > dc->left) want = dc->left;
+    dc->inLen = want ? fread(dc->inBuf, 1, want, dc->in) : 0;
+    dc->inPos = 0;
+    if(dc->format == DECOMP_ZIP) dc->left -= dc->inLen;
+    if(dc->inLen < want || (dc->format == DECOMP_ZIP && !dc->left)) {
+        dc->inEnd = true;
+    }
+}
+
+
+static int take(decompressor *dc, uint8_t *dest, uint32_t len) {
+    //copy the next len bytes of input, for parsing headers
+    while(len > 0) {
+        fill(dc);
+        uint32_t n = dc->inLen - dc->inPos;
+        if(!n) return -1;
+        if(n > len) n = len;
+        memcpy(dest, dc->inBuf + dc->inPos, n);
+        dc->inPos += n;
+        dest += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int zip_begin(decompressor *dc, int fd, off_t end, bool regular,
+int *method) {
+    //read the first local file header, leaving the input at its data
+    uint8_t header[30], skip[256];
+    dc->left = INT64_MAX; //until the header says
+    if(take(dc, header, sizeof(header))) return fail(dc, "truncated header");
+    uint32_t flags = load_le16(header + 6);
+    *method = load_le16(header + 8);
+    int64_t compSize = load_le32(header + 18);
+    dc->size = load_le32(header + 22);
+    if(flags & 1) return fail(dc, "encrypted");
+    if(flags & 8) { //sizes follow the data, so look in the central directory
+        dc->size = compSize = -1;
+        if(regular) zip_central(fd, end, &compSize, &dc->size);
+    }
+    for(uint32_t n = load_le16(header + 26) + load_le16(header + 28); n;) {
+        uint32_t len = (n > sizeof(skip)) ? sizeof(skip) : n;
+        if(take(dc, skip, len)) return fail(dc, "truncated header");
+        n -= len;
+    }
+    if(compSize < 0) {
+        if(*method == 0) return fail(dc, "stored file of unknown size");
+        return 0; //ends where the deflate stream does
+    }
+
+    //keep the rest of the archive out of the decompressor
+    uint32_t buffered = dc->inLen - dc->inPos;
+    if(buffered >= compSize) {
+        dc->inLen = dc->inPos + compSize;
+        dc->left = 0;
+        dc->inEnd = true;
+    }
+    else dc->left = compSize - buffered;
+    return 0;
+}
+
+
+static int step(decompressor *dc, const uint8_t *in, size_t inLen,
+uint8_t *out, size_t outLen, size_t *used, size_t *made) {
+    /** Decompress some of in into out.
+     *  Returns 1 at the end of the data, 0 if there may be more, or -1 on
+     *  error.
+     */
+    bool last = dc->inEnd; //in is all the input there is
+    if(dc->between && !inLen && last) return 1;
+    if(inLen) dc->between = false;
+    switch(dc->format) {
+        case DECOMP_NONE:
+        stored: {
+            size_t n = (inLen < outLen) ? inLen : outLen;
+            memcpy(out, in, n);
+            *used = *made = n;
+            return (last && n == inLen) ? 1 : 0;
+        }
+
+#ifdef HAVE_ZLIB
+        case DECOMP_GZIP:
+        case DECOMP_ZIP: {
+            if(dc->format == DECOMP_ZIP && !dc->zs.state) goto stored;
+            dc->zs.next_in = (Bytef*)in;
+            dc->zs.avail_in = inLen;
+            dc->zs.next_out = out;
+            dc->zs.avail_out = outLen;
+            int err = inflate(&dc->zs, Z_NO_FLUSH);
+            *used = inLen - dc->zs.avail_in;
+            *made = outLen - dc->zs.avail_out;
+            if(err == Z_STREAM_END) {
+                //another gzip member may follow
+                if(dc->format == DECOMP_ZIP) return 1;
+                inflateReset(&dc->zs);
+                dc->between = true;
+                return (last && *used == inLen) ? 1 : 0;
+            }
+            if(err == Z_OK || err == Z_BUF_ERROR) return 0;
+            return fail(dc, dc->zs.msg ? dc->zs.msg : "bad data");
+        }
+#else
+        case DECOMP_ZIP:
+            goto stored;
+#endif
+
+#ifdef HAVE_LZMA
+        case DECOMP_XZ: {
+            dc->xz.next_in = in;
+            dc->xz.avail_in = inLen;
+            dc->xz.next_out = out;
+            dc->xz.avail_out = outLen;
+            lzma_ret err = lzma_code(&dc->xz, last ? LZMA_FINISH : LZMA_RUN);
+            *used = inLen - dc->xz.avail_in;
+            *made = outLen - dc->xz.avail_out;
+            if(err == LZMA_STREAM_END) return 1;
+            if(err == LZMA_OK || err == LZMA_BUF_ERROR) return 0;
+            return fail(dc, err == LZMA_MEM_ERROR ? "out of memory"
+                : "bad data");
+        }
+#endif
+
+#ifdef HAVE_ZSTD
+        case DECOMP_ZSTD: {
+            ZSTD_inBuffer ib = {in, inLen, 0};
+            ZSTD_outBuffer ob = {out, outLen, 0};
+            size_t err = ZSTD_decompressStream(dc->zstd, &ob, &ib);
+            *used = ib.pos;
+            *made = ob.pos;
+            if(ZSTD_isError(err)) return fail(dc, ZSTD_getErrorName(err));
+            if(err) return 0;
+            //a frame just ended; others may follow
+            dc->between = true;
+            return (last && ib.pos == inLen) ? 1 : 0;
+        }
+#endif
+
+        default:
+            return fail(dc, "not supported by this build");
+    }
+}
+
+
+static ssize_t decode(decompressor *dc, uint8_t *out, size_t len) {
+    //decompress up to len bytes; short only at the end of the data
+    size_t done = 0;
+    while(done < len && !dc->outEnd) {
+        fill(dc);
+        if(ferror(dc->in)) return fail(dc, strerror(errno));
+        size_t avail = dc->inLen - dc->inPos, used = 0, made = 0;
+        int end = step(dc, dc->inBuf + dc->inPos, avail, out + done,
+            len - done, &used, &made);
+        if(end < 0) return -1;
+        dc->inPos += used;
+        done += made;
+        if(end) dc->outEnd = true;
+        else if(!used && !made && dc->inEnd && dc->inPos == dc->inLen) {
+            return fail(dc, "data ends early");
+        }
+    }
+    return done;
+}
+
+
+static void decomp_free(decompressor *dc) {
+#ifdef HAVE_ZLIB
+    if(dc->zs.state) inflateEnd(&dc->zs);
+#endif
+#ifdef HAVE_LZMA
+    lzma_end(&dc->xz);
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(dc->zstd);
+    dc->zstd = NULL;
+#endif
+    free(dc->inBuf);
+    dc->inBuf = NULL;
+}
+
+
+static ssize_t cookie_read(void *cookie, char *buf, size_t size) {
+    decompressor *dc = (decompressor*)cookie;
+    size_t n = dc->headLen - dc->headPos;
+    if(n > size) n = size;
+    memcpy(buf, dc->head + dc->headPos, n);
+    dc->headPos += n;
+    if(n == size) return n;
+
+    ssize_t more = decode(dc, (uint8_t*)buf + n, size - n);
+    if(more < 0) {
+        errno = EIO;
+        return n ? (ssize_t)n : -1;
+    }
+    return n + more;
+}
+
+
+static int cookie_close(void *cookie) {
+    decomp_free((decompressor*)cookie);
+    return 0;
+}
+
+
+FILE* decomp_open(decompressor *dc, FILE *in) {
+    /** Get the contents of a possibly compressed file.
+     *  in: File to read, from its current position.
+     *  Returns in itself if it's a regular file that isn't compressed, so
+     *  it can still be mapped, or else a stream to read the decompressed
+     *  data from and fclose() when done, or NULL on error. dc->size is set
+     *  if the container says how big the data is, and the first
+     *  DECOMP_HEAD bytes are decompressed now, into dc->head.
+     */
+    memset(dc, 0, sizeof(*dc));
+    dc->in = in;
+    dc->size = -1;
+#ifdef HAVE_LZMA
+    lzma_stream init = LZMA_STREAM_INIT;
+    dc->xz = init;
+#endif
+
+    int fd = fileno(in);
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    bool regular = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    off_t start = regular ? ftell(in) : 0;
+    if(start < 0) start = 0;
+    if(regular) {
+        uint8_t magic[6];
+        ssize_t n = pread(fd, magic, sizeof(magic), start);
+        dc->format = detect(magic, n > 0 ? n : 0);
+        if(dc->format == DECOMP_NONE) return in;
+        switch(dc->format) {
+            case DECOMP_GZIP:
+                dc->size = gzip_size(fd, start, st.st_size);
+                break;
+            case DECOMP_XZ:   dc->size = xz_size(fd, st.st_size); break;
+            case DECOMP_ZSTD:
+                dc->size = zstd_size(fd, start, st.st_size);
+                break;
+        }
+    }
+
+    dc->inBuf = (uint8_t*)malloc(DECOMP_IN_SIZE);
+    if(!dc->inBuf) {
+        fprintf(stderr, "Can't decompress input: out of memory\n");
+        return NULL;
+    }
+    if(!regular) { //a pipe; what's read to find out the format is kept
+        fill(dc);
+        dc->format = detect(dc->inBuf, dc->inLen);
+    }
+
+    int err = 0, method = 0;
+    switch(dc->format) {
+        case DECOMP_NONE:
+            break;
+
+#ifdef HAVE_ZLIB
+        case DECOMP_GZIP:
+            if(inflateInit2(&dc->zs, 16 + MAX_WBITS) != Z_OK) err = -1;
+            break;
+#endif
+
+        case DECOMP_ZIP:
+            err = zip_begin(dc, fd, st.st_size, regular, &method);
+            if(err || method == 0) break; //stored
+#ifdef HAVE_ZLIB
+            if(method == 8) { //deflate
+                if(inflateInit2(&dc->zs, -MAX_WBITS) != Z_OK) err = -1;
+                break;
+            }
+#endif
+            err = fail(dc, "compression method not supported");
+            break;
+
+#ifdef HAVE_LZMA
+        case DECOMP_XZ:
+            if(lzma_stream_decoder(&dc->xz, UINT64_MAX, LZMA_CONCATENATED)
+            != LZMA_OK) err = -1;
+            break;
+#endif
+
+#ifdef HAVE_ZSTD
+        case DECOMP_ZSTD:
+            dc->zstd = ZSTD_createDStream();
+            if(!dc->zstd) err = -1;
+            //a pipe only has the first frame's header to go on
+            if(!regular && dc->size < 0) {
+                unsigned long long size = ZSTD_getFrameContentSize(
+                    dc->inBuf, dc->inLen);
+                if(size != ZSTD_CONTENTSIZE_UNKNOWN
+                && size != ZSTD_CONTENTSIZE_ERROR) dc->size = size;
+            }
+            break;
+#endif
+
+        default:
+            err = fail(dc, "not supported by this build");
+            break;
+    }
+
+    ssize_t n = err ? -1 : decode(dc, dc->head, sizeof(dc->head));
+    if(n < 0) {
+        decomp_free(dc);
+        return NULL;
+    }
+    dc->headLen = n;
+
+    static const cookie_io_functions_t io = {
+        cookie_read, NULL, NULL, cookie_close};
+    FILE *file = fopencookie(dc, "rb", io);
+    if(!file) {
+        decomp_free(dc);
+        return NULL;
+    }
+    if(verbosity > 0 && dc->format != DECOMP_NONE) {
+        printf(" * Decompressing %s input", decomp_name(dc->format));
+        if(dc->size >= 0) printf(" (%" PRId64 " Kbytes)", dc->size / 1024);
+        printf("\n");
+    }
+    return file;
+}
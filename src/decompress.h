@@ -0,0 +1,57 @@
+#ifndef _DECOMPRESS_H_
+#define _DECOMPRESS_H_
+
+#include "64drive.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DECOMP_IN_SIZE (256 * 1024) //compressed bytes read at a time
+#define DECOMP_HEAD    0x1000 //decompressed up front, for the header and CIC
+
+enum {
+    DECOMP_NONE,
+    DECOMP_GZIP,
+    DECOMP_XZ,
+    DECOMP_ZSTD,
+    DECOMP_ZIP,
+    DECOMP_LAST
+};
+
+//turns a compressed file into a stream of what's in it, decompressed as
+//it's read, so it can be uploaded without unpacking it anywhere first
+typedef struct {
+    int format;   //DECOMP_*
+    FILE *in;     //the compressed file
+    int64_t size; //decompressed size from the container, or -1 if unknown
+    int64_t left; //compressed bytes of a zip entry not yet read
+    bool inEnd;   //all of the input has been read
+    bool outEnd;  //all of the output has been given out
+    bool between; //at the end of a gzip member or zstd frame
+    uint8_t *inBuf;
+    uint32_t inLen, inPos;
+
+    uint8_t head[DECOMP_HEAD]; //first bytes decompressed
+    uint32_t headLen, headPos; //bytes in head, and given out so far
+
+#ifdef HAVE_ZLIB
+    z_stream zs;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+} decompressor;
+
+FILE* decomp_open(decompressor *dc, FILE *in);
+const char* decomp_name(int format);
+
+#endif //_DECOMPRESS_H_
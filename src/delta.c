@@ -0,0 +1,440 @@
+#include <ctype.h>
+#include "delta.h"
+#include "n64crc.h"
+#include "paths.h"
+#include "transport.h"
+
+/** The manifest is a text file per device in the cache directory:
+ *    region BANK OFFSET SIZE BLOCKSIZE NBLOCKS
+ *    probe POS SHA1      (DELTA_PROBES times)
+ *    SHA1                (NBLOCKS times)
+ *  for each place we've uploaded to.
+ *  With transfer_opts.fineDelta, a copy of the last ROM upload is kept
+ *  beside it too, so changed blocks can be narrowed down to the windows
+ *  within them that differ.
+ */
+
+
+static int manifest_path(sixtyfourDrive *device, char *buf, size_t len) {
+    //without a serial number we can't tell devices apart
+    if(!device->serial[0]) return -1;
+    char name[128];
+    snprintf(name, sizeof(name), "delta-%s", device->serial);
+    for(char *c = name; *c; c++) {
+        if(!isalnum((unsigned char)*c) && *c != '-') *c = '_';
+    }
+    return user_file_path(buf, len, true, name);
+}
+
+
+static int parse_hash(const char *hex, uint8_t *out) {
+    for(int i=0; i<SHA1_SIZE; i++) {
+        unsigned byte;
+        if(!isxdigit((unsigned char)hex[i*2])
+        || !isxdigit((unsigned char)hex[i*2+1])
+        || sscanf(&hex[i*2], "%2x", &byte) != 1) return -1;
+        out[i] = byte;
+    }
+    return hex[SHA1_SIZE * 2] ? -1 : 0;
+}
+
+
+static void write_hash(FILE *file, const uint8_t *hash) {
+    for(int i=0; i<SHA1_SIZE; i++) fprintf(file, "%02x", hash[i]);
+}
+
+
+static int64_t padded(int64_t size) {
+    return (size + 511) & ~511;
+}
+
+
+static bool overlaps(deltaRegion *a, deltaRegion *b) {
+    return a->bank == b->bank
+        && a->offset < b->offset + padded(b->size)
+        && b->offset < a->offset + padded(a->size);
+}
+
+
+static void load_manifest(deltaPlan *plan) {
+    FILE *file = fopen(plan->path, "r");
+    if(!file) return;
+
+    char line[256];
+    deltaRegion *r = NULL;
+    uint32_t nHashes = 0;
+    int nProbes = 0, cap = 0;
+    while(1) {
+        bool eof = !fgets(line, sizeof(line), file);
+        int bank;
+        unsigned offset, blockSize, nBlocks, pos;
+        long long size;
+        char hex[64];
+        bool header = !eof && sscanf(line, "region %d %u %lld %u %u",
+            &bank, &offset, &size, &blockSize, &nBlocks) == 5;
+
+        if((eof || header) && r
+        && (nHashes != r->nBlocks || nProbes != DELTA_PROBES)) {
+            free(r->hashes); //truncated; forget it
+            plan->nRegions--;
+        }
+        if(eof) break;
+        if(line[0] == '#') continue;
+
+        if(header) {
+            r = NULL;
+            if(blockSize != DELTA_BLOCK_SIZE || size <= 0
+            || nBlocks != (size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE) {
+                continue;
+            }
+            if(plan->nRegions == cap) {
+                cap = cap ? cap * 2 : 8;
+                deltaRegion *regions = (deltaRegion*)realloc(plan->regions,
+                    cap * sizeof(deltaRegion));
+                if(!regions) break;
+                plan->regions = regions;
+            }
+            r = &plan->regions[plan->nRegions];
+            memset(r, 0, sizeof(*r));
+            r->bank = bank;
+            r->offset = offset;
+            r->size = size;
+            r->nBlocks = nBlocks;
+            r->hashes = (uint8_t*)malloc(nBlocks * SHA1_SIZE);
+            if(!r->hashes) {
+                r = NULL;
+                continue;
+            }
+            plan->nRegions++;
+            nHashes = 0;
+            nProbes = 0;
+        }
+        else if(!r) continue;
+        else if(sscanf(line, "probe %u %63s", &pos, hex) == 2) {
+            if(nProbes < DELTA_PROBES
+            && !parse_hash(hex, r->probeHash[nProbes])) {
+                r->probePos[nProbes++] = pos;
+            }
+        }
+        else if(sscanf(line, "%63s", hex) == 1 && nHashes < r->nBlocks
+        && !parse_hash(hex, &r->hashes[nHashes * SHA1_SIZE])) {
+            nHashes++;
+        }
+    }
+    fclose(file);
+}
+
+
+static void save_manifest(deltaPlan *plan, bool keepImage) {
+    //rewrite the manifest without anything the upload overwrote
+    char tmpPath[4200];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", plan->path, (int)getpid());
+    FILE *out = fopen(tmpPath, "w");
+    if(!out) {
+        if(verbosity > 0) {
+            fprintf(stderr, " ! Can't save upload manifest %s: %s\n",
+                tmpPath, strerror(errno));
+        }
+        return;
+    }
+    fprintf(out, "# 64drive upload manifest\n");
+
+    for(int i=0; i<plan->nRegions + 1; i++) {
+        deltaRegion *r = (i < plan->nRegions)
+            ? &plan->regions[i] : &plan->image;
+        if(r == &plan->image ? !keepImage : overlaps(r, &plan->image)) {
+            continue;
+        }
+
+        fprintf(out, "region %d %u %lld %u %u\n", r->bank, r->offset,
+            (long long)r->size, DELTA_BLOCK_SIZE, r->nBlocks);
+        for(int p=0; p<DELTA_PROBES; p++) {
+            fprintf(out, "probe %u ", r->probePos[p]);
+            write_hash(out, r->probeHash[p]);
+            fputc('\n', out);
+        }
+        for(uint32_t b=0; b<r->nBlocks; b++) {
+            write_hash(out, &r->hashes[b * SHA1_SIZE]);
+            fputc('\n', out);
+        }
+    }
+
+    if(fclose(out) || rename(tmpPath, plan->path)) {
+        fprintf(stderr, " ! Can't save upload manifest %s: %s\n",
+            plan->path, strerror(errno));
+        unlink(tmpPath);
+    }
+}
+
+
+static void save_copy(deltaPlan *plan) {
+    /** Bring our copy of the ROM up to date with what was just sent.
+     *  Parts we didn't send are left alone; if the copy was stale there,
+     *  diff_block() will notice next time by their hashes.
+     */
+    FILE *copy = fopen(plan->copyPath, "r+b");
+    if(!copy) copy = fopen(plan->copyPath, "w+b");
+    bool ok = (copy != NULL);
+    static uint8_t buf[DELTA_BLOCK_SIZE];
+    for(int i=0; ok && i<plan->nRanges; i++) {
+        uploadRange *r = &plan->ranges[i];
+        ok = !fseeko(copy, r->start, SEEK_SET);
+        for(int64_t pos = 0; ok && pos < r->len; pos += DELTA_BLOCK_SIZE) {
+            int64_t len = r->len - pos;
+            if(len > DELTA_BLOCK_SIZE) len = DELTA_BLOCK_SIZE;
+            const uint8_t *data = source_read(plan->src, r->start + pos, len,
+                buf);
+            ok = data && fwrite(data, 1, len, copy) == (size_t)len;
+        }
+    }
+    if(copy) {
+        ok = !fflush(copy) && ok
+            && !ftruncate(fileno(copy), plan->image.size);
+        if(fclose(copy)) ok = false;
+    }
+    if(!ok) {
+        fprintf(stderr, " ! Can't save ROM copy %s: %s\n",
+            plan->copyPath, strerror(errno));
+        unlink(plan->copyPath);
+    }
+}
+
+
+static int hash_image(deltaRegion *image, romSource *src) {
+    image->nBlocks = (image->size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+    image->hashes = (uint8_t*)malloc(image->nBlocks * SHA1_SIZE);
+    if(!image->hashes) return -1;
+
+    //hash it as the device will hold it, in the byte order it's sent in
+    static uint8_t buf[DELTA_BLOCK_SIZE];
+    const uint8_t *data = buf;
+    n64crcState crc;
+    bool fixing = transfer_fixes_checksum(src, image->offset, image->bank);
+    if(fixing) n64crc_init(&crc);
+    for(uint32_t b=0; data && b<image->nBlocks; b++) {
+        int64_t pos = (int64_t)b * DELTA_BLOCK_SIZE;
+        int64_t len = image->size - pos;
+        if(len > DELTA_BLOCK_SIZE) len = DELTA_BLOCK_SIZE;
+        data = source_read(src, pos, len, buf);
+        if(!data) break;
+        if(fixing) n64crc_feed(&crc, data, len);
+        sha1(data, len, &image->hashes[b * SHA1_SIZE]);
+    }
+
+    //start, middle and end, to check the device still holds this later
+    int64_t last = (image->size - DELTA_PROBE_SIZE) & ~511;
+    image->probePos[0] = 0;
+    image->probePos[1] = (last / 2) & ~511;
+    image->probePos[2] = last;
+    for(int p=0; data && p<DELTA_PROBES; p++) {
+        data = source_read(src, image->probePos[p], DELTA_PROBE_SIZE, buf);
+        if(data) sha1(data, DELTA_PROBE_SIZE, image->probeHash[p]);
+    }
+
+    //the upload corrects stale header checksums afterward, so the first
+    //block and probe have to be of the header as it's left on the device
+    uint32_t want[2];
+    if(data && fixing && !n64crc_result(&crc, want)) {
+        data = source_read(src, 0, DELTA_BLOCK_SIZE, buf);
+        if(data) {
+            if(data != buf) memcpy(buf, data, DELTA_BLOCK_SIZE);
+            n64crc_patch(buf, want);
+            sha1(buf, DELTA_BLOCK_SIZE, &image->hashes[0]);
+            sha1(buf, DELTA_PROBE_SIZE, image->probeHash[0]);
+        }
+    }
+
+    if(!data) {
+        free(image->hashes);
+        image->hashes = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+static bool device_holds(sixtyfourDrive *device, deltaRegion *r) {
+    //read back the probe blocks; if the cart was power cycled or written
+    //by something else since, they won't match
+    for(int p=0; p<DELTA_PROBES; p++) {
+        uint8_t buf[DELTA_PROBE_SIZE], hash[SHA1_SIZE];
+        uint32_t params[2] = {r->offset + r->probePos[p],
+            DELTA_PROBE_SIZE | (uint32_t)r->bank << 24};
+        if(device_send_cmd(device, DEV_CMD_DUMPRAM, 2, params, buf,
+        sizeof(buf)) != sizeof(buf)) {
+            transport_purge(device);
+            return false;
+        }
+        sha1(buf, sizeof(buf), hash);
+        if(memcmp(hash, r->probeHash[p], SHA1_SIZE)) return false;
+    }
+    return true;
+}
+
+
+static int add_range(deltaPlan *plan, int64_t pos, int64_t len) {
+    //add a part to send, merged with the last one if they're close enough
+    if(plan->ranges == &plan->whole) return -1; //gave up on it
+    if(plan->nRanges) {
+        uploadRange *last = &plan->ranges[plan->nRanges - 1];
+        if(pos - (last->start + last->len) <= DELTA_MERGE_GAP) {
+            last->len = pos + len - last->start;
+            return 0;
+        }
+    }
+    if(plan->nRanges == plan->maxRanges) {
+        int max = plan->maxRanges ? plan->maxRanges * 2 : 64;
+        uploadRange *ranges = (uploadRange*)realloc(plan->ranges,
+            max * sizeof(uploadRange));
+        if(!ranges) { //send everything instead
+            free(plan->ranges);
+            plan->ranges = &plan->whole;
+            plan->nRanges = 1;
+            return -1;
+        }
+        plan->ranges = ranges;
+        plan->maxRanges = max;
+    }
+    plan->ranges[plan->nRanges].start = pos;
+    plan->ranges[plan->nRanges].len = len;
+    plan->nRanges++;
+    return 0;
+}
+
+
+static int diff_block(deltaPlan *plan, FILE *copy, deltaRegion *old,
+uint32_t block) {
+    /** Add the DELTA_WINDOW_SIZE windows of a changed block that differ
+     *  from our copy of the last upload. Returns -1 if the copy doesn't
+     *  hold that upload's version of the block, so the caller sends all
+     *  of it.
+     */
+    int64_t pos = (int64_t)block * DELTA_BLOCK_SIZE;
+    int64_t oldLen = old->size - pos, newLen = plan->image.size - pos;
+    if(oldLen > DELTA_BLOCK_SIZE) oldLen = DELTA_BLOCK_SIZE;
+    if(newLen > DELTA_BLOCK_SIZE) newLen = DELTA_BLOCK_SIZE;
+
+    static uint8_t buf[DELTA_BLOCK_SIZE], newBuf[DELTA_BLOCK_SIZE];
+    uint8_t hash[SHA1_SIZE];
+    if(fseeko(copy, pos, SEEK_SET)
+    || fread(buf, 1, oldLen, copy) != (size_t)oldLen) return -1;
+    sha1(buf, oldLen, hash);
+    if(memcmp(hash, &old->hashes[block * SHA1_SIZE], SHA1_SIZE)) return -1;
+    const uint8_t *data = source_read(plan->src, pos, newLen, newBuf);
+    if(!data) return -1;
+
+    for(int64_t w=0; w<newLen; w += DELTA_WINDOW_SIZE) {
+        int64_t len = newLen - w;
+        if(len > DELTA_WINDOW_SIZE) len = DELTA_WINDOW_SIZE;
+        //the device holds whole windows, so a short old one always differs
+        if(w + len <= oldLen && !memcmp(&buf[w], &data[w], len)) {
+            continue;
+        }
+        if(add_range(plan, pos + w, len)) return 0;
+    }
+    return 0;
+}
+
+
+void delta_plan(deltaPlan *plan, sixtyfourDrive *device, romSource *src,
+uint32_t offset, int bank) {
+    /** Work out which parts of src need uploading, by comparing block
+     *  hashes against the last upload to the same place.
+     *  Everything is sent if there's no usable record of that, if the
+     *  device no longer holds what was recorded, if src isn't mapped or is
+     *  small, or if transfer_opts.delta is off.
+     *  Call delta_finish() after the upload.
+     */
+    memset(plan, 0, sizeof(*plan));
+    plan->image.bank = bank;
+    plan->image.offset = offset;
+    plan->image.size = src->size;
+    plan->whole.start = 0;
+    plan->whole.len = src->size;
+    plan->ranges = &plan->whole;
+    plan->nRanges = 1;
+
+    if(manifest_path(device, plan->path, sizeof(plan->path))) {
+        plan->path[0] = 0;
+        return;
+    }
+    load_manifest(plan);
+    if(!src->map || src->size < DELTA_MIN_SIZE) return;
+    if(hash_image(&plan->image, src)) return;
+    plan->src = src;
+
+    //only the ROM is big enough to be worth keeping a copy of
+    plan->fine = transfer_opts.fineDelta && bank == BANK_CARTROM
+        && snprintf(plan->copyPath, sizeof(plan->copyPath), "%s.rom",
+        plan->path) < (int)sizeof(plan->copyPath);
+    if(!transfer_opts.delta) return;
+
+    deltaRegion *old = NULL;
+    for(int i=0; i<plan->nRegions; i++) {
+        deltaRegion *r = &plan->regions[i];
+        if(r->bank == bank && r->offset == offset) old = r;
+    }
+    if(!old) return;
+    if(!device_holds(device, old)) {
+        if(verbosity > 0) {
+            printf(" * Device contents changed since the last upload; "
+                "sending everything\n");
+        }
+        return;
+    }
+
+    plan->ranges = NULL;
+    plan->nRanges = 0;
+    FILE *copy = NULL;
+    if(plan->fine) copy = fopen(plan->copyPath, "rb");
+
+    uint32_t nChanged = 0;
+    for(uint32_t b=0; b<plan->image.nBlocks; b++) {
+        if(b < old->nBlocks && !memcmp(&old->hashes[b * SHA1_SIZE],
+        &plan->image.hashes[b * SHA1_SIZE], SHA1_SIZE)) continue;
+
+        int64_t pos = (int64_t)b * DELTA_BLOCK_SIZE;
+        int64_t len = plan->image.size - pos;
+        if(len > DELTA_BLOCK_SIZE) len = DELTA_BLOCK_SIZE;
+        nChanged++;
+        if(copy && b < old->nBlocks
+        && !diff_block(plan, copy, old, b)) continue;
+        if(add_range(plan, pos, len)) break;
+    }
+    if(copy) fclose(copy);
+
+    if(verbosity > 0) {
+        printf(" * %u of %u blocks changed since the last upload\n",
+            nChanged, plan->image.nBlocks);
+    }
+}
+
+
+void delta_finish(deltaPlan *plan, bool ok) {
+    /** Record the upload in the manifest, or if it failed, forget what
+     *  was there before.
+     */
+    if(plan->path[0]) save_manifest(plan, ok && plan->image.hashes);
+    if(ok && plan->fine) save_copy(plan);
+
+    for(int i=0; i<plan->nRegions; i++) free(plan->regions[i].hashes);
+    free(plan->regions);
+    free(plan->image.hashes);
+    if(plan->ranges != &plan->whole) free(plan->ranges);
+}
+
+
+int delta_forget(sixtyfourDrive *device) {
+    //drop the manifest, so the next uploads are sent whole
+    char path[4096], copyPath[4200];
+    if(manifest_path(device, path, sizeof(path))) return 0;
+    snprintf(copyPath, sizeof(copyPath), "%s.rom", path);
+    if((unlink(path) && errno != ENOENT)
+    || (unlink(copyPath) && errno != ENOENT)) {
+        fprintf(stderr, "Can't remove upload manifest: %s\n",
+            strerror(errno));
+        return -1;
+    }
+    if(verbosity > 0) printf(" * Forgot previous uploads\n");
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "64drive.h"
+#include "hash.h"
+#include "source.h"
+#include "transfer.h"
+
+#define DELTA_BLOCK_SIZE  (64 * 1024)  //granularity of change detection
+#define DELTA_MIN_SIZE    (256 * 1024) //smaller uploads are always sent whole
+#define DELTA_PROBES      3            //blocks read back to check the device
+#define DELTA_PROBE_SIZE  512
+#define DELTA_WINDOW_SIZE 512          //granularity with a copy of the ROM
+#define DELTA_MERGE_GAP   (4 * 1024)   //send unchanged gaps this small
+
+//what we last wrote to one place on the device
+typedef struct {
+    int bank;
+    uint32_t offset;
+    int64_t size;
+    uint32_t nBlocks;
+    uint8_t *hashes; //SHA-1 of each DELTA_BLOCK_SIZE block
+    uint32_t probePos[DELTA_PROBES];
+    uint8_t probeHash[DELTA_PROBES][SHA1_SIZE];
+} deltaRegion;
+
+typedef struct {
+    char path[4096];      //manifest file, or empty if we can't keep one
+    deltaRegion *regions; //manifest contents
+    int nRegions;
+    deltaRegion image;    //what's being uploaded; no hashes if not mapped
+    romSource *src;       //the image, read as it's sent
+    bool fine;            //narrowing changes down using copyPath
+    char copyPath[4200];  //copy of the last ROM upload
+    uploadRange whole;    //all of it
+    uploadRange *ranges;  //parts of it to send
+    int nRanges, maxRanges;
+} deltaPlan;
+
+void delta_plan(deltaPlan *plan, sixtyfourDrive *device, romSource *src,
+    uint32_t offset, int bank);
+void delta_finish(deltaPlan *plan, bool ok);
+int delta_forget(sixtyfourDrive *device);
+
+#endif //_DELTA_H_
@@ -0,0 +1,319 @@
+#include <time.h>
+#include "64drive.h"
+#include "transfer.h"
+#include "delta.h"
+#include "decompress.h"
+#include "transport.h"
+
+int verbosity = 0;
+
+const uint32_t bank_capacity[BANK_LAST] = {
+    0,                //BANK_INVALID
+    64 * 1024 * 1024, //BANK_CARTROM
+    32 * 1024,        //BANK_SRAM256
+    96 * 1024,        //BANK_SRAM768
+    128 * 1024,       //BANK_FLASHRAM1M
+    128 * 1024,       //BANK_FLASHPKM1M
+    2 * 1024,         //BANK_EEPROM16
+};
+
+const cicType cic_types[] = { //XXX missing CRCs
+    {6101, CIC_6101, 0x6170A4A1, "Star Fox"},
+    {6102, CIC_6102, 0x90BB6CB5, "most NTSC games"},
+    {7101, CIC_7101, 0xFFFFFFFF, "most PAL games"},
+    {7102, CIC_7102, 0xFFFFFFFF, "Lylat Wars"},
+    { 103, CIC_X103, 0x0B050EE0, "covers 6103 and 7103"},
+    { 105, CIC_X105, 0x98BC2C86, "covers 6105 and 7105"},
+    { 106, CIC_X106, 0xACC8580A, "covers 6106 and 7106"},
+    {5101, CIC_5101, 0xFFFFFFFF, "Aleck64"},
+    //8303: JP 64DD (not dumped)
+    {0, 0, 0, NULL}
+};
+
+
+uint32_t swap_endian(uint32_t val) {
+    return ((val << 24)) |
+           ((val << 8) & 0x00ff0000) |
+           ((val >> 8) & 0x0000ff00) |
+           ((val >> 24));
+}
+
+
+int fail_ftdi(struct ftdi_context* ftdi, const char *msg) {
+    fprintf(stderr, "%s: %s\n", msg, ftdi_get_error_string(ftdi));
+    return EXIT_FAILURE;
+}
+
+
+int cic_from_bootcode(const uint8_t *bootcode) {
+    //which of cic_types the 0xFC0 bytes of bootcode are for, or -1
+    //copied from http://n64dev.org/n64crc.html
+    uint32_t crc = crc32(bootcode, 0xFC0);
+    for(int i=0; cic_types[i].num; i++) {
+        if(cic_types[i].crc32 == crc) return i;
+    }
+    return -1;
+}
+
+
+int get_cic(romSource *rom) {
+    uint8_t buf[0xFC0];
+    const uint8_t *data = source_read(rom, 0x40, sizeof(buf), buf); //bootcode
+    if(!data) {
+        fprintf(stderr, " ! Can't read bootcode from this input\n");
+        return -1;
+    }
+    if(verbosity > 0) {
+        printf(" * Bootcode CRC32: 0x%08X\n", crc32(data, sizeof(buf)));
+    }
+    return cic_from_bootcode(data);
+}
+
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+int device_build_cmd(uint8_t *buf, uint8_t cmd, uint8_t nParams,
+uint32_t *params) {
+    /** Build a command packet into buf.
+     *  Returns the packet length, or -1 if there are too many params.
+     *  buf must have room for 4 + (nParams * 4) bytes.
+     */
+    if(nParams >= 32 / sizeof(uint32_t)) {
+        fprintf(stderr, "Too many params for command\n");
+        return -1;
+    }
+
+    buf[0] = cmd;
+    buf[1] = 'C';
+    buf[2] = 'M';
+    buf[3] = 'D';
+
+    for(int i=0; i<nParams; i++) {
+        uint32_t param = swap_endian(params[i]);
+        memcpy(&buf[4 + (i * 4)], &param, sizeof(param));
+    }
+    return 4 + (nParams * 4);
+}
+
+
+int device_send_cmd(sixtyfourDrive *device, uint8_t cmd, uint8_t nParams,
+uint32_t *params, uint8_t *resp, uint32_t respLen) {
+    uint8_t tx_buf[32];
+
+    memset(tx_buf, 0, sizeof(tx_buf));
+    int len = device_build_cmd(tx_buf, cmd, nParams, params);
+    if(len < 0) return -1;
+
+    if(verbosity > 2) printf(" * Sending command 0x%02X\n", cmd);
+
+    int err = device_write_all(device, tx_buf, len);
+    if(err != len) {
+        fprintf(stderr, "device_send_cmd(0x%02X) write failed: %s\n",
+            cmd, transport_error(device));
+        return err < 0 ? err : -1;
+    }
+
+    if(respLen > 0) {
+        err = device_read_all(device, resp, respLen);
+        if(err <= 0) {
+            fprintf(stderr, "device_send_cmd(0x%02X) read failed: %s\n",
+                cmd, transport_error(device));
+        }
+    }
+
+    return err;
+}
+
+
+int device_write_all(sixtyfourDrive *device, const uint8_t *buf, int len) {
+    //write all of buf, however many goes it takes
+    //returns the bytes written, short only if the device stopped taking them
+    int pos = 0;
+    while(pos < len) {
+        int n = transport_write(device, buf + pos, len - pos);
+        if(n < 0) return n;
+        if(n == 0) break;
+        pos += n;
+    }
+    return pos;
+}
+
+
+int device_read_all(sixtyfourDrive *device, uint8_t *buf, int len) {
+    //read exactly len bytes, however many goes it takes
+    //returns the bytes read, short only if the device stopped sending
+    int pos = 0;
+    while(pos < len) {
+        int n = transport_read(device, buf + pos, len - pos);
+        if(n < 0) return pos ? pos : n;
+        if(n == 0) break;
+        pos += n;
+    }
+    return pos;
+}
+
+
+int device_resync(sixtyfourDrive *device) {
+    /** Get back in step with the device after a failed transfer.
+     *  Throws away anything still buffered either way, including responses
+     *  to commands the device was still working on, then checks it answers
+     *  GETVER with the right magic. Returns 0 if it does.
+     */
+    uint8_t buf[512];
+    transport_purge(device);
+    while(transport_read(device, buf, sizeof(buf)) > 0);
+    transport_purge(device);
+
+    if(device_send_cmd(device, DEV_CMD_GETVER, 0, NULL, buf, 8) != 8) {
+        return -1;
+    }
+    uint32_t magic = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+    if(magic != DEV_MAGIC) {
+        if(verbosity > 0) {
+            fprintf(stderr, " ! incorrect magic 0x%08X, expected 0x%08X\n",
+                magic, DEV_MAGIC);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+int device_get_version(sixtyfourDrive *device) {
+    uint8_t response[8]; //version, magic
+    int err = device_send_cmd(device, DEV_CMD_GETVER, 0, NULL,
+        response, sizeof(response));
+    if(err <= 0) {
+        fprintf(stderr, "device_get_version() failed: %s\n"
+            "Try unplugging 64drive USB cable and turning off console.\n",
+            transport_error(device));
+        return err;
+    }
+
+    int tries = 0;
+    while(1) {
+        int err = device_send_cmd(device, DEV_CMD_GETVER, 0, NULL,
+            response, sizeof(response));
+        if(err <= 0) {
+            fprintf(stderr, "device_get_version() failed: %s\n",
+                transport_error(device));
+            return err;
+        }
+
+        uint32_t *data = (uint32_t*)response;
+        uint32_t magic = swap_endian(data[1]);
+        if(magic == DEV_MAGIC) break;
+
+        if(verbosity > 0) {
+            fprintf(stderr, " ! incorrect magic 0x%08X, expected 0x%08X\n",
+                magic, DEV_MAGIC);
+        }
+
+        if(++tries >= 4) {
+            fprintf(stderr,
+                "\nCommunication failure.\n"
+                "Unplug USB cable, turn off N64, then try again.\n");
+            return -1;
+        }
+    }
+
+    /* if(verbosity > 0) {
+        printf(" * HW revision: %c%c\n", response[0], response[1]);
+    } */
+    device->variant[0] = response[0];
+    device->variant[1] = response[1];
+    device->variant[2] = response[2];
+    return (response[0] << 24) | (response[1] << 16) | (response[2] << 8);
+}
+
+
+int device_set_cic(sixtyfourDrive *device, int cic) {
+    if(device->variant[0] == 'A') {
+        fprintf(stderr, "This device does not support changing CIC mode.\n");
+        return -1;
+    }
+
+    if(verbosity > 0) {
+        printf(" * Selecting CIC %d (#%d)\n", cic_types[cic].num, cic);
+    }
+
+    uint32_t param = (1 << 31) | cic;
+    return device_send_cmd(device, DEV_CMD_SETCIC, 1, &param, NULL, 0);
+}
+
+
+int setup_device(sixtyfourDrive *device) {
+    if(!device->transport) device->transport = &transport_ftdi;
+    int ver = device->transport->open(device, device->transportArgs);
+    if(ver < 1) {
+        fprintf(stderr, "64drive device not found.\n");
+        return EXIT_FAILURE;
+    }
+    if(verbosity > 0) {
+        printf(" * Found 64drive version %d, serial \"%s\"\n",
+            device->version, device->serial);
+    }
+
+    if(device_get_version(device) <= 0) {
+        shutdown_device(device);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+void shutdown_device(sixtyfourDrive *device) {
+    if(device->ctx == NULL) return;
+    device->transport->close(device);
+}
+
+
+int load_file(sixtyfourDrive *device, FILE *file, int64_t size,
+uint32_t offset, int bank, bool autoCIC) {
+    //upload a file, selecting its CIC first if autoCIC is set
+    decompressor dc;
+    FILE *in = decomp_open(&dc, file);
+    if(!in) return -1;
+    if(size < 0) size = dc.size;
+
+    romSource rom;
+    if(source_open(&rom, in, size)) {
+        if(in != file) fclose(in);
+        return -1;
+    }
+    if(in != file) { //a stream, but its header has been read already
+        rom.head = dc.head;
+        rom.headLen = dc.headLen;
+    }
+    if(bank == BANK_CARTROM) source_set_order(&rom, transfer_opts.byteOrder);
+
+    if(autoCIC) {
+        if(verbosity > 1) printf(" * Identifying CIC...\n");
+        int cic = get_cic(&rom);
+        if(cic < 0) {
+            fprintf(stderr, " ! Auto CIC selection failed - "
+                "unrecognized bootcode.\n");
+        }
+        else {
+            if(verbosity > 0) {
+                printf(" * Auto detected CIC: %d\n", cic_types[cic].num);
+            }
+            device_set_cic(device, cic_types[cic].cic);
+        }
+    }
+
+    deltaPlan plan;
+    delta_plan(&plan, device, &rom, offset, bank);
+    int result = device_upload_ranges(device, &rom, offset, bank,
+        plan.ranges, plan.nRanges);
+    delta_finish(&plan, result == 0);
+    source_close(&rom);
+    if(in != file) fclose(in);
+    return result;
+}
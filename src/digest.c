@@ -0,0 +1,256 @@
+#include "digest.h"
+
+static const struct {
+    int flag;
+    const char *name;
+} digest_names[] = {
+    {DIGEST_CRC32, "crc32"},
+    {DIGEST_MD5,   "md5"},
+    {DIGEST_SHA1,  "sha1"},
+    {DIGEST_XXH64, "xxh64"},
+    {0, NULL}
+};
+
+
+int digest_parse(const char *spec) {
+    /** Parse a comma separated list of digest names, or "all".
+     *  Returns DIGEST_* flags, or -1 if a name isn't known.
+     */
+    char buf[64];
+    if(strlen(spec) >= sizeof(buf)) return -1;
+    strcpy(buf, spec);
+
+    int algos = 0;
+    char *save = NULL;
+    for(char *name = strtok_r(buf, ",", &save); name;
+    name = strtok_r(NULL, ",", &save)) {
+        int flag = strcmp(name, "all") ? 0 : DIGEST_ALL;
+        for(int i=0; !flag && digest_names[i].name; i++) {
+            if(!strcmp(name, digest_names[i].name)) {
+                flag = digest_names[i].flag;
+            }
+        }
+        if(!flag) return -1;
+        algos |= flag;
+    }
+    return algos ? algos : -1;
+}
+
+
+static void state_init(digestState *st) {
+    st->length = 0;
+    st->crc32 = 0;
+    md5_init(&st->md5);
+    sha1_init(&st->sha1);
+    xxh64_init(&st->xxh64, 0);
+}
+
+
+static void state_update(digestState *st, int algos, const uint8_t *data,
+size_t len) {
+    if(algos & DIGEST_CRC32) st->crc32 = crc32_update(st->crc32, data, len);
+    if(algos & DIGEST_MD5)   md5_update(&st->md5, data, len);
+    if(algos & DIGEST_SHA1)  sha1_update(&st->sha1, data, len);
+    if(algos & DIGEST_XXH64) xxh64_update(&st->xxh64, data, len);
+    st->length += len;
+}
+
+
+static void state_final(digestState *st, int algos, digestResult *result) {
+    memset(result, 0, sizeof(*result));
+    result->algos = algos;
+    result->length = st->length;
+    result->crc32 = st->crc32;
+    if(algos & DIGEST_MD5)   md5_final(&st->md5, result->md5);
+    if(algos & DIGEST_SHA1)  sha1_final(&st->sha1, result->sha1);
+    if(algos & DIGEST_XXH64) result->xxh64 = xxh64_final(&st->xxh64);
+}
+
+
+static int mark_index(int64_t length) {
+    //which of the kept states is at length, or -1 if none is
+    int i = 0;
+    for(int64_t mark = DIGEST_MIN_MARK; mark < length; mark *= 2) i++;
+    if(i >= DIGEST_MAX_MARKS) return -1;
+    return (((int64_t)DIGEST_MIN_MARK << i) == length) ? i : -1;
+}
+
+
+static void worker_update(digestWorker *dw, const uint8_t *data, size_t len) {
+    //hash more data, stopping at each power of two to keep the state
+    while(len > 0) {
+        int64_t mark = DIGEST_MIN_MARK;
+        while(mark <= dw->state.length) mark *= 2;
+        size_t n = len;
+        if((int64_t)n > mark - dw->state.length) {
+            n = mark - dw->state.length;
+        }
+        state_update(&dw->state, dw->algos, data, n);
+        data += n;
+        len -= n;
+
+        int i = mark_index(dw->state.length);
+        if(i >= 0) dw->marks[i] = dw->state;
+    }
+}
+
+
+static int digest_write(dumpSink *sink, const uint8_t *data, uint32_t len) {
+    worker_update((digestWorker*)sink->ctx, data, len);
+    return 0;
+}
+
+static const sinkBackend sink_digest = {"digest", NULL, digest_write, NULL};
+
+
+static void* map_thread(void *arg) {
+    digestWorker *dw = (digestWorker*)arg;
+    worker_update(dw, dw->map, dw->mapLen);
+    return NULL;
+}
+
+
+int digest_start(digestWorker *dw, int algos, const uint8_t *map,
+size_t mapLen) {
+    /** Start hashing on a worker thread.
+     *  algos:  DIGEST_* flags of the digests to compute.
+     *  map:    Data to hash, which must stay valid until digest_finish(),
+     *          or NULL to pass it in with digest_feed() instead.
+     *  Returns 0, or -1 if the worker can't be started.
+     */
+    dw->algos = algos;
+    dw->map = map;
+    dw->mapLen = mapLen;
+    state_init(&dw->state);
+    for(int i=0; i<DIGEST_MAX_MARKS; i++) dw->marks[i].length = -1;
+
+    if(map) return pthread_create(&dw->thread, NULL, map_thread, dw) ? -1 : 0;
+    return sink_start(&dw->sink, NULL, &sink_digest, dw, DIGEST_BUFFER_SIZE,
+        DIGEST_BUFFERS, NULL);
+}
+
+
+int digest_feed(digestWorker *dw, const uint8_t *data, size_t len) {
+    //hand a copy of the next len bytes to the worker, waiting if it's behind
+    while(len > 0) {
+        uint32_t n = (len > DIGEST_BUFFER_SIZE) ? DIGEST_BUFFER_SIZE : len;
+        uint8_t *buf = sink_reserve(&dw->sink, true);
+        memcpy(buf, data, n);
+        sink_commit(&dw->sink, n);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int digest_finish(digestWorker *dw, int64_t length, digestResult *result) {
+    /** Wait for the worker and stop it.
+     *  length: Bytes to give the digests of, or -1 for everything hashed.
+     *          Less than that only works at a power of two.
+     *  result: Receives the digests, or NULL to throw them away.
+     *  Returns 0, or -1 if there's no state kept at length.
+     */
+    if(dw->map) pthread_join(dw->thread, NULL);
+    else sink_finish(&dw->sink);
+    if(!result) return 0;
+
+    digestState *st = &dw->state;
+    if(length >= 0 && length != st->length) {
+        int i = mark_index(length);
+        if(length > st->length || i < 0 || dw->marks[i].length != length) {
+            memset(result, 0, sizeof(*result));
+            return -1;
+        }
+        st = &dw->marks[i];
+    }
+    state_final(st, dw->algos, result);
+    return 0;
+}
+
+
+int digest_file(int fd, off_t base, int64_t size, int algos,
+digestResult *result) {
+    //digest size bytes of a file from base, on this thread
+    uint8_t *buf = (uint8_t*)malloc(DIGEST_BUFFER_SIZE);
+    if(!buf) return -1;
+    digestState st;
+    state_init(&st);
+    int err = 0;
+    for(int64_t pos = 0; pos < size && !err; pos += DIGEST_BUFFER_SIZE) {
+        int64_t len = size - pos;
+        if(len > DIGEST_BUFFER_SIZE) len = DIGEST_BUFFER_SIZE;
+        if(pread(fd, buf, len, base + pos) != len) err = -1;
+        else state_update(&st, algos, buf, len);
+    }
+    free(buf);
+    if(!err) state_final(&st, algos, result);
+    return err;
+}
+
+
+static void print_hex(FILE *out, const uint8_t *data, int len) {
+    for(int i=0; i<len; i++) fprintf(out, "%02x", data[i]);
+}
+
+
+static void print_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for(; *str; str++) {
+        unsigned char c = *str;
+        if(c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if(c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+
+void digest_print(const digestResult *result, const char *op,
+const char *path, bool json, FILE *out) {
+    /** Show the digests of an up/download.
+     *  op:   What was done, e.g. "upload".
+     *  path: File uploaded or dumped.
+     *  json: Print one JSON object on a line, rather than text.
+     */
+    int algos = result->algos;
+    if(!algos) return;
+    if(json) {
+        fprintf(out, "{\"op\":\"%s\",\"file\":", op);
+        print_json_string(out, path);
+        fprintf(out, ",\"size\":%" PRId64, result->length);
+        if(algos & DIGEST_CRC32) {
+            fprintf(out, ",\"crc32\":\"%08x\"", result->crc32);
+        }
+        if(algos & DIGEST_MD5) {
+            fprintf(out, ",\"md5\":\"");
+            print_hex(out, result->md5, MD5_SIZE);
+            fputc('"', out);
+        }
+        if(algos & DIGEST_SHA1) {
+            fprintf(out, ",\"sha1\":\"");
+            print_hex(out, result->sha1, SHA1_SIZE);
+            fputc('"', out);
+        }
+        if(algos & DIGEST_XXH64) {
+            fprintf(out, ",\"xxh64\":\"%016" PRIx64 "\"", result->xxh64);
+        }
+        fprintf(out, "}\n");
+        return;
+    }
+
+    if(algos & DIGEST_CRC32) fprintf(out, " * CRC32: %08x\n", result->crc32);
+    if(algos & DIGEST_MD5) {
+        fprintf(out, " * MD5:   ");
+        print_hex(out, result->md5, MD5_SIZE);
+        fputc('\n', out);
+    }
+    if(algos & DIGEST_SHA1) {
+        fprintf(out, " * SHA-1: ");
+        print_hex(out, result->sha1, SHA1_SIZE);
+        fputc('\n', out);
+    }
+    if(algos & DIGEST_XXH64) {
+        fprintf(out, " * XXH64: %016" PRIx64 "\n", result->xxh64);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <pthread.h>
+#include "64drive.h"
+#include "hash.h"
+#include "sink.h"
+
+#define DIGEST_BUFFER_SIZE (1024 * 1024) //bytes per copy handed to the worker
+#define DIGEST_BUFFERS     8
+#define DIGEST_MIN_MARK    (64 * 1024) //smallest length the state is kept at
+#define DIGEST_MAX_MARKS   24 //powers of two from DIGEST_MIN_MARK kept
+
+enum {
+    DIGEST_CRC32 = 1 << 0,
+    DIGEST_MD5   = 1 << 1,
+    DIGEST_SHA1  = 1 << 2,
+    DIGEST_XXH64 = 1 << 3,
+    DIGEST_ALL   = 0xF
+};
+
+//digests of everything up/downloaded
+typedef struct {
+    int32_t algos;  //DIGEST_* flags of those computed, 0 if none
+    int64_t length; //bytes covered
+    uint32_t crc32;
+    uint8_t md5[MD5_SIZE];
+    uint8_t sha1[SHA1_SIZE];
+    uint64_t xxh64;
+} digestResult;
+
+typedef struct {
+    int64_t length;
+    uint32_t crc32;
+    md5Context md5;
+    sha1Context sha1;
+    xxh64Context xxh64;
+} digestState;
+
+//hashes on a worker thread, either straight from memory given up front,
+//or copies handed over with digest_feed(). The state at each power of two
+//is kept, so a dump can still be digested after being cut short at one.
+typedef struct {
+    int algos;
+    digestState state;
+    digestState marks[DIGEST_MAX_MARKS]; //at DIGEST_MIN_MARK << i bytes
+
+    const uint8_t *map; //hashed directly, or NULL to use the sink
+    size_t mapLen;
+    pthread_t thread;
+    dumpSink sink;
+} digestWorker;
+
+int digest_parse(const char *spec);
+int digest_start(digestWorker *dw, int algos, const uint8_t *map,
+    size_t mapLen);
+int digest_feed(digestWorker *dw, const uint8_t *data, size_t len);
+int digest_finish(digestWorker *dw, int64_t length, digestResult *result);
+int digest_file(int fd, off_t base, int64_t size, int algos,
+    digestResult *result);
+void digest_print(const digestResult *result, const char *op,
+    const char *path, bool json, FILE *out);
+
+#endif //_DIGEST_H_
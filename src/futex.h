@@ -0,0 +1,29 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <atomic>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+//sleep/wake helpers for the lock-free rings shared between the transfer
+//loop and its worker threads.
+
+static inline void futex_wait(std::atomic<uint32_t> *word, uint32_t expected) {
+    //sleep until word changes from expected. The timeout covers stop
+    //flags, which are not futex words themselves.
+    struct timespec timeout = {0, 50 * 1000 * 1000};
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT_PRIVATE, expected,
+        &timeout, NULL, 0);
+}
+
+
+static inline void futex_wake(std::atomic<uint32_t> *word) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, INT_MAX,
+        NULL, NULL, 0);
+}
+
+#endif //_FUTEX_H_
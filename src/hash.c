@@ -0,0 +1,286 @@
+#include "hash.h"
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+
+static void sha1_block(uint32_t *state, const uint8_t *block) {
+    uint32_t w[80];
+    for(int i=0; i<16; i++) {
+        w[i] = (block[i*4] << 24) | (block[i*4+1] << 16)
+            | (block[i*4+2] << 8) | block[i*4+3];
+    }
+    for(int i=16; i<80; i++) {
+        w[i] = ROL32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+        e = state[4];
+    for(int i=0; i<80; i++) {
+        uint32_t f, k;
+        if(i < 20)      { f = (b & c) | (~b & d);           k = 0x5A827999; }
+        else if(i < 40) { f = b ^ c ^ d;                    k = 0x6ED9EBA1; }
+        else if(i < 60) { f = (b & c) | (b & d) | (c & d);  k = 0x8F1BBCDC; }
+        else            { f = b ^ c ^ d;                    k = 0xCA62C1D6; }
+        uint32_t t = ROL32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL32(b, 30);
+        b = a;
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+
+void sha1_init(sha1Context *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->length = 0;
+    ctx->bufLen = 0;
+}
+
+
+void sha1_update(sha1Context *ctx, const uint8_t *data, size_t len) {
+    ctx->length += len;
+    if(ctx->bufLen) { //top up a partial block first
+        size_t n = 64 - ctx->bufLen;
+        if(n > len) n = len;
+        memcpy(&ctx->buf[ctx->bufLen], data, n);
+        ctx->bufLen += n;
+        data += n;
+        len -= n;
+        if(ctx->bufLen < 64) return;
+        sha1_block(ctx->state, ctx->buf);
+        ctx->bufLen = 0;
+    }
+    for(; len >= 64; data += 64, len -= 64) sha1_block(ctx->state, data);
+    memcpy(ctx->buf, data, len);
+    ctx->bufLen = len;
+}
+
+
+void sha1_final(sha1Context *ctx, uint8_t *digest) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padLen = (ctx->bufLen < 56) ? 56 - ctx->bufLen : 120 - ctx->bufLen;
+    for(int i=0; i<8; i++) pad[padLen + i] = bits >> (56 - (i * 8));
+    sha1_update(ctx, pad, padLen + 8);
+
+    for(int i=0; i<5; i++) {
+        digest[i*4]   = ctx->state[i] >> 24;
+        digest[i*4+1] = ctx->state[i] >> 16;
+        digest[i*4+2] = ctx->state[i] >> 8;
+        digest[i*4+3] = ctx->state[i];
+    }
+}
+
+
+void sha1(const uint8_t *data, size_t len, uint8_t *digest) {
+    sha1Context ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, len);
+    sha1_final(&ctx, digest);
+}
+
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+
+static void md5_block(uint32_t *state, const uint8_t *block) {
+    uint32_t w[16];
+    for(int i=0; i<16; i++) {
+        w[i] = block[i*4] | (block[i*4+1] << 8)
+            | (block[i*4+2] << 16) | ((uint32_t)block[i*4+3] << 24);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for(int i=0; i<64; i++) {
+        uint32_t f;
+        int g;
+        if(i < 16)      { f = (b & c) | (~b & d); g = i; }
+        else if(i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+        else if(i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) % 16; }
+        else            { f = c ^ (b | ~d);       g = (7 * i) % 16; }
+        uint32_t t = d;
+        d = c;
+        c = b;
+        b += ROL32(a + f + md5_k[i] + w[g], md5_r[i]);
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+
+void md5_init(md5Context *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+    ctx->bufLen = 0;
+}
+
+
+void md5_update(md5Context *ctx, const uint8_t *data, size_t len) {
+    ctx->length += len;
+    if(ctx->bufLen) { //top up a partial block first
+        size_t n = 64 - ctx->bufLen;
+        if(n > len) n = len;
+        memcpy(&ctx->buf[ctx->bufLen], data, n);
+        ctx->bufLen += n;
+        data += n;
+        len -= n;
+        if(ctx->bufLen < 64) return;
+        md5_block(ctx->state, ctx->buf);
+        ctx->bufLen = 0;
+    }
+    for(; len >= 64; data += 64, len -= 64) md5_block(ctx->state, data);
+    memcpy(ctx->buf, data, len);
+    ctx->bufLen = len;
+}
+
+
+void md5_final(md5Context *ctx, uint8_t *digest) {
+    //same padding as SHA-1, but the length is little endian
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padLen = (ctx->bufLen < 56) ? 56 - ctx->bufLen : 120 - ctx->bufLen;
+    for(int i=0; i<8; i++) pad[padLen + i] = bits >> (i * 8);
+    md5_update(ctx, pad, padLen + 8);
+
+    for(int i=0; i<4; i++) {
+        digest[i*4]   = ctx->state[i];
+        digest[i*4+1] = ctx->state[i] >> 8;
+        digest[i*4+2] = ctx->state[i] >> 16;
+        digest[i*4+3] = ctx->state[i] >> 24;
+    }
+}
+
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+
+static uint64_t read_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for(int i=7; i>=0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return ROL64(acc, 31) * XXH_PRIME1;
+}
+
+
+static uint64_t xxh64_merge(uint64_t h, uint64_t acc) {
+    h ^= xxh64_round(0, acc);
+    return (h * XXH_PRIME1) + XXH_PRIME4;
+}
+
+
+static void xxh64_stripe(uint64_t *acc, const uint8_t *p) {
+    for(int i=0; i<4; i++) {
+        acc[i] = xxh64_round(acc[i], read_le64(p + (i * 8)));
+    }
+}
+
+
+void xxh64_init(xxh64Context *ctx, uint64_t seed) {
+    ctx->acc[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+    ctx->acc[1] = seed + XXH_PRIME2;
+    ctx->acc[2] = seed;
+    ctx->acc[3] = seed - XXH_PRIME1;
+    ctx->length = 0;
+    ctx->bufLen = 0;
+}
+
+
+void xxh64_update(xxh64Context *ctx, const uint8_t *data, size_t len) {
+    ctx->length += len;
+    if(ctx->bufLen) { //top up a partial stripe first
+        size_t n = 32 - ctx->bufLen;
+        if(n > len) n = len;
+        memcpy(&ctx->buf[ctx->bufLen], data, n);
+        ctx->bufLen += n;
+        data += n;
+        len -= n;
+        if(ctx->bufLen < 32) return;
+        xxh64_stripe(ctx->acc, ctx->buf);
+        ctx->bufLen = 0;
+    }
+    for(; len >= 32; data += 32, len -= 32) xxh64_stripe(ctx->acc, data);
+    memcpy(ctx->buf, data, len);
+    ctx->bufLen = len;
+}
+
+
+uint64_t xxh64_final(xxh64Context *ctx) {
+    uint64_t h;
+    if(ctx->length >= 32) {
+        h = ROL64(ctx->acc[0], 1) + ROL64(ctx->acc[1], 7)
+            + ROL64(ctx->acc[2], 12) + ROL64(ctx->acc[3], 18);
+        for(int i=0; i<4; i++) h = xxh64_merge(h, ctx->acc[i]);
+    }
+    else h = ctx->acc[2] + XXH_PRIME5; //acc[2] is still the seed
+    h += ctx->length;
+
+    const uint8_t *p = ctx->buf;
+    uint32_t left = ctx->bufLen;
+    for(; left >= 8; p += 8, left -= 8) {
+        h ^= xxh64_round(0, read_le64(p));
+        h = (ROL64(h, 27) * XXH_PRIME1) + XXH_PRIME4;
+    }
+    if(left >= 4) {
+        uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        h ^= v * XXH_PRIME1;
+        h = (ROL64(h, 23) * XXH_PRIME2) + XXH_PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for(; left; p++, left--) {
+        h ^= *p * XXH_PRIME5;
+        h = ROL64(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,44 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include "64drive.h"
+
+#define SHA1_SIZE 20
+#define MD5_SIZE  16
+
+typedef struct {
+    uint32_t state[5];
+    uint64_t length; //bytes hashed so far
+    uint8_t buf[64];
+    uint32_t bufLen;
+} sha1Context;
+
+void sha1_init(sha1Context *ctx);
+void sha1_update(sha1Context *ctx, const uint8_t *data, size_t len);
+void sha1_final(sha1Context *ctx, uint8_t *digest);
+void sha1(const uint8_t *data, size_t len, uint8_t *digest);
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t length; //bytes hashed so far
+    uint8_t buf[64];
+    uint32_t bufLen;
+} md5Context;
+
+void md5_init(md5Context *ctx);
+void md5_update(md5Context *ctx, const uint8_t *data, size_t len);
+void md5_final(md5Context *ctx, uint8_t *digest);
+
+//XXH64, a fast non-cryptographic hash
+typedef struct {
+    uint64_t acc[4];
+    uint64_t length; //bytes hashed so far
+    uint8_t buf[32];
+    uint32_t bufLen;
+} xxh64Context;
+
+void xxh64_init(xxh64Context *ctx, uint64_t seed);
+void xxh64_update(xxh64Context *ctx, const uint8_t *data, size_t len);
+uint64_t xxh64_final(xxh64Context *ctx);
+
+#endif //_HASH_H_
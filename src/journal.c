@@ -0,0 +1,184 @@
+#include "journal.h"
+#include "sparse.h"
+
+/** The journal is a text file:
+ *    dump BANK OFFSET SIZE STANDALONE BYTEORDER RANGESIZE
+ *    range START LEN SHA1
+ *    ...
+ *  with a range line added, after the data is synced to disk, each time
+ *  another JOURNAL_RANGE_SIZE bytes (or the end) is written. On resuming,
+ *  ranges are checked against the output file before being trusted.
+ */
+
+
+static int journal_load(dumpJournal *journal, int outFd, char *text,
+int bank, uint32_t offset, int64_t size, bool standalone, int order) {
+    //check the existing ranges against the output file
+    //returns how many lines of text are still good
+    int nGood = 0;
+    uint8_t *buf = NULL;
+    char *save = NULL;
+    for(char *line = strtok_r(text, "\n", &save); line;
+    line = strtok_r(NULL, "\n", &save)) {
+        if(line[0] == '#') continue;
+        if(!nGood) {
+            int jBank, jStandalone, jOrder;
+            unsigned jOffset, jRange;
+            long long jSize;
+            if(sscanf(line, "dump %d %u %lld %d %d %u", &jBank, &jOffset,
+                &jSize, &jStandalone, &jOrder, &jRange) != 6
+            || jBank != bank || jOffset != offset || jSize != size
+            || jStandalone != standalone || jOrder != order
+            || jRange != JOURNAL_RANGE_SIZE) {
+                break;
+            }
+            nGood++;
+            continue;
+        }
+
+        long long start, len;
+        char hex[64];
+        uint8_t hash[SHA1_SIZE];
+        if(sscanf(line, "range %lld %lld %63s", &start, &len, hex) != 3
+        || start != journal->done || len <= 0 || len > JOURNAL_RANGE_SIZE
+        || start + len > size || strlen(hex) != SHA1_SIZE * 2) break;
+
+        if(!buf) buf = (uint8_t*)malloc(JOURNAL_RANGE_SIZE);
+        if(!buf || pread(outFd, buf, len, start) != len) break;
+        sha1(buf, len, hash);
+        char actual[SHA1_SIZE * 2 + 1];
+        for(int i=0; i<SHA1_SIZE; i++) sprintf(&actual[i*2], "%02x", hash[i]);
+        if(strcmp(actual, hex)) {
+            if(verbosity > 0) {
+                printf(" * Output changed after %" PRId64 " Kbytes\n",
+                    journal->done / 1024);
+            }
+            break;
+        }
+        journal->done += len;
+        nGood++;
+    }
+    free(buf);
+    return nGood;
+}
+
+
+int journal_begin(dumpJournal *journal, FILE *file, FILE *out, int bank,
+uint32_t offset, int64_t size, bool standalone, int order) {
+    /** Pick up an interrupted download, or start a new one.
+     *  file:  The journal, opened for reading and writing.
+     *  out:   The output file, opened for reading and writing.
+     *  order: Byte order the dump is written in.
+     *  Other params describe the whole download; if they don't match
+     *  what the journal recorded, it starts over.
+     *  Sets journal->done to how much of the download is already done,
+     *  leaving out positioned just after it.
+     */
+    memset(journal, 0, sizeof(*journal));
+    journal->file = file;
+    int outFd = fileno(out);
+    fflush(out);
+
+    //read the old journal, then rewrite it with just what still checks out
+    char *text = NULL;
+    size_t textLen = 0;
+    FILE *mem = open_memstream(&text, &textLen);
+    if(!mem) return -1;
+    rewind(file);
+    char line[256];
+    while(fgets(line, sizeof(line), file)) fputs(line, mem);
+    fclose(mem);
+
+    char *copy = strdup(text);
+    int nGood = copy ? journal_load(journal, outFd, copy, bank, offset, size,
+        standalone, order) : 0;
+    free(copy);
+
+    rewind(file);
+    if(ftruncate(fileno(file), 0)) {
+        free(text);
+        return -1;
+    }
+    fprintf(file, "# 64drive download journal\n");
+    if(!nGood) {
+        fprintf(file, "dump %d %u %lld %d %d %u\n", bank, offset,
+            (long long)size, (int)standalone, order, JOURNAL_RANGE_SIZE);
+    }
+    char *save = NULL;
+    for(char *l = strtok_r(text, "\n", &save); l && nGood;
+    l = strtok_r(NULL, "\n", &save)) {
+        if(l[0] == '#') continue;
+        fprintf(file, "%s\n", l);
+        nGood--;
+    }
+    free(text);
+    if(fflush(file)) return -1;
+
+    //anything after what we trust gets downloaded again
+    if(ftruncate(outFd, journal->done)
+    || lseek(outFd, journal->done, SEEK_SET) < 0) {
+        fprintf(stderr, "Can't resume output: %s\n", strerror(errno));
+        return -1;
+    }
+    journal->rangeStart = journal->done;
+    sha1_init(&journal->hash);
+    return 0;
+}
+
+
+static int journal_checkpoint(dumpSink *sink, dumpJournal *journal) {
+    //record the range just written, once it's safely on disk; a hole at
+    //the end of it only counts once the file reaches past it
+    if(sink->sparse) {
+        int err = sparse_settle(sink->sparse, sink->fd);
+        if(err) return err;
+    }
+    if(fdatasync(sink->fd) && errno != EINVAL) return -errno;
+
+    uint8_t hash[SHA1_SIZE];
+    sha1_final(&journal->hash, hash);
+    fprintf(journal->file, "range %lld %u ",
+        (long long)journal->rangeStart, journal->rangeLen);
+    for(int i=0; i<SHA1_SIZE; i++) fprintf(journal->file, "%02x", hash[i]);
+    fputc('\n', journal->file);
+    if(fflush(journal->file)) return -errno;
+    fdatasync(fileno(journal->file));
+
+    journal->rangeStart += journal->rangeLen;
+    journal->rangeLen = 0;
+    sha1_init(&journal->hash);
+    return 0;
+}
+
+
+static int journal_write(dumpSink *sink, const uint8_t *data, uint32_t len) {
+    dumpJournal *journal = (dumpJournal*)sink->ctx;
+    int err = sink_file.write(sink, data, len);
+    if(err) return err;
+
+    while(len > 0) {
+        uint32_t n = JOURNAL_RANGE_SIZE - journal->rangeLen;
+        if(n > len) n = len;
+        sha1_update(&journal->hash, data, n);
+        journal->rangeLen += n;
+        data += n;
+        len -= n;
+        if(journal->rangeLen == JOURNAL_RANGE_SIZE) {
+            err = journal_checkpoint(sink, journal);
+            if(err) return err;
+        }
+    }
+    return 0;
+}
+
+
+static int journal_finish(dumpSink *sink) {
+    //record what's left, whether the download finished or not; everything
+    //handed to the sink was received intact
+    dumpJournal *journal = (dumpJournal*)sink->ctx;
+    if(!journal->rangeLen || sink->error.load()) return 0;
+    return journal_checkpoint(sink, journal);
+}
+
+const sinkBackend sink_journal = {"journal", NULL, journal_write,
+    journal_finish};
@@ -0,0 +1,25 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "64drive.h"
+#include "hash.h"
+#include "sink.h"
+
+#define JOURNAL_RANGE_SIZE (4 * 1024 * 1024) //data between checkpoints
+
+//sidecar file recording how much of a download is safely on disk, so an
+//interrupted one can pick up where it left off
+typedef struct {
+    FILE *file;
+    int64_t done;       //bytes already downloaded and verified
+    int64_t rangeStart; //position in the dump of the range being written
+    uint32_t rangeLen;
+    sha1Context hash;   //of the range being written
+} dumpJournal;
+
+int journal_begin(dumpJournal *journal, FILE *file, FILE *out, int bank,
+    uint32_t offset, int64_t size, bool standalone, int order);
+
+extern const sinkBackend sink_journal;
+
+#endif //_JOURNAL_H_
@@ -1,19 +1,53 @@
+#include <sys/stat.h>
 #include "64drive.h"
-
-static int verbosity = 0;
+#include "transfer.h"
+#include "daemon.h"
+#include "delta.h"
+#include "transport.h"
+#include "watch.h"
+#include "compress.h"
+#include "sparse.h"
+
+static bool useDaemon = true; //talk to a running daemon if there is one
+static bool resumeDumps = false; //keep a journal so dumps can be resumed
+static bool digestJson = false; //print digests as JSON
+static int daemonSock = -1;
+static char socketPath[108];
 
 static struct option long_options[] = {
     {"bank",         required_argument, 0, 'b'},
+    {"chunk-size",   required_argument, 0, 'C'},
+    {"byte-order",   required_argument, 0, 0x10C},
     {"cic",          required_argument, 0, 'c'},
+    {"compress",     required_argument, 0, 0x10D},
+    {"daemon",       no_argument,       0, 0x100},
+    {"digest",       required_argument, 0, 0x109},
     {"dump",         required_argument, 0, 'd'},
+    {"fine-delta",   no_argument,       0, 0x106},
+    {"forget",       no_argument,       0, 0x104},
     {"help",         no_argument,       0, 'h'},
     {"info",         no_argument,       0, 'i'},
+    {"json",         no_argument,       0, 0x10A},
     {"load",         required_argument, 0, 'l'},
     {"list-devices", no_argument,       0, 'L'},
+    {"no-daemon",    no_argument,       0, 0x101},
+    {"no-delta",     no_argument,       0, 0x103},
+    {"no-fix-crc",   no_argument,       0, 0x10B},
+    {"no-tune",      no_argument,       0, 'N'},
     {"offset",       required_argument, 0, 'o'},
+    {"queue-depth",  required_argument, 0, 'Q'},
     {"quiet",        no_argument,       0, 'q'},
+    {"read-ahead",   required_argument, 0, 'R'},
+    {"resume",       no_argument,       0, 0x107},
     {"size",         required_argument, 0, 's'},
+    {"socket",       required_argument, 0, 0x102},
+    {"sparse",       required_argument, 0, 0x10E},
+    {"transport",    required_argument, 0, 'T'},
     {"verbose",      no_argument,       0, 'v'},
+    {"unsparse",     required_argument, 0, 0x10F},
+    {"verify",       required_argument, 0, 0x108},
+    {"watch",        required_argument, 0, 0x105},
+    {"write-behind", required_argument, 0, 'W'},
     {0, 0, 0, 0}
 };
 
@@ -30,77 +64,6 @@ static struct {
     {NULL, 0}
 };
 
-static struct {
-    int num;
-    int cic;
-    uint32_t crc32; //of bootcode
-    const char *desc;
-} cic_types[] = { //XXX missing CRCs
-    {6101, CIC_6101, 0x6170A4A1, "Star Fox"},
-    {6102, CIC_6102, 0x90BB6CB5, "most NTSC games"},
-    {7101, CIC_7101, 0xFFFFFFFF, "most PAL games"},
-    {7102, CIC_7102, 0xFFFFFFFF, "Lylat Wars"},
-    { 103, CIC_X103, 0x0B050EE0, "covers 6103 and 7103"},
-    { 105, CIC_X105, 0x98BC2C86, "covers 6105 and 7105"},
-    { 106, CIC_X106, 0xACC8580A, "covers 6106 and 7106"},
-    {5101, CIC_5101, 0xFFFFFFFF, "Aleck64"},
-    //8303: JP 64DD (not dumped)
-    {0, 0, 0, NULL}
-};
-
-uint32_t swap_endian(uint32_t val) {
-    return ((val << 24)) |
-           ((val << 8) & 0x00ff0000) |
-           ((val >> 8) & 0x0000ff00) |
-           ((val >> 24));
-}
-
-
-int fail_ftdi(struct ftdi_context* ftdi, const char *msg) {
-    fprintf(stderr, "%s: %s\n", msg, ftdi_get_error_string(ftdi));
-    return EXIT_FAILURE;
-}
-
-
-uint32_t crc32(const uint8_t *data, size_t len) {
-    //copied from http://n64dev.org/n64crc.html
-
-    static uint32_t crc_table[256];
-    static int isInit = 0;
-    if(!isInit) { //generate CRC table
-        uint32_t poly = 0xEDB88320;
-        for(int i = 0; i < 256; i++) {
-            uint32_t crc = i;
-            for(int j = 8; j > 0; j--) {
-                if (crc & 1) crc = (crc >> 1) ^ poly;
-                else crc >>= 1;
-            }
-            crc_table[i] = crc;
-        }
-        isInit = 1;
-    }
-
-    uint32_t crc = ~0;
-	for(size_t i = 0; i < len; i++) {
-		crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xFF];
-	}
-	return ~crc;
-}
-
-
-int get_cic(FILE *rom) {
-    //copied from http://n64dev.org/n64crc.html
-    uint8_t data[0xFC0];
-    fseek(rom, 0x40, SEEK_SET);
-    fread(data, 1, sizeof(data), rom); //read bootcode
-    uint32_t crc = crc32(data, sizeof(data));
-    if(verbosity > 0) printf(" * Bootcode CRC32: 0x%08X\n", crc);
-    for(int i=0; cic_types[i].num; i++) {
-        if(cic_types[i].crc32 == crc) return i;
-    }
-    return -1;
-}
-
 
 int list_devices(struct ftdi_context* ftdi) {
     struct ftdi_device_list *devices;
@@ -133,373 +96,6 @@ int list_devices(struct ftdi_context* ftdi) {
 }
 
 
-int device_send_cmd(sixtyfourDrive *device, uint8_t cmd, uint8_t nParams,
-uint32_t *params, uint8_t *resp, uint32_t respLen) {
-    uint8_t tx_buf[32];
-
-    memset(tx_buf, 0, sizeof(tx_buf));
-    tx_buf[0] = cmd;
-    tx_buf[1] = 'C';
-    tx_buf[2] = 'M';
-    tx_buf[3] = 'D';
-
-    if(nParams >= sizeof(tx_buf) / sizeof(uint32_t)) {
-        fprintf(stderr, "Too many params for command\n");
-        return -1;
-    }
-
-    uint32_t *paramBuf = (uint32_t*)&tx_buf[4];
-    for(int i=0; i<nParams; i++) {
-        paramBuf[i] = swap_endian(params[i]);
-    }
-
-    if(verbosity > 2) printf(" * Sending command 0x%02X\n", cmd);
-
-    int err = ftdi_write_data(device->ftdi, tx_buf, 4 + (nParams * 4));
-    if(err <= 0) {
-        fprintf(stderr, "device_send_cmd(0x%02X) write failed: %s\n",
-            cmd, ftdi_get_error_string(device->ftdi));
-        return err;
-    }
-
-    if(respLen > 0) {
-        err = ftdi_read_data(device->ftdi, resp, respLen);
-        if(err <= 0) {
-            fprintf(stderr, "device_send_cmd(0x%02X) read failed: %s\n",
-                cmd, ftdi_get_error_string(device->ftdi));
-        }
-    }
-
-    return err;
-}
-
-
-int device_get_version(sixtyfourDrive *device) {
-    uint8_t response[64];
-    int err = device_send_cmd(device, DEV_CMD_GETVER, 0, NULL,
-        response, sizeof(response));
-    if(err <= 0) {
-        fprintf(stderr, "device_get_version() failed: %s\n"
-            "Try unplugging 64drive USB cable and turning off console.\n",
-            ftdi_get_error_string(device->ftdi));
-        return err;
-    }
-
-    int tries = 0;
-    while(1) {
-        int err = device_send_cmd(device, DEV_CMD_GETVER, 0, NULL,
-            response, sizeof(response));
-        if(err <= 0) {
-            fprintf(stderr, "device_get_version() failed: %s\n",
-                ftdi_get_error_string(device->ftdi));
-            return err;
-        }
-
-        uint32_t *data = (uint32_t*)response;
-        uint32_t magic = swap_endian(data[1]);
-        if(magic == DEV_MAGIC) break;
-
-        if(verbosity > 0) {
-            fprintf(stderr, " ! incorrect magic 0x%08X, expected 0x%08X\n",
-                magic, DEV_MAGIC);
-        }
-
-        if(++tries >= 4) {
-            fprintf(stderr,
-                "\nCommunication failure.\n"
-                "Unplug USB cable, turn off N64, then try again.\n");
-            return -1;
-        }
-    }
-
-    /* if(verbosity > 0) {
-        printf(" * HW revision: %c%c\n", response[0], response[1]);
-    } */
-    device->variant[0] = response[0];
-    device->variant[1] = response[1];
-    device->variant[2] = response[2];
-    return (response[0] << 24) | (response[1] << 16) | (response[2] << 8);
-}
-
-
-int device_upload(sixtyfourDrive *device, FILE *file, int64_t size,
-uint32_t offset, int bank) {
-    /** Upload file to device.
-     *  file:   File to upload.
-     *  size:   Size to upload. If -1, upload entire file (minus seek position).
-     *  offset: Offset to upload to.
-     *  bank:   Bank to upload to.
-     *  Will upload from the file's current seek position to the specified size.
-     */
-
-    if(size < 0) {
-        int64_t cur = ftell(file);
-        fseek(file, 0, SEEK_END);
-        size = ftell(file) - cur;
-        fseek(file, cur, SEEK_SET); //restore position
-    }
-
-    //determine ideal chunk size
-    uint32_t chunkSize;
-    if(size > 16 * 1024 * 1024) chunkSize = 32;
-    else if(size > 2 * 1024 * 1024) chunkSize = 16;
-    else chunkSize = 4;
-    if(verbosity > 1) printf(" * Chunk size: %d => %d\n",
-        chunkSize, (chunkSize * 128 * 1024) & 0xffffff);
-    chunkSize *= 128 * 1024; // convert to megabytes
-    if(chunkSize > size) chunkSize = size;
-
-    uint8_t *buffer = (uint8_t*)malloc(chunkSize);
-    if(!buffer) {
-        fprintf(stderr, "device_upload(): out of memory\n");
-        return -1;
-    }
-
-    int err = ftdi_write_data_set_chunksize(device->ftdi, chunkSize);
-    if(err) {
-        fprintf(stderr, "device_upload() set chunk size failed: %s\n",
-            ftdi_get_error_string(device->ftdi));
-        free(buffer);
-        return err;
-    }
-
-    if(verbosity > 0) {
-        printf(" * Uploading %" PRId64 " Kbytes to offset 0x%06X\n",
-            size / 1024, offset);
-    }
-    for(int64_t readPos=0; readPos<size;) {
-        fread(buffer, chunkSize, 1, file);
-
-        uint32_t params[2] = {offset, (chunkSize & 0xffffff) | bank << 24};
-        device_send_cmd(device, DEV_CMD_LOADRAM, 2, params, NULL, 0);
-
-        int nSent = -1;
-        for(int tries=0; tries<5; tries++) {
-            nSent = ftdi_write_data(device->ftdi, buffer, chunkSize);
-            if(nSent > 0) break;
-
-            //wait, flush, retry
-            usleep(10000);
-            ftdi_usb_purge_buffers(device->ftdi);
-        }
-        if(nSent <= 0) {
-            fprintf(stderr, "\ndevice_upload() write failed "
-                "(after %" PRId64 " bytes): %s\n", readPos,
-                ftdi_get_error_string(device->ftdi));
-            free(buffer);
-            return nSent;
-        }
-
-        offset += nSent;
-        readPos += nSent;
-        if(verbosity >= 0) {
-            printf("\r * Uploading... %3" PRId64 "%%", (readPos * 100) / size);
-            fflush(stdout);
-        }
-    }
-    if(verbosity >= 0) printf("\r * Uploading... Done.\n");
-    free(buffer);
-    return 0;
-}
-
-
-int device_download(sixtyfourDrive *device, FILE *file, int64_t size,
-uint32_t offset, int bank, bool standalone) {
-    /** Download file from device.
-     *  file:       File to write to.
-     *  size:       Size to download.
-     *  offset:     Offset to download from.
-     *  bank:       Bank to download from.
-     *  standalone: Standalone mode, i.e. read from attached cartridge
-     */
-
-    if(size < 0) {
-        //XXX get bank size
-        size = 256 * 1024 * 1024; //256 MBytes
-    }
-
-    //determine ideal chunk size
-    uint32_t chunkSize;
-    if(standalone) chunkSize = 512;
-    else if(size > 16 * 1024 * 1024) chunkSize = 32;
-    else if(size > 2 * 1024 * 1024) chunkSize = 16;
-    else chunkSize = 4;
-    if(verbosity > 1) printf(" * Chunk size: %d => %d\n",
-        chunkSize, chunkSize * 128 * 1024);
-    if(!standalone) chunkSize *= 128 * 1024; // convert to megabytes for RAM dump
-    if(chunkSize > size) chunkSize = size;
-
-    uint8_t *buffer = (uint8_t*)malloc(chunkSize);
-    if(!buffer) {
-        fprintf(stderr, "device_download(): out of memory\n");
-        return -1;
-    }
-
-    int err = ftdi_read_data_set_chunksize(device->ftdi, chunkSize);
-    if(err) {
-        fprintf(stderr, "device_download() set chunk size failed: %s\n",
-            ftdi_get_error_string(device->ftdi));
-        free(buffer);
-        return err;
-    }
-
-    if(verbosity > 0) printf(" * Downloading %" PRId64 " Kbytes\n", size / 1024);
-    if (standalone) {
-        if(verbosity > 0) printf(" * Entering standalone mode\n");
-        uint8_t response[4];
-        device_send_cmd(device, DEV_CMD_STD_ENTER, 0, NULL, response, sizeof(response));
-    }
-
-    for(int64_t readPos=0; readPos<size;) {
-        if(standalone) {
-            uint32_t params[2] = {offset | 0x10 << 24, chunkSize/4};
-            device_send_cmd(device, DEV_CMD_PI_RD_BURST, 2, params, NULL, 0);
-        } else {
-            uint32_t params[2] = {offset, (chunkSize & 0xffffff) | bank << 24};
-            device_send_cmd(device, DEV_CMD_DUMPRAM, 2, params, NULL, 0);
-        }
-
-        int nRecv = -1;
-        for(int tries=0; tries<5; tries++) {
-            nRecv = ftdi_read_data(device->ftdi, buffer, chunkSize);
-            if(nRecv > 0) break;
-
-            //wait, flush, retry
-            usleep(10000);
-            ftdi_usb_purge_buffers(device->ftdi);
-        }
-        if(nRecv <= 0) {
-            fprintf(stderr, "\ndevice_download() read failed "
-                "(after %" PRId64 " bytes): %s\n", readPos,
-                ftdi_get_error_string(device->ftdi));
-            free(buffer);
-            return nRecv;
-        }
-        fwrite(buffer, nRecv, 1, file);
-
-        offset += nRecv;
-        readPos += nRecv;
-        if(verbosity >= 0) {
-            printf("\r * Downloading... %3" PRId64 "%%", (readPos * 100) / size);
-            fflush(stdout);
-        }
-    }
-    if(verbosity >= 0) printf("\r * Downloading... Done.\n");
-    if(standalone) {
-        if (verbosity > 0) printf(" * Leaving standalone mode");
-        uint8_t response[4];
-        device_send_cmd(device, DEV_CMD_STD_LEAVE, 0, NULL, response, sizeof(response));
-    }
-    free(buffer);
-    return 0;
-}
-
-
-int device_set_cic(sixtyfourDrive *device, int cic) {
-    if(device->variant[0] == 'A') {
-        fprintf(stderr, "This device does not support changing CIC mode.\n");
-        return -1;
-    }
-
-    if(verbosity > 0) {
-        printf(" * Selecting CIC %d (#%d)\n", cic_types[cic].num, cic);
-    }
-
-    uint32_t param = (1 << 31) | cic;
-    return device_send_cmd(device, DEV_CMD_SETCIC, 1, &param, NULL, 0);
-}
-
-
-int device_open(sixtyfourDrive *device) {
-    //return device version: 2=HW2 1=HW1 0=not found
-    static struct {
-        uint16_t vid, pid;
-        int version;
-        const char *descr;
-    } devices[] = {
-        {0x0403, 0x6014, 2, "64drive USB device"},
-        {0x0403, 0x6010, 1, "64drive USB device A"},
-        {0x0403, 0x6010, 1, "64drive USB device"},
-        {0, 0, 0, NULL}
-    };
-
-    for(int i=0; devices[i].vid; i++) {
-        int err = ftdi_usb_open_desc(device->ftdi,
-            devices[i].vid, devices[i].pid, devices[i].descr, NULL);
-        if(!err) {
-            device->version = devices[i].version;
-            return device->version;
-        }
-        if(err != -3) {
-            fprintf(stderr, "device_open(): %s\n",
-                ftdi_get_error_string(device->ftdi));
-        }
-    }
-
-    return 0;
-}
-
-
-int device_init(sixtyfourDrive *device) {
-    if(verbosity > 1) printf(" * Resetting device\n");
-    int err = ftdi_usb_reset(device->ftdi);
-    if(err) return fail_ftdi(device->ftdi, "ftdi_usb_reset");
-
-    if(device->version == 2) {
-        if(verbosity > 1) printf(" * Setting synchronous mode\n");
-
-        err = ftdi_set_bitmode(device->ftdi, 0xFF, BITMODE_RESET);
-        if(err) return fail_ftdi(device->ftdi, "ftdi_set_bitmode(BITMODE_RESET)");
-
-        err = ftdi_set_bitmode(device->ftdi, 0xFF, BITMODE_SYNCFF);
-        if(err) return fail_ftdi(device->ftdi, "ftdi_set_bitmode(BITMODE_SYNCFF)");
-    }
-    err = ftdi_set_latency_timer(device->ftdi, 255);
-    if(err) return fail_ftdi(device->ftdi, "ftdi_set_latency_timer");
-
-    if(verbosity > 1) printf(" * Purging buffers\n");
-    err = ftdi_usb_purge_buffers(device->ftdi);
-    if(err) return fail_ftdi(device->ftdi, "ftdi_usb_purge_buffers");
-
-    return 1;
-}
-
-
-int setup_device(sixtyfourDrive *device) {
-    device->ftdi = ftdi_new();
-    if(!device->ftdi) {
-        return fail_ftdi(device->ftdi, "ftdi_new");
-    }
-
-    int ver = device_open(device);
-    if(ver < 1) {
-        fprintf(stderr, "64drive device not found.\n");
-        ftdi_free(device->ftdi);
-        return EXIT_FAILURE;
-    }
-    if(verbosity > 0) printf(" * Found 64drive version %d\n", device->version);
-
-    if(!device_init(device)) {
-        ftdi_deinit(device->ftdi);
-        return EXIT_FAILURE;
-    }
-
-    if(device_get_version(device) <= 0) {
-        ftdi_deinit(device->ftdi);
-        return EXIT_FAILURE;
-    }
-
-    return EXIT_SUCCESS;
-}
-
-
-void shutdown_device(sixtyfourDrive *device) {
-    if(device->ftdi == NULL) return;
-    ftdi_usb_close(device->ftdi);
-    ftdi_deinit(device->ftdi);
-}
-
-
 void show_help() {
     printf(
         "64drive USB tool for Linux\n"
@@ -511,18 +107,93 @@ void show_help() {
         "usage: 64drive options...\n"
         "options:\n"
         "  -b, --bank BANK      up/download to specified bank (default: rom)\n"
+        "      --byte-order ORD byte order of ROM files: z64, v64 or n64.\n"
+        "                       Uploads are converted from it and dumps to "
+        "it.\n"
+        "                       Default: auto (detect uploads, dump as z64)\n"
         "  -c, --cic  CIC       set CIC type (HW2 RevB only)\n"
+        "  -C, --chunk-size N   transfer N bytes per command "
+        "(multiple of 512)\n"
+        "                       (also turns off tuning)\n"
+        "      --compress FMT   compress dumps as they come in: zstd or xz "
+        "(FMT:LEVEL\n"
+        "                       for a level other than the default), "
+        "or none.\n"
+        "                       Default: auto (by a name ending in .zst "
+        "or .xz)\n"
+        "      --daemon         keep the device open and serve other 64drive\n"
+        "                       commands until interrupted\n"
+        "      --digest LIST    print digests of each up/download, hashed as "
+        "it goes:\n"
+        "                       crc32,md5,sha1,xxh64 or all\n"
         "  -d, --dump FILE      download file from cartridge\n"
+        "      --fine-delta     keep a copy of the last ROM upload, to send "
+        "only the\n"
+        "                       512-byte windows that changed\n"
+        "      --forget         forget what was uploaded before, so the "
+        "next uploads\n"
+        "                       are sent whole\n"
         "  -h, --help           show help and exit\n"
         "  -i, --info           show device info (version)\n"
-        "  -l, --load FILE      upload file to cartridge\n"
+        "      --json           print digests as JSON, one object per line "
+        "(all of\n"
+        "                       them unless --digest says otherwise)\n"
+        "  -l, --load FILE      upload file to cartridge; it may be compressed\n"
+        "                       (gzip, xz, zstd or zip, as this build allows)\n"
         "  -L, --list-devices   list FTDI devices\n"
+        "      --no-daemon      use the device directly even if a daemon "
+        "is running\n"
+        "      --no-delta       send whole files, even parts the device "
+        "already has\n"
+        "      --no-fix-crc     upload ROMs with stale header checksums as "
+        "they are,\n"
+        "                       rather than correcting them on the device\n"
+        "  -N, --no-tune        don't tune chunk size and queue depth "
+        "for this device\n"
         "  -o, --offset OFFSET  upload to/download from specified offset "
         "(default: 0)\n"
         "  -q, --quiet          be quiet (no progress indicators)\n"
+        "  -Q, --queue-depth N  keep N chunks in flight during up/downloads "
+        "(default: 4)\n"
+        "                       (also turns off tuning)\n"
+        "  -R, --read-ahead N   read up to N chunks ahead of the upload "
+        "(default: 4)\n"
+        "      --resume         keep a journal beside each following dump, "
+        "and pick\n"
+        "                       up where an interrupted one left off\n"
+        "      --socket PATH    daemon socket (default: "
+        "$XDG_RUNTIME_DIR/64drive.sock)\n"
+        "      --sparse MODE    leave blocks of fill in dumps as holes, so "
+        "they take\n"
+        "                       no space: zero for 0x00, ff for 0x00 and "
+        "0xFF (listed\n"
+        "                       in FILE" SPARSE_MAP_SUFFIX
+        " for --unsparse), or off (default)\n"
+        "  -T, --transport NAME use transport NAME[:OPTIONS] (default: ftdi)\n"
+        "                       \"sim\" simulates a 64drive in memory; "
+        "options are\n"
+        "                       bw=MB/s,lat=us,short=P,fault=P,timeout=ms,"
+        "seed=N,\n"
+        "                       burst=BYTES,cart=BYTES,mirror=1,flip=P\n"
+        "                       \"usb\" queues bulk transfers through libusb "
+        "directly;\n"
+        "                       options are depth=N,urb=KB,timeout=ms\n"
         "  -v, --verbose        be verbose (repeat for more verbosity)\n"
+        "      --unsparse FILE  put the 0xFF a dump with --sparse ff left "
+        "out back\n"
+        "      --verify N       read dumps N times, re-reading blocks that "
+        "differ\n"
+        "                       until most reads agree, and list them\n"
+        "      --watch FILE     upload FILE, then again each time it's "
+        "rewritten,\n"
+        "                       until interrupted\n"
+        "  -W, --write-behind N let up to N downloaded chunks wait to be "
+        "written\n"
+        "                       (default: 4)\n"
         "  -z, --size SIZE      up/download specified size "
-        "(default: entire file)\n"
+        "(default: entire file,\n"
+        "                       or for dumps the bank, stopping where a ROM "
+        "ends)\n"
         "      (must be multiple of 512)\n"
         "\n"
         "CIC is one of:\n"
@@ -544,6 +215,17 @@ void show_help() {
         "-b sets the bank for ALL following up/downloads (until another -b).\n"
         "-o and -s set the offset and size for ONLY THE NEXT up/download.\n"
         "\n"
+        "Chunk size and queue depth are tuned per device by measuring each\n"
+        "transfer; results are kept in ~/.config/64drive/profiles.\n"
+        "\n"
+        "Uploads of 256K or more only send the 64K blocks that changed since\n"
+        "the last upload to the same place, as recorded per device in\n"
+        "~/.cache/64drive. A few blocks are read back first to check the\n"
+        "device still holds that upload.\n"
+        "\n"
+        "While a daemon is running, other invocations pass their requests to\n"
+        "it instead of opening the device, skipping the USB setup each time.\n"
+        "\n"
         "Args are processed in the order given, so eg:\n"
         "  64drive -l file.rom -b eeprom -l file.sav\n"
         "will upload file.rom to ROM and file.sav to EEPROM.\n"
@@ -555,15 +237,200 @@ void show_help() {
 void setup_or_die(sixtyfourDrive *device) {
     static int is_setup = 0;
     if(is_setup) return;
+    if(useDaemon) {
+        daemonSock = daemon_connect(socketPath);
+        if(daemonSock >= 0) {
+            if(verbosity > 0) printf(" * Using daemon on %s\n", socketPath);
+            is_setup = 1;
+            return;
+        }
+    }
     int err = setup_device(device);
     if(err) exit(err);
     is_setup = 1;
 }
 
 
+static int call_daemon(int op, int bank, int64_t size, uint32_t offset,
+int arg, int fileFd, int sideFd, daemonResponse *resp) {
+    //pass a request to the daemon with our current settings
+    daemonRequest req;
+    daemonResponse tmp;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.verbosity = verbosity;
+    req.bank = bank;
+    req.size = size;
+    req.offset = offset;
+    req.arg = arg;
+    req.opts = transfer_opts;
+    return daemon_call(daemonSock, &req, fileFd, sideFd,
+        resp ? resp : &tmp);
+}
+
+
+static void show_digest(const digestResult *digest, const char *op,
+const char *path, FILE *out) {
+    //print the digests of an up/download, if any were asked for
+    digest_print(digest, op, path, digestJson, out);
+    fflush(out);
+}
+
+
+static int upload_file(sixtyfourDrive *device, const char *path, int bank,
+int64_t size, uint32_t offset, int autoCIC) {
+    //upload a file given on the command line, directly or via the daemon
+    FILE *file;
+    if(!strcmp(path, "-")) { file = stdin; verbosity = -1; }
+    else file = fopen(path, "rb");
+    if(!file) {
+        fprintf(stderr, "Failed opening \"%s\": %s\n", path,
+            strerror(errno));
+        return -1;
+    }
+
+    int result;
+    daemonResponse resp;
+    memset(&resp, 0, sizeof(resp));
+    transfer_digest = &resp.digest;
+    if(daemonSock >= 0) {
+        result = call_daemon(DAEMON_OP_UPLOAD, bank, size, offset,
+            autoCIC, fileno(file), -1, &resp);
+    }
+    else result = load_file(device, file, size, offset, bank, autoCIC);
+    transfer_digest = NULL;
+    fclose(file);
+    if(!result) show_digest(&resp.digest, "upload", path, stdout);
+    return result;
+}
+
+
+static int download_file(sixtyfourDrive *device, const char *path, int bank,
+int64_t size, uint32_t offset, bool standalone) {
+    //download to a file given on the command line, directly or via the
+    //daemon, keeping a journal beside it with --resume, or a map of the
+    //0xFF left out of it with --sparse ff
+    FILE *file, *journal = NULL, *map = NULL;
+    char journalPath[4200], mapPath[4200];
+    int compress = transfer_opts.compress; //auto goes by the file name
+    int format = (compress == COMPRESS_AUTO) ? compress_from_name(path)
+        : compress;
+    if(resumeDumps && format != COMPRESS_NONE) {
+        fprintf(stderr, "Can't resume a compressed dump\n");
+        return -1;
+    }
+    if(resumeDumps && transfer_opts.sparse == SPARSE_FF) {
+        fprintf(stderr, "Can't resume a dump with 0xFF left out\n");
+        return -1;
+    }
+
+    if(!strcmp(path, "-")) {
+        file = stdout;
+        verbosity = -1;
+    }
+    else if(resumeDumps) {
+        file = fopen(path, "r+b");
+        if(!file && errno == ENOENT) file = fopen(path, "w+b");
+        snprintf(journalPath, sizeof(journalPath), "%s.journal", path);
+        journal = fopen(journalPath, "r+");
+        if(!journal && errno == ENOENT) journal = fopen(journalPath, "w+");
+        if(file && !journal) {
+            fprintf(stderr, "Failed opening \"%s\": %s\n", journalPath,
+                strerror(errno));
+            fclose(file);
+            return -1;
+        }
+    }
+    else file = fopen(path, transfer_opts.verifyPasses > 1 ? "w+b" : "wb");
+    if(!file) {
+        fprintf(stderr, "Failed opening \"%s\": %s\n", path,
+            strerror(errno));
+        if(journal) fclose(journal);
+        return -1;
+    }
+
+    if(transfer_opts.sparse == SPARSE_FF && file != stdout
+    && format == COMPRESS_NONE) {
+        snprintf(mapPath, sizeof(mapPath), "%s" SPARSE_MAP_SUFFIX, path);
+        map = fopen(mapPath, "w");
+        if(!map) {
+            fprintf(stderr, "Failed opening \"%s\": %s\n", mapPath,
+                strerror(errno));
+            fclose(file);
+            return -1;
+        }
+    }
+
+    int result;
+    daemonResponse resp;
+    memset(&resp, 0, sizeof(resp));
+    transfer_digest = &resp.digest;
+    transfer_opts.compress = format;
+    if(daemonSock >= 0) {
+        fflush(file);
+        int sideFd = journal ? fileno(journal) : map ? fileno(map) : -1;
+        result = call_daemon(DAEMON_OP_DOWNLOAD, bank, size, offset,
+            standalone, fileno(file), sideFd, &resp);
+    }
+    else {
+        result = device_download(device, file, size, offset, bank,
+            standalone, journal, map);
+    }
+    transfer_digest = NULL;
+    transfer_opts.compress = compress;
+    if(file != stdout) fclose(file);
+    if(!result) {
+        show_digest(&resp.digest, "dump", path,
+            (file == stdout) ? stderr : stdout);
+    }
+    if(journal) {
+        fclose(journal);
+        if(!result) unlink(journalPath);
+        else fprintf(stderr, " * Run again with --resume to continue\n");
+    }
+    if(map) { //only kept if something was left out
+        struct stat st;
+        if(!fstat(fileno(map), &st) && !st.st_size) unlink(mapPath);
+        fclose(map);
+    }
+    return result;
+}
+
+
+typedef struct {
+    sixtyfourDrive *device;
+    int bank;
+    int64_t size;
+    uint32_t offset;
+    int autoCIC;
+    bool viaDaemon; //connect to the daemon for each upload
+} watchTarget;
+
+
+static int watch_upload(const char *path, void *arg) {
+    //the daemon serves one client at a time, so don't hold on to it
+    //between uploads, when others may want it
+    watchTarget *target = (watchTarget*)arg;
+    if(target->viaDaemon) {
+        daemonSock = daemon_connect(socketPath);
+        if(daemonSock < 0) {
+            fprintf(stderr, "Can't reach the daemon on %s\n", socketPath);
+            return -1;
+        }
+    }
+    int result = upload_file(target->device, path, target->bank,
+        target->size, target->offset, target->autoCIC);
+    if(target->viaDaemon) {
+        close(daemonSock);
+        daemonSock = -1;
+    }
+    return result;
+}
+
+
 int main(int argc, char **argv) {
     sixtyfourDrive device;
-    device.ftdi = NULL;
+    memset(&device, 0, sizeof(device));
 
     int bank = BANK_CARTROM;
     int64_t fileSize = -1, fileOffset = 0;
@@ -573,10 +440,11 @@ int main(int argc, char **argv) {
         show_help();
         return EXIT_SUCCESS;
     }
+    if(daemon_socket_path(socketPath, sizeof(socketPath))) socketPath[0] = 0;
 
     while(1) {
         int c = getopt_long(argc, argv,
-            "b:c:d:D:z:hil:Lo:qs:v", long_options, NULL);
+            "b:c:C:d:D:z:hil:LNo:qQ:R:s:T:vW:", long_options, NULL);
         if(c < 0) break;
         switch(c) {
             case 'b': { //specify bank
@@ -615,7 +483,11 @@ int main(int argc, char **argv) {
                             //with Windows version; eg 3 = 7102
                             cic = cic_types[i].cic;
                             setup_or_die(&device);
-                            device_set_cic(&device, cic_types[i].cic);
+                            if(daemonSock >= 0) {
+                                call_daemon(DAEMON_OP_SETCIC, bank, 0, 0,
+                                    cic_types[i].cic, -1, -1, NULL);
+                            }
+                            else device_set_cic(&device, cic_types[i].cic);
                             break;
                         }
                     }
@@ -626,24 +498,27 @@ int main(int argc, char **argv) {
                 }
                 break;
             }
-            case 'D': //dump real cartridge
-            case 'd': { //dump RAM
-                setup_or_die(&device);
+            case 'C': { //set chunk size
+                //0 would mean tuning it, so make that fail too
+                unsigned long size = strtoul(optarg, NULL, 0);
+                transfer_opts.chunkSize = (size && size <= UINT32_MAX)
+                    ? size : 1;
+                if(transfer_check_opts(&transfer_opts)) return EXIT_FAILURE;
+                break;
+            }
 
-                FILE *file;
-                if(!strcmp(optarg, "-")) { file = stdout; verbosity = -1; }
-                else file = fopen(optarg, "wb");
-                if(!file) {
-                    fprintf(stderr, "Failed opening \"%s\": %s\n", optarg,
-                        strerror(errno));
-                    break;
+            case 'D': //dump real cartridge
+            case 'd': //dump RAM
+                if(resumeDumps && !strcmp(optarg, "-")) {
+                    fprintf(stderr, "Can't resume a dump to stdout\n");
+                    return EXIT_FAILURE;
                 }
-                device_download(&device, file, fileSize, fileOffset, bank, c == 'D');
-                fclose(file);
+                setup_or_die(&device);
+                download_file(&device, optarg, bank, fileSize, fileOffset,
+                    c == 'D');
                 fileSize = -1;
                 fileOffset = 0;
                 break;
-            }
 
             //f: update firmware (not implemented)
 
@@ -653,60 +528,43 @@ int main(int argc, char **argv) {
 
             case 'i': //info
                 setup_or_die(&device);
-                device_get_version(&device);
+                if(daemonSock >= 0) {
+                    daemonResponse resp;
+                    if(call_daemon(DAEMON_OP_INFO, bank, 0, 0, 0, -1, -1, &resp)) {
+                        break;
+                    }
+                    device.version = resp.version;
+                    memcpy(device.variant, resp.variant, sizeof(device.variant));
+                }
+                else device_get_version(&device);
                 printf("Device version: HW%d rev %c%c%c\n",
                     device.version, device.variant[0],
                     device.variant[1], device.variant[2]);
                 break;
 
-            case 'l': { //upload
+            case 'l': //upload
                 setup_or_die(&device);
-
-                FILE *file;
-                if(!strcmp(optarg, "-")) { file = stdin; verbosity = -1; }
-                else file = fopen(optarg, "rb");
-                if(!file) {
-                    fprintf(stderr, "Failed opening \"%s\": %s\n", optarg,
-                        strerror(errno));
-                    break;
-                }
-
-                if(autoCIC) {
-                    if(verbosity > 1) printf(" * Identifying CIC...\n");
-                    int cic = get_cic(file);
-                    if(cic < 0) {
-                        fprintf(stderr, " ! Auto CIC selection failed - "
-                            "unrecognized bootcode.\n");
-                    }
-                    else {
-                        if(verbosity > 0) {
-                            printf(" * Auto detected CIC: %d\n",
-                                cic_types[cic].num);
-                        }
-                        device_set_cic(&device, cic_types[cic].cic);
-                    }
-                }
-
-                device_upload(&device, file, fileSize, fileOffset, bank);
-                fclose(file);
+                upload_file(&device, optarg, bank, fileSize, fileOffset,
+                    autoCIC);
                 fileSize = -1;
                 fileOffset = 0;
                 break;
-            }
 
             case 'L': { //list devices
-                if(device.ftdi) {
-                    list_devices(device.ftdi);
-                }
-                else {
-                    device.ftdi = ftdi_new();
-                    list_devices(device.ftdi);
-                    ftdi_deinit(device.ftdi);
-                    device.ftdi = NULL;
+                struct ftdi_context *ftdi = ftdi_new();
+                if(!ftdi) {
+                    fprintf(stderr, "ftdi_new failed\n");
+                    break;
                 }
+                list_devices(ftdi);
+                ftdi_free(ftdi);
                 break;
             }
 
+            case 'N': //don't autotune
+                transfer_opts.autotune = false;
+                break;
+
             case 'o': //set offset
                 fileOffset = strtoul(optarg, NULL, 0); //XXX detect error
                 break;
@@ -715,23 +573,181 @@ int main(int argc, char **argv) {
                 verbosity = -1;
                 break;
 
+            case 'Q': //set queue depth
+                transfer_opts.queueDepth = atoi(optarg);
+                if(!transfer_opts.queueDepth) { //0 would mean tuning it
+                    transfer_opts.queueDepth = -1;
+                }
+                if(transfer_check_opts(&transfer_opts)) return EXIT_FAILURE;
+                break;
+
+            case 'R': //set read-ahead
+                transfer_opts.readAhead = atoi(optarg);
+                if(transfer_check_opts(&transfer_opts)) return EXIT_FAILURE;
+                break;
+
             //s: set save emulation type (not implemented)
             //was set size in old versions (changed to z)
 
+            case 'T': { //select transport
+                if(device.ctx) {
+                    fprintf(stderr, "-T must come before any device access\n");
+                    return EXIT_FAILURE;
+                }
+                device.transport = transport_find(optarg, &device.transportArgs);
+                if(!device.transport) {
+                    fprintf(stderr, "Unknown transport \"%s\"; one of:\n",
+                        optarg);
+                    for(int i=0; transports[i]; i++) {
+                        fprintf(stderr, "  %-6s %s\n", transports[i]->name,
+                            transports[i]->descr);
+                    }
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+
             case 'v': //verbose
                 verbosity++;
                 break;
 
+            case 'W': //set write-behind
+                transfer_opts.writeBehind = atoi(optarg);
+                if(transfer_check_opts(&transfer_opts)) return EXIT_FAILURE;
+                break;
+
             case 'z': //set size
                 fileSize = strtoul(optarg, NULL, 0); //XXX detect error
                 //printf("fileSize = %d\n", fileSize);
                 break;
 
+            case 0x100: { //daemon
+                useDaemon = false;
+                setup_or_die(&device);
+                int err = daemon_run(&device, socketPath);
+                shutdown_device(&device);
+                return err;
+            }
+
+            case 0x101: //no-daemon
+                useDaemon = false;
+                break;
+
+            case 0x102: //socket path
+                if(strlen(optarg) >= sizeof(socketPath)) {
+                    fprintf(stderr, "Socket path too long\n");
+                    return EXIT_FAILURE;
+                }
+                strcpy(socketPath, optarg);
+                break;
+
+            case 0x103: //no-delta
+                transfer_opts.delta = false;
+                break;
+
+            case 0x104: //forget previous uploads
+                setup_or_die(&device);
+                if(daemonSock >= 0) {
+                    call_daemon(DAEMON_OP_FORGET, bank, 0, 0, 0, -1, -1, NULL);
+                }
+                else delta_forget(&device);
+                break;
+
+            case 0x105: { //watch and upload on changes
+                if(!strcmp(optarg, "-")) {
+                    fprintf(stderr, "Can't watch stdin\n");
+                    return EXIT_FAILURE;
+                }
+                setup_or_die(&device);
+                watchTarget target = {&device, bank, fileSize,
+                    (uint32_t)fileOffset, autoCIC, daemonSock >= 0};
+                if(daemonSock >= 0) {
+                    close(daemonSock);
+                    daemonSock = -1;
+                }
+                int err = watch_file(optarg, watch_upload, &target);
+                shutdown_device(&device);
+                return err;
+            }
+
+            case 0x106: //fine-delta
+                transfer_opts.fineDelta = true;
+                break;
+
+            case 0x107: //resume dumps
+                resumeDumps = true;
+                break;
+
+            case 0x108: //verify dumps
+                transfer_opts.verifyPasses = atoi(optarg);
+                if(!transfer_opts.verifyPasses) { //0 is the default, of 1
+                    transfer_opts.verifyPasses = -1;
+                }
+                if(transfer_check_opts(&transfer_opts)) return EXIT_FAILURE;
+                break;
+
+            case 0x109: { //digests
+                int algos = digest_parse(optarg);
+                if(algos < 0) {
+                    fprintf(stderr, "Invalid digest list \"%s\" (crc32, md5, "
+                        "sha1, xxh64 or all)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                transfer_opts.digests = algos;
+                break;
+            }
+
+            case 0x10A: //digests as JSON
+                digestJson = true;
+                if(!transfer_opts.digests) transfer_opts.digests = DIGEST_ALL;
+                break;
+
+            case 0x10B: //no-fix-crc
+                transfer_opts.fixChecksum = false;
+                break;
+
+            case 0x10C: { //byte order
+                int order = byteorder_parse(optarg);
+                if(order < 0) {
+                    fprintf(stderr, "Invalid byte order \"%s\" (auto, z64, "
+                        "v64 or n64)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                transfer_opts.byteOrder = order;
+                break;
+            }
+
+            case 0x10D: //compress dumps
+                if(compress_parse(optarg, &transfer_opts.compress,
+                &transfer_opts.compressLevel)) {
+                    fprintf(stderr, "Invalid compression \"%s\" (none, "
+                        "auto, or zstd[:LEVEL] or xz[:LEVEL] if this build "
+                        "has them)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 0x10E: { //sparse dumps
+                int mode = sparse_parse(optarg);
+                if(mode < 0) {
+                    fprintf(stderr, "Invalid sparse mode \"%s\" (off, zero "
+                        "or ff)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                transfer_opts.sparse = mode;
+                break;
+            }
+
+            case 0x10F: //restore 0xFF left out of a dump
+                if(sparse_restore(optarg)) return EXIT_FAILURE;
+                break;
+
             default:
                 fprintf(stderr, "getopt returned 0x%02X '%c'\n", c, c);
         }
     }
 
+    if(daemonSock >= 0) close(daemonSock);
     shutdown_device(&device);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,172 @@
+#include "n64crc.h"
+
+/** ROM header checksums, as checked by the CIC at boot; after n64crc
+ *  (http://n64dev.org/n64crc.html). They cover the first megabyte after
+ *  the bootcode, with a seed and final mix that depend on the CIC.
+ *  The image is fed in pieces, so an upload can work them out from the
+ *  chunks it's already sending instead of reading the file again.
+ */
+
+
+static inline uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static inline uint32_t rol32(uint32_t val, int n) {
+    return n ? (val << n) | (val >> (32 - n)) : val;
+}
+
+
+void n64crc_init(n64crcState *st) {
+    memset(st, 0, sizeof(*st));
+    st->cic = -1;
+}
+
+
+static void start_sum(n64crcState *st) {
+    //identify the CIC from the bootcode, to know the seed
+    uint32_t seed;
+    st->cic = cic_from_bootcode(st->head + N64CRC_HEADER);
+    if(st->cic < 0) return;
+    switch(cic_types[st->cic].cic) {
+        case CIC_6101:
+        case CIC_6102:
+        case CIC_7101:
+        case CIC_7102: seed = 0xF8CA4DDC; break;
+        case CIC_X103: seed = 0xA3886759; break;
+        case CIC_X105: seed = 0xDF26F436; break;
+        case CIC_X106: seed = 0x1FEA617A; break;
+        default: //checksum not known
+            st->cic = -1;
+            return;
+    }
+    st->t1 = st->t2 = st->t3 = st->t4 = st->t5 = st->t6 = seed;
+}
+
+
+static void sum_words(n64crcState *st, const uint8_t *data, size_t nWords) {
+    /** Add words of the image starting at st->pos.
+     *  Each step of t2 depends on the one before through a comparison, so
+     *  this is one serial chain whatever the other sums do; it runs at a
+     *  few cycles per word.
+     */
+    uint32_t t1 = st->t1, t2 = st->t2, t3 = st->t3, t4 = st->t4,
+        t5 = st->t5, t6 = st->t6;
+    uint32_t pos = st->pos;
+    const uint8_t *key = st->head + N64CRC_HEADER + 0x710; //6105 only
+
+    if(cic_types[st->cic].cic == CIC_X105) {
+        for(size_t i = 0; i < nWords; i++, data += 4, pos += 4) {
+            uint32_t d = load_be32(data);
+            if(t6 + d < t6) t4++;
+            t6 += d;
+            t3 ^= d;
+            uint32_t r = rol32(d, d & 0x1F);
+            t5 += r;
+            if(t2 > d) t2 ^= r;
+            else t2 ^= t6 ^ d;
+            t1 += load_be32(key + (pos & 0xFF)) ^ d;
+        }
+    }
+    else {
+        for(size_t i = 0; i < nWords; i++, data += 4) {
+            uint32_t d = load_be32(data);
+            if(t6 + d < t6) t4++;
+            t6 += d;
+            t3 ^= d;
+            uint32_t r = rol32(d, d & 0x1F);
+            t5 += r;
+            if(t2 > d) t2 ^= r;
+            else t2 ^= t6 ^ d;
+            t1 += t5 ^ d;
+        }
+    }
+
+    st->t1 = t1;
+    st->t2 = t2;
+    st->t3 = t3;
+    st->t4 = t4;
+    st->t5 = t5;
+    st->t6 = t6;
+}
+
+
+void n64crc_feed(n64crcState *st, const uint8_t *data, size_t len) {
+    //take the next len bytes of the image; anything past the end of the
+    //checksummed part is ignored
+    if(st->pos < N64CRC_START) {
+        size_t n = N64CRC_START - st->pos;
+        if(n > len) n = len;
+        memcpy(st->head + st->pos, data, n);
+        st->pos += n;
+        data += n;
+        len -= n;
+        if(st->pos == N64CRC_START) start_sum(st);
+    }
+    if(st->pos >= N64CRC_END || !len) return;
+    if((int64_t)len > N64CRC_END - st->pos) len = N64CRC_END - st->pos;
+
+    //finish a word split between feeds
+    int have = st->pos & 3;
+    if(have) {
+        size_t n = 4 - have;
+        if(n > len) n = len;
+        memcpy(st->word + have, data, n);
+        data += n;
+        len -= n;
+        if(have + n < 4) {
+            st->pos += n;
+            return;
+        }
+        st->pos -= have;
+        if(st->cic >= 0) sum_words(st, st->word, 1);
+        st->pos += 4;
+    }
+
+    size_t nWords = len / 4;
+    if(st->cic >= 0) sum_words(st, data, nWords);
+    st->pos += nWords * 4;
+    memcpy(st->word, data + (nWords * 4), len & 3);
+    st->pos += len & 3;
+}
+
+
+int n64crc_result(n64crcState *st, uint32_t *crc) {
+    /** Get the checksums the header should have.
+     *  crc: Receives CRC1 and CRC2.
+     *  Returns 0, or -1 if the image was too short or its CIC isn't known.
+     */
+    if(st->pos < N64CRC_END || st->cic < 0) return -1;
+    switch(cic_types[st->cic].cic) {
+        case CIC_X103:
+            crc[0] = (st->t6 ^ st->t4) + st->t3;
+            crc[1] = (st->t5 ^ st->t2) + st->t1;
+            break;
+        case CIC_X106:
+            crc[0] = (st->t6 * st->t4) + st->t3;
+            crc[1] = (st->t5 * st->t2) + st->t1;
+            break;
+        default:
+            crc[0] = st->t6 ^ st->t4 ^ st->t3;
+            crc[1] = st->t5 ^ st->t2 ^ st->t1;
+            break;
+    }
+    return 0;
+}
+
+
+void n64crc_header(const n64crcState *st, uint32_t *crc) {
+    //the checksums the header has now
+    crc[0] = load_be32(st->head + N64CRC_OFFSET);
+    crc[1] = load_be32(st->head + N64CRC_OFFSET + 4);
+}
+
+
+void n64crc_patch(uint8_t *header, const uint32_t *crc) {
+    //put CRC1 and CRC2 into a header
+    for(int i=0; i<2; i++) {
+        uint32_t val = swap_endian(crc[i]);
+        memcpy(header + N64CRC_OFFSET + (i * 4), &val, sizeof(val));
+    }
+}
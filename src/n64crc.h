@@ -0,0 +1,26 @@
+#ifndef _N64CRC_H_
+#define _N64CRC_H_
+
+#include "64drive.h"
+
+#define N64CRC_HEADER 0x40     //header, before the bootcode
+#define N64CRC_START  0x1000   //checksummed data follows the bootcode
+#define N64CRC_END    (N64CRC_START + 0x100000)
+#define N64CRC_OFFSET 0x10     //of CRC1 and CRC2 in the header
+
+//the checksums in a ROM header, worked out from the image as it goes past
+typedef struct {
+    int64_t pos; //bytes of the image seen
+    uint8_t head[N64CRC_START]; //header and bootcode
+    int cic;     //index into cic_types, once the bootcode is seen; -1 if none
+    uint32_t t1, t2, t3, t4, t5, t6;
+    uint8_t word[4]; //bytes of a word split between feeds
+} n64crcState;
+
+void n64crc_init(n64crcState *st);
+void n64crc_feed(n64crcState *st, const uint8_t *data, size_t len);
+int n64crc_result(n64crcState *st, uint32_t *crc);
+void n64crc_header(const n64crcState *st, uint32_t *crc);
+void n64crc_patch(uint8_t *header, const uint32_t *crc);
+
+#endif //_N64CRC_H_
@@ -0,0 +1,31 @@
+#include <sys/stat.h>
+#include "paths.h"
+
+
+int user_file_path(char *buf, size_t len, bool cache, const char *name) {
+    /** Build the path of one of our per-user files.
+     *  cache: true for $XDG_CACHE_HOME (~/.cache), false for
+     *         $XDG_CONFIG_HOME (~/.config).
+     *  name:  File name within our directory there.
+     *  Creates the directory if needed. Returns 0 on success.
+     */
+    const char *base = getenv(cache ? "XDG_CACHE_HOME" : "XDG_CONFIG_HOME");
+    char dir[4096];
+    if(base && base[0]) {
+        mkdir(base, 0755);
+        snprintf(dir, sizeof(dir), "%s/64drive", base);
+    }
+    else {
+        const char *home = getenv("HOME");
+        if(!home || !home[0]) return -1;
+        snprintf(dir, sizeof(dir), "%s/%s", home,
+            cache ? ".cache" : ".config");
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/%s/64drive", home,
+            cache ? ".cache" : ".config");
+    }
+    if(mkdir(dir, 0755) && errno != EEXIST) return -1;
+
+    if(snprintf(buf, len, "%s/%s", dir, name) >= (int)len) return -1;
+    return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef _PATHS_H_
+#define _PATHS_H_
+
+#include "64drive.h"
+
+int user_file_path(char *buf, size_t len, bool cache, const char *name);
+
+#endif //_PATHS_H_
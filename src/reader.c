@@ -0,0 +1,121 @@
+#include "reader.h"
+#include "futex.h"
+
+
+static void* reader_thread(void *arg) {
+    chunkReader *reader = (chunkReader*)arg;
+    uint32_t head = reader->head.load(std::memory_order_relaxed);
+
+    while(reader->size > 0
+    && !reader->stop.load(std::memory_order_acquire)) {
+        uint32_t tail = reader->tail.load(std::memory_order_acquire);
+        if(head - tail >= reader->depth) { //ring full
+            futex_wait(&reader->tail, tail);
+            continue;
+        }
+
+        readerChunk *chunk = &reader->chunks[head % reader->depth];
+        uint8_t *data = chunk->buf + reader->headroom;
+        uint32_t len = reader->chunkSize;
+        if(len > reader->size) len = reader->size;
+
+        size_t nRead = fread(data, 1, len, reader->file);
+        chunk->error = 0;
+        if(nRead < len) {
+            if(ferror(reader->file)) chunk->error = errno ? errno : EIO;
+            //size given beyond end of file; pad with zeros
+            memset(data + nRead, 0, len - nRead);
+        }
+        chunk->len = len;
+        reader->size -= len;
+
+        reader->head.store(++head, std::memory_order_release);
+        futex_wake(&reader->head);
+        if(chunk->error) break;
+    }
+    return NULL;
+}
+
+
+int reader_start(chunkReader *reader, FILE *file, int64_t size,
+uint32_t chunkSize, uint32_t headroom, uint32_t depth) {
+    /** Start a thread reading file ahead into a ring of chunk buffers.
+     *  file:      File to read, from its current position.
+     *  size:      Number of bytes to read.
+     *  chunkSize: Bytes per chunk.
+     *  headroom:  Bytes reserved in front of each chunk (for a command).
+     *  depth:     Number of chunk buffers, capped by READER_MAX_MEMORY.
+     *  Each buffer has room for the chunk padded to 512 bytes.
+     */
+    uint32_t bufSize = headroom + ((chunkSize + 511) & ~511);
+    if((uint64_t)depth * bufSize > READER_MAX_MEMORY) {
+        depth = READER_MAX_MEMORY / bufSize;
+    }
+    if(depth < 2) depth = 2;
+
+    reader->file      = file;
+    reader->size      = size;
+    reader->chunkSize = chunkSize;
+    reader->headroom  = headroom;
+    reader->depth     = depth;
+    reader->next      = 0;
+    reader->head.store(0);
+    reader->tail.store(0);
+    reader->stop.store(false);
+
+    reader->chunks = (readerChunk*)calloc(depth, sizeof(readerChunk));
+    if(!reader->chunks) return -1;
+    for(uint32_t i=0; i<depth; i++) {
+        reader->chunks[i].buf = (uint8_t*)malloc(bufSize);
+        if(!reader->chunks[i].buf) {
+            for(uint32_t j=0; j<i; j++) free(reader->chunks[j].buf);
+            free(reader->chunks);
+            return -1;
+        }
+    }
+
+    if(pthread_create(&reader->thread, NULL, reader_thread, reader)) {
+        for(uint32_t i=0; i<depth; i++) free(reader->chunks[i].buf);
+        free(reader->chunks);
+        return -1;
+    }
+    if(verbosity > 1) {
+        printf(" * Reading ahead %u chunks (%u Kbytes)\n",
+            depth, (depth * bufSize) / 1024);
+    }
+    return 0;
+}
+
+
+readerChunk* reader_acquire(chunkReader *reader) {
+    /** Wait for the next chunk to be read and return it.
+     *  The chunk stays valid until it is released; chunks are released
+     *  in the order they were acquired. Must not be called for more
+     *  chunks than the reader was started with.
+     */
+    uint32_t next = reader->next;
+    uint32_t head;
+    while((head = reader->head.load(std::memory_order_acquire)) == next) {
+        futex_wait(&reader->head, head);
+    }
+    reader->next++;
+    return &reader->chunks[next % reader->depth];
+}
+
+
+void reader_release(chunkReader *reader) {
+    //hand the oldest acquired chunk back to the reader thread
+    reader->tail.fetch_add(1, std::memory_order_release);
+    futex_wake(&reader->tail);
+}
+
+
+void reader_stop(chunkReader *reader) {
+    reader->stop.store(true, std::memory_order_release);
+    futex_wake(&reader->tail);
+    pthread_join(reader->thread, NULL);
+
+    for(uint32_t i=0; i<reader->depth; i++) free(reader->chunks[i].buf);
+    free(reader->chunks);
+    reader->chunks = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef _READER_H_
+#define _READER_H_
+
+#include <atomic>
+#include <pthread.h>
+#include "64drive.h"
+
+#define READER_MAX_MEMORY (256 * 1024 * 1024) //cap on buffered file data
+
+typedef struct {
+    uint8_t *buf;  //headroom bytes, then data padded to 512 bytes
+    uint32_t len;  //bytes of file data
+    int error;     //errno from the read, or 0
+} readerChunk;
+
+typedef struct {
+    FILE *file;
+    int64_t size;       //bytes left for the reader thread to read
+    uint32_t chunkSize;
+    uint32_t headroom;  //space reserved in front of each chunk
+    uint32_t depth;     //number of chunk buffers in the ring
+    readerChunk *chunks;
+    uint32_t next;      //consumer's next chunk to acquire
+
+    //single producer/single consumer indices; also used as futex words
+    std::atomic<uint32_t> head; //chunks filled (reader thread)
+    std::atomic<uint32_t> tail; //chunks released (consumer)
+    std::atomic<bool> stop;
+    pthread_t thread;
+} chunkReader;
+
+int reader_start(chunkReader *reader, FILE *file, int64_t size,
+    uint32_t chunkSize, uint32_t headroom, uint32_t depth);
+readerChunk* reader_acquire(chunkReader *reader);
+void reader_release(chunkReader *reader);
+void reader_stop(chunkReader *reader);
+
+#endif //_READER_H_
@@ -0,0 +1,96 @@
+#include "romend.h"
+
+//first word of a ROM in each byte order
+static const uint32_t rom_magic[] = {0x80371240, 0x37804012, 0x40123780};
+
+
+int romend_init(romEnd *re, int64_t maxSize) {
+    memset(re, 0, sizeof(*re));
+    re->nBlocks = (maxSize + ROMEND_BLOCK - 1) / ROMEND_BLOCK;
+    re->hashes = (uint8_t*)malloc(re->nBlocks * SHA1_SIZE);
+    re->fill = (int16_t*)malloc(re->nBlocks * sizeof(int16_t));
+    if(!re->hashes || !re->fill) {
+        romend_free(re);
+        return -1;
+    }
+    re->enabled = true;
+    sha1_init(&re->hash);
+    return 0;
+}
+
+
+void romend_free(romEnd *re) {
+    free(re->hashes);
+    free(re->fill);
+    re->hashes = NULL;
+    re->fill = NULL;
+}
+
+
+static int run_fill(const uint8_t *data, uint32_t len) {
+    //byte data is entirely made of, or -1
+    if(len && memcmp(data, data + 1, len - 1)) return -1;
+    return data[0];
+}
+
+
+static bool half_is_padding(romEnd *re, uint32_t half) {
+    //whether blocks [half, half*2) are one fill byte throughout, or a
+    //copy of blocks [0, half)
+    bool filled = true, mirrored = true;
+    int fill = re->fill[half];
+    for(uint32_t b=half; b<half*2 && (filled || mirrored); b++) {
+        if(fill < 0 || re->fill[b] != fill) filled = false;
+        if(memcmp(&re->hashes[b * SHA1_SIZE],
+        &re->hashes[(b - half) * SHA1_SIZE], SHA1_SIZE)) mirrored = false;
+    }
+    return filled || mirrored;
+}
+
+
+static void block_done(romEnd *re) {
+    uint32_t b = (re->pos - 1) / ROMEND_BLOCK;
+    sha1_final(&re->hash, &re->hashes[b * SHA1_SIZE]);
+    re->fill[b] = re->blockFill;
+    sha1_init(&re->hash);
+
+    //at each power of two, check the half just finished
+    uint32_t n = b + 1;
+    if(n * (int64_t)ROMEND_BLOCK >= ROMEND_MIN * 2 && !(n & (n - 1))
+    && half_is_padding(re, n / 2)) {
+        re->end = (n / 2) * (int64_t)ROMEND_BLOCK;
+    }
+}
+
+
+int64_t romend_feed(romEnd *re, const uint8_t *data, uint32_t len) {
+    /** Look at the next len bytes of the download.
+     *  Returns the size of the ROM once it's clear, otherwise 0.
+     */
+    if(!re->enabled || re->end) return re->end;
+    if(re->pos == 0 && len >= 4) {
+        uint32_t magic = (data[0] << 24) | (data[1] << 16)
+            | (data[2] << 8) | data[3];
+        re->enabled = false;
+        for(size_t i=0; i<sizeof(rom_magic) / sizeof(rom_magic[0]); i++) {
+            if(magic == rom_magic[i]) re->enabled = true;
+        }
+        if(!re->enabled) return 0;
+    }
+
+    while(len > 0 && !re->end
+    && re->pos < (int64_t)re->nBlocks * ROMEND_BLOCK) {
+        uint32_t offs = re->pos % ROMEND_BLOCK;
+        uint32_t n = ROMEND_BLOCK - offs;
+        if(n > len) n = len;
+        int fill = run_fill(data, n);
+        if(offs == 0) re->blockFill = fill;
+        else if(fill != re->blockFill) re->blockFill = -1;
+        sha1_update(&re->hash, data, n);
+        re->pos += n;
+        data += n;
+        len -= n;
+        if(re->pos % ROMEND_BLOCK == 0) block_done(re);
+    }
+    return re->end;
+}
@@ -0,0 +1,27 @@
+#ifndef _ROMEND_H_
+#define _ROMEND_H_
+
+#include "64drive.h"
+#include "hash.h"
+
+#define ROMEND_BLOCK (64 * 1024)   //granularity of the comparisons
+#define ROMEND_MIN   (1024 * 1024) //smallest ROM size considered
+
+//finds where a ROM ends while it's being downloaded, by noticing the
+//second half of a power-of-two size is just fill or a mirror of the first
+typedef struct {
+    int64_t pos;     //bytes seen so far
+    uint32_t nBlocks;
+    uint8_t *hashes; //SHA-1 of each block
+    int16_t *fill;   //byte each block is entirely made of, or -1
+    sha1Context hash; //of the block being fed
+    int blockFill;   //fill of the block being fed so far
+    bool enabled;    //false if the data doesn't look like a ROM
+    int64_t end;     //size of the ROM, once found
+} romEnd;
+
+int romend_init(romEnd *re, int64_t maxSize);
+int64_t romend_feed(romEnd *re, const uint8_t *data, uint32_t len);
+void romend_free(romEnd *re);
+
+#endif //_ROMEND_H_
@@ -0,0 +1,146 @@
+#include "sink.h"
+#include "futex.h"
+#include "sparse.h"
+
+
+static int file_write(dumpSink *sink, const uint8_t *data, uint32_t len) {
+    if(sink->sparse) return sparse_write(sink->sparse, sink->fd, data, len);
+    while(len > 0) {
+        ssize_t n = write(sink->fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -errno;
+        }
+        data += n;
+        len  -= n;
+    }
+    return 0;
+}
+
+const sinkBackend sink_file = {"raw", NULL, file_write, NULL};
+
+
+static void* sink_thread(void *arg) {
+    dumpSink *sink = (dumpSink*)arg;
+    uint32_t written = 0;
+
+    while(1) {
+        uint32_t filled = sink->filled.load(std::memory_order_acquire);
+        if(written == filled) {
+            if(sink->stop.load(std::memory_order_acquire)) break;
+            futex_wait(&sink->filled, filled);
+            continue;
+        }
+
+        //after an error keep retiring buffers so the transfer loop can
+        //see the error instead of waiting forever
+        uint32_t i = written % sink->nBuffers;
+        if(!sink->error.load(std::memory_order_relaxed)) {
+            int err = sink->backend->write(sink, sink->buffers[i],
+                sink->lens[i]);
+            if(err) sink->error.store(err);
+            sink->pos += sink->lens[i];
+        }
+        sink->written.store(++written, std::memory_order_release);
+        futex_wake(&sink->written);
+    }
+    return NULL;
+}
+
+
+int sink_start(dumpSink *sink, FILE *file, const sinkBackend *backend,
+void *ctx, uint32_t bufSize, uint32_t nBuffers, sparseOutput *sparse) {
+    /** Start a writer thread for downloaded data.
+     *  file:     File to write to, or NULL if the backend doesn't need one.
+     *  backend:  How to write it.
+     *  ctx:      Backend state, if it needs any.
+     *  bufSize:  Size of each receive buffer.
+     *  nBuffers: Number of receive buffers rotating between the transfer
+     *            loop and the writer thread.
+     *  sparse:   If not NULL, what sink_file writes leaves holes for fill;
+     *            sparse_begin() must have accepted the file.
+     */
+    if(file) fflush(file);
+    sink->backend  = backend;
+    sink->ctx      = ctx;
+    sink->fd       = file ? fileno(file) : -1;
+    sink->sparse   = sparse;
+    sink->pos      = 0;
+    sink->bufSize  = bufSize;
+    sink->nBuffers = nBuffers;
+    sink->reserved = 0;
+    sink->filled.store(0);
+    sink->written.store(0);
+    sink->error.store(0);
+    sink->stop.store(false);
+
+    sink->buffers = (uint8_t**)calloc(nBuffers, sizeof(uint8_t*));
+    sink->lens    = (uint32_t*)calloc(nBuffers, sizeof(uint32_t));
+    if(!sink->buffers || !sink->lens) goto fail;
+    for(uint32_t i=0; i<nBuffers; i++) {
+        sink->buffers[i] = (uint8_t*)malloc(bufSize);
+        if(!sink->buffers[i]) goto fail;
+    }
+
+    if(backend->open && backend->open(sink)) goto fail;
+    if(pthread_create(&sink->thread, NULL, sink_thread, sink)) {
+        if(backend->finish) backend->finish(sink);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    for(uint32_t i=0; sink->buffers && i<nBuffers; i++) {
+        free(sink->buffers[i]);
+    }
+    free(sink->buffers);
+    free(sink->lens);
+    return -1;
+}
+
+
+uint8_t* sink_reserve(dumpSink *sink, bool wait) {
+    /** Get the next free receive buffer.
+     *  If none is free, waits for the writer when wait is set, or
+     *  returns NULL otherwise.
+     */
+    while(1) {
+        uint32_t written = sink->written.load(std::memory_order_acquire);
+        if(sink->reserved - written < sink->nBuffers) break;
+        if(!wait) return NULL;
+        futex_wait(&sink->written, written);
+    }
+    return sink->buffers[sink->reserved++ % sink->nBuffers];
+}
+
+
+void sink_commit(dumpSink *sink, uint32_t len) {
+    //hand the oldest reserved buffer, holding len bytes, to the writer
+    uint32_t filled = sink->filled.load(std::memory_order_relaxed);
+    sink->lens[filled % sink->nBuffers] = len;
+    sink->filled.store(filled + 1, std::memory_order_release);
+    futex_wake(&sink->filled);
+}
+
+
+int sink_finish(dumpSink *sink) {
+    /** Wait for everything committed to be written, then shut down.
+     *  Returns 0, or the first error from the backend.
+     */
+    sink->stop.store(true, std::memory_order_release);
+    futex_wake(&sink->filled);
+    pthread_join(sink->thread, NULL);
+
+    int err = sink->error.load();
+    if(!err && sink->sparse) err = sparse_settle(sink->sparse, sink->fd);
+    if(sink->backend->finish) {
+        int finishErr = sink->backend->finish(sink);
+        if(!err) err = finishErr;
+    }
+
+    for(uint32_t i=0; i<sink->nBuffers; i++) free(sink->buffers[i]);
+    free(sink->buffers);
+    free(sink->lens);
+    sink->buffers = NULL;
+    return err;
+}
@@ -0,0 +1,48 @@
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <atomic>
+#include <pthread.h>
+#include "64drive.h"
+
+typedef struct dumpSink dumpSink;
+typedef struct sparseOutput sparseOutput;
+
+//where downloaded data ends up; called on the sink's writer thread
+typedef struct {
+    const char *name;
+    int (*open)(dumpSink *sink);
+    int (*write)(dumpSink *sink, const uint8_t *data, uint32_t len);
+    int (*finish)(dumpSink *sink);
+} sinkBackend;
+
+struct dumpSink {
+    const sinkBackend *backend;
+    void *ctx;   //backend state
+    int fd;
+    int64_t pos; //bytes handed to the backend so far
+    sparseOutput *sparse; //leaves holes for fill in the file, or NULL
+
+    uint32_t bufSize;
+    uint32_t nBuffers;
+    uint8_t **buffers;
+    uint32_t *lens;
+
+    //buffers rotate through reserved -> filled -> written -> reserved
+    uint32_t reserved;              //reserved for receiving (transfer loop)
+    std::atomic<uint32_t> filled;   //handed to the writer (transfer loop)
+    std::atomic<uint32_t> written;  //written out (writer thread)
+    std::atomic<int> error;
+    std::atomic<bool> stop;
+    pthread_t thread;
+};
+
+extern const sinkBackend sink_file;
+
+int sink_start(dumpSink *sink, FILE *file, const sinkBackend *backend,
+    void *ctx, uint32_t bufSize, uint32_t nBuffers, sparseOutput *sparse);
+uint8_t* sink_reserve(dumpSink *sink, bool wait);
+void sink_commit(dumpSink *sink, uint32_t len);
+int sink_finish(dumpSink *sink);
+
+#endif //_SINK_H_
@@ -0,0 +1,107 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "source.h"
+
+
+int source_open(romSource *src, FILE *file, int64_t size) {
+    /** Prepare file for uploading.
+     *  file: File to upload, from its current position.
+     *  size: Number of bytes to upload. If -1, the rest of the file.
+     *  Regular files are mapped into memory so the upload and any analysis
+     *  of the image can read it in place; anything else is streamed, as is
+     *  a file shorter than size, so the reader can pad it out with zeros.
+     */
+    memset(src, 0, sizeof(*src));
+    src->file = file;
+    src->byteOrder = BYTEORDER_Z64;
+
+    struct stat st;
+    if(fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)) {
+        src->seekable = true;
+        src->start = ftell(file);
+        if(src->start < 0) src->start = 0;
+        if(size < 0) size = st.st_size - src->start;
+
+        if(size > st.st_size - src->start) {
+            if(verbosity > 0) {
+                printf(" * File is shorter than the upload; padding it "
+                    "with zeros\n");
+            }
+        }
+        else if(st.st_size > 0) {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                fileno(file), 0);
+            if(map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                madvise(map, st.st_size, MADV_WILLNEED);
+                src->map = (const uint8_t*)map;
+                src->mapSize = st.st_size;
+            }
+            else if(verbosity > 0) {
+                fprintf(stderr, " ! mmap failed (%s), streaming file\n",
+                    strerror(errno));
+            }
+        }
+    }
+
+    if(size < 0) {
+        fprintf(stderr, "Can't determine size of input; use -z\n");
+        return -1;
+    }
+    src->size = size;
+    return 0;
+}
+
+
+void source_set_order(romSource *src, int order) {
+    /** Say what byte order the file is in, so it can be converted.
+     *  BYTEORDER_AUTO looks at the header if it can be read now, or else
+     *  leaves it for the upload to find out from the first chunk.
+     */
+    if(order == BYTEORDER_AUTO) {
+        uint8_t buf[4];
+        src->byteOrder = BYTEORDER_Z64; //read it as it is
+        const uint8_t *head = source_read(src, 0, sizeof(buf), buf);
+        order = head ? byteorder_detect(head, sizeof(buf)) : BYTEORDER_AUTO;
+    }
+    src->byteOrder = order;
+}
+
+
+void source_close(romSource *src) {
+    if(src->map) munmap((void*)src->map, src->mapSize);
+    src->map = NULL;
+}
+
+
+const uint8_t* source_read(romSource *src, int64_t pos, uint32_t len,
+uint8_t *buf) {
+    /** Get len bytes of the image starting at pos (relative to the start
+     *  of the upload), for inspecting the image before it is sent.
+     *  Returns a pointer into the mapping when there is one and no
+     *  conversion is needed, otherwise reads into buf. Returns NULL if the
+     *  data isn't available. A file in another byte order is converted,
+     *  so pos should be a multiple of 4.
+     */
+    if(pos < 0 || pos + len > src->size) return NULL;
+    int64_t filePos = src->start + pos;
+    bool convert = (src->byteOrder == BYTEORDER_V64
+        || src->byteOrder == BYTEORDER_N64);
+
+    if(src->map) {
+        if(filePos + len > (int64_t)src->mapSize) return NULL;
+        if(!convert) return src->map + filePos;
+        byteorder_convert(buf, src->map + filePos, len, src->byteOrder);
+        return buf;
+    }
+    if(!src->seekable) {
+        if(pos + len > src->headLen) return NULL;
+        byteorder_convert(buf, src->head + pos, len, src->byteOrder);
+        return buf;
+    }
+
+    ssize_t nRead = pread(fileno(src->file), buf, len, filePos);
+    if(nRead != (ssize_t)len) return NULL;
+    if(convert) byteorder_convert(buf, buf, len, src->byteOrder);
+    return buf;
+}
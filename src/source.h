@@ -0,0 +1,26 @@
+#ifndef _SOURCE_H_
+#define _SOURCE_H_
+
+#include "64drive.h"
+#include "byteorder.h"
+
+typedef struct {
+    FILE *file;
+    int64_t start;      //file position the data starts at
+    int64_t size;       //number of bytes to upload
+    const uint8_t *map; //whole file mapped into memory, or NULL
+    size_t mapSize;
+    bool seekable;
+    const uint8_t *head; //start of a stream, already read from it
+    uint32_t headLen;
+    int byteOrder;      //of the file, or BYTEORDER_AUTO until a stream's
+                        //first chunk is seen; it's sent as BYTEORDER_Z64
+} romSource;
+
+int source_open(romSource *src, FILE *file, int64_t size);
+void source_set_order(romSource *src, int order);
+void source_close(romSource *src);
+const uint8_t* source_read(romSource *src, int64_t pos, uint32_t len,
+    uint8_t *buf);
+
+#endif //_SOURCE_H_
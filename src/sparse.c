@@ -0,0 +1,314 @@
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include "sparse.h"
+
+#if defined(__SSE2__)
+#define SPARSE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define SPARSE_NEON
+#include <arm_neon.h>
+#endif
+
+/** Sparse dump output. Blocks of fill are seeked over instead of written,
+ *  or punched out if the file already had something there, so they take
+ *  no space; a dump of a mostly empty bank is mostly holes. Holes read
+ *  back as 0x00, so with SPARSE_ZERO the file is the same as if every
+ *  byte had been written, and resuming, verifying and cutting off where
+ *  the ROM ends all work as usual. SPARSE_FF leaves 0xFF blocks out too,
+ *  and lists them in a map for sparse_restore() to put back.
+ */
+
+static const char *modeNames[SPARSE_LAST] = {"off", "zero", "ff"};
+
+
+int sparse_parse(const char *name) {
+    //SPARSE_* for a name, or -1
+    for(int i=0; i<SPARSE_LAST; i++) {
+        if(!strcmp(name, modeNames[i])) return i;
+    }
+    return -1;
+}
+
+
+static int fill_scalar(const uint8_t *data, size_t len) {
+    uint8_t any = 0, all = 0xFF;
+    for(size_t i=0; i<len; i++) {
+        any |= data[i];
+        all &= data[i];
+    }
+    return !any ? 0x00 : (all == 0xFF) ? 0xFF : -1;
+}
+
+
+int sparse_fill(const uint8_t *data, size_t len) {
+    /** Find whether data is all 0x00 or all 0xFF.
+     *  Returns the fill byte, or -1 if it's neither. Gives up at the first
+     *  64 bytes that are neither, so real data costs next to nothing.
+     */
+    size_t i = 0;
+    bool zero = true, ones = true;
+#if defined(SPARSE_SSE2)
+    const __m128i none = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi8(-1);
+    __m128i any = none, all = full;
+    for(; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(data + i + 48));
+        any = _mm_or_si128(any, _mm_or_si128(_mm_or_si128(a, b),
+            _mm_or_si128(c, d)));
+        all = _mm_and_si128(all, _mm_and_si128(_mm_and_si128(a, b),
+            _mm_and_si128(c, d)));
+        zero = _mm_movemask_epi8(_mm_cmpeq_epi8(any, none)) == 0xFFFF;
+        ones = _mm_movemask_epi8(_mm_cmpeq_epi8(all, full)) == 0xFFFF;
+        if(!zero && !ones) return -1;
+    }
+#elif defined(SPARSE_NEON)
+    uint8x16_t any = vdupq_n_u8(0), all = vdupq_n_u8(0xFF);
+    for(; i + 64 <= len; i += 64) {
+        uint8x16_t a = vld1q_u8(data + i), b = vld1q_u8(data + i + 16);
+        uint8x16_t c = vld1q_u8(data + i + 32), d = vld1q_u8(data + i + 48);
+        any = vorrq_u8(any, vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d)));
+        all = vandq_u8(all, vandq_u8(vandq_u8(a, b), vandq_u8(c, d)));
+        zero = vmaxvq_u8(any) == 0x00;
+        ones = vminvq_u8(all) == 0xFF;
+        if(!zero && !ones) return -1;
+    }
+#endif
+    int tail = (i < len) ? fill_scalar(data + i, len - i) : -2;
+    if(zero && (tail == 0x00 || tail == -2)) return 0x00;
+    if(ones && (tail == 0xFF || tail == -2)) return 0xFF;
+    return -1;
+}
+
+
+void sparse_init(sparseOutput *sp, int mode) {
+    memset(sp, 0, sizeof(*sp));
+    sp->mode = mode;
+}
+
+
+int sparse_begin(sparseOutput *sp, int fd, int64_t base, int64_t pos) {
+    /** Start writing to fd, which must be a regular file.
+     *  base: File position of the start of the dump.
+     *  pos:  File position the first write goes to.
+     *  Returns 0, or -1 if fd can't have holes, to write it as usual.
+     */
+    struct stat st;
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode)) return -1;
+    sp->base = base;
+    sp->pos = pos;
+    sp->fileEnd = st.st_size;
+    return 0;
+}
+
+
+static int add_range(sparseOutput *sp, int64_t start, int64_t len) {
+    //note 0xFF blocks left as a hole, joining them to the last ones
+    sparseRange *last = sp->nRanges ? &sp->ranges[sp->nRanges - 1] : NULL;
+    if(last && last->start + last->len == start) {
+        last->len += len;
+        return 0;
+    }
+    if(sp->nRanges == sp->maxRanges) {
+        uint32_t max = sp->maxRanges ? sp->maxRanges * 2 : 64;
+        sparseRange *ranges = (sparseRange*)realloc(sp->ranges,
+            max * sizeof(sparseRange));
+        if(!ranges) return -ENOMEM;
+        sp->ranges = ranges;
+        sp->maxRanges = max;
+    }
+    sp->ranges[sp->nRanges].start = start;
+    sp->ranges[sp->nRanges].len = len;
+    sp->nRanges++;
+    return 0;
+}
+
+
+static int write_at(int fd, const uint8_t *data, size_t len, int64_t pos) {
+    while(len > 0) {
+        ssize_t n = pwrite(fd, data, len, pos);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -errno;
+        }
+        data += n;
+        len -= n;
+        pos += n;
+    }
+    return 0;
+}
+
+
+static int make_hole(sparseOutput *sp, int fd, const uint8_t *data,
+uint32_t len) {
+    //leave len bytes of fill at sp->pos unwritten; past the end of the
+    //file that's a hole already, but before it the old data has to go
+    if(sp->pos < sp->fileEnd) {
+        int64_t n = sp->fileEnd - sp->pos;
+        if(n > len) n = len;
+        if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        sp->pos, n)) {
+            //can't punch holes here, so write it after all
+            if(data[0] == 0xFF) return write_at(fd, data, len, sp->pos);
+            return write_at(fd, data, n, sp->pos);
+        }
+    }
+    if(data[0] == 0xFF) {
+        int err = add_range(sp, sp->pos - sp->base, len);
+        if(err) return err;
+    }
+    sp->holes += len;
+    return 0;
+}
+
+
+static int block_kind(const sparseOutput *sp, const uint8_t *data,
+uint32_t len) {
+    //fill byte of a whole block that can be left as a hole, or -1
+    if(len < SPARSE_BLOCK) return -1;
+    int fill = sparse_fill(data, len);
+    if(fill == 0xFF && sp->mode != SPARSE_FF) return -1;
+    return fill;
+}
+
+
+int sparse_write(sparseOutput *sp, int fd, const uint8_t *data,
+uint32_t len) {
+    /** Write len bytes at sp->pos, leaving holes for blocks of fill.
+     *  Returns 0 or -errno.
+     */
+    while(len > 0) {
+        //blocks line up with the file's, so they can be holes
+        uint32_t n = SPARSE_BLOCK - (sp->pos % SPARSE_BLOCK);
+        if(n > len) n = len;
+        int kind = block_kind(sp, data, n);
+
+        //take as many blocks of the same kind as follow, to write or
+        //leave out together
+        while(n < len) {
+            uint32_t next = len - n;
+            if(next > SPARSE_BLOCK) next = SPARSE_BLOCK;
+            if(block_kind(sp, data + n, next) != kind) break;
+            n += next;
+        }
+
+        int err = (kind < 0) ? write_at(fd, data, n, sp->pos)
+            : make_hole(sp, fd, data, n);
+        if(err) return err;
+        sp->pos += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int sparse_settle(sparseOutput *sp, int fd) {
+    /** Make the file as long as what's been written, since a hole at the
+     *  end doesn't extend it, and leave fd positioned after it.
+     *  Returns 0 or -errno.
+     */
+    struct stat st;
+    if(fstat(fd, &st)) return -errno;
+    if(st.st_size < sp->pos && ftruncate(fd, sp->pos)) return -errno;
+    if(lseek(fd, sp->pos, SEEK_SET) < 0) return -errno;
+    if(sp->fileEnd < sp->pos) sp->fileEnd = sp->pos;
+    return 0;
+}
+
+
+void sparse_cut(sparseOutput *sp, int64_t size) {
+    //forget 0xFF blocks past size, where the dump is being cut off
+    while(sp->nRanges && sp->ranges[sp->nRanges - 1].start >= size) {
+        sp->nRanges--;
+    }
+    if(sp->nRanges) {
+        sparseRange *last = &sp->ranges[sp->nRanges - 1];
+        if(last->start + last->len > size) last->len = size - last->start;
+    }
+}
+
+
+int sparse_save_map(const sparseOutput *sp, FILE *file) {
+    /** Write the list of 0xFF blocks left out to file, if there are any.
+     *  Returns 0 or -errno.
+     */
+    if(!sp->nRanges) return 0;
+    fprintf(file, "# 64drive 0xFF map: these parts of the dump are 0xFF, "
+        "left as holes\n");
+    for(uint32_t i=0; i<sp->nRanges; i++) {
+        fprintf(file, "ff %" PRIX64 " %" PRIX64 "\n",
+            sp->ranges[i].start, sp->ranges[i].len);
+    }
+    return fflush(file) ? -errno : 0;
+}
+
+
+int sparse_restore(const char *path) {
+    /** Put back the 0xFF blocks a dump's map lists, then delete the map.
+     *  Returns 0, or -1 on error.
+     */
+    char mapPath[4200];
+    snprintf(mapPath, sizeof(mapPath), "%s" SPARSE_MAP_SUFFIX, path);
+    FILE *map = fopen(mapPath, "r");
+    if(!map) {
+        fprintf(stderr, "Failed opening \"%s\": %s\n", mapPath,
+            strerror(errno));
+        return -1;
+    }
+    int fd = open(path, O_WRONLY);
+    if(fd < 0) {
+        fprintf(stderr, "Failed opening \"%s\": %s\n", path,
+            strerror(errno));
+        fclose(map);
+        return -1;
+    }
+
+    uint8_t ones[SPARSE_BLOCK];
+    memset(ones, 0xFF, sizeof(ones));
+    char line[256];
+    int64_t total = 0;
+    int err = 0;
+    while(!err && fgets(line, sizeof(line), map)) {
+        if(line[0] == '#') continue;
+        long long start, len;
+        if(sscanf(line, "ff %llX %llX", &start, &len) != 2 || start < 0
+        || len < 0) {
+            fprintf(stderr, "Bad line in \"%s\": %s", mapPath, line);
+            err = -1;
+            break;
+        }
+        for(int64_t pos = 0; !err && pos < len; pos += SPARSE_BLOCK) {
+            int64_t n = len - pos;
+            if(n > SPARSE_BLOCK) n = SPARSE_BLOCK;
+            err = write_at(fd, ones, n, start + pos);
+        }
+        total += len;
+        if(err) {
+            fprintf(stderr, "Failed writing \"%s\": %s\n", path,
+                strerror(-err));
+        }
+    }
+    fclose(map);
+    if(!err && fsync(fd)) err = -errno;
+    close(fd);
+
+    if(err) return -1;
+    unlink(mapPath);
+    if(verbosity >= 0) {
+        printf(" * Restored %" PRId64 " Kbytes of 0xFF to %s\n",
+            total / 1024, path);
+    }
+    return 0;
+}
+
+
+void sparse_free(sparseOutput *sp) {
+    free(sp->ranges);
+    sp->ranges = NULL;
+    sp->nRanges = sp->maxRanges = 0;
+}
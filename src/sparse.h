@@ -0,0 +1,47 @@
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include "64drive.h"
+
+#define SPARSE_BLOCK      4096 //smallest hole left, a usual filesystem block
+#define SPARSE_MAP_SUFFIX ".ffmap" //beside a dump, listing its 0xFF holes
+
+enum {
+    SPARSE_OFF,  //write every byte
+    SPARSE_ZERO, //leave holes for blocks of 0x00
+    SPARSE_FF,   //and for blocks of 0xFF, listed in a map beside the dump
+    SPARSE_LAST
+};
+
+//part of a dump that's all 0xFF, left as a hole
+typedef struct {
+    int64_t start; //relative to the start of the dump
+    int64_t len;
+} sparseRange;
+
+//writes a dump leaving holes where it's only fill, so the file takes just
+//the space of what's really in it
+struct sparseOutput {
+    int mode;         //SPARSE_*
+    int64_t base;     //file position of the start of the dump
+    int64_t pos;      //file position the next byte goes to
+    int64_t fileEnd;  //size of the file before, where holes must be punched
+    int64_t holes;    //bytes left as holes
+    sparseRange *ranges; //0xFF blocks left out, in order
+    uint32_t nRanges, maxRanges;
+};
+typedef struct sparseOutput sparseOutput;
+
+int sparse_parse(const char *name);
+int sparse_fill(const uint8_t *data, size_t len);
+void sparse_init(sparseOutput *sp, int mode);
+int sparse_begin(sparseOutput *sp, int fd, int64_t base, int64_t pos);
+int sparse_write(sparseOutput *sp, int fd, const uint8_t *data,
+    uint32_t len);
+int sparse_settle(sparseOutput *sp, int fd);
+void sparse_cut(sparseOutput *sp, int64_t size);
+int sparse_save_map(const sparseOutput *sp, FILE *file);
+int sparse_restore(const char *path);
+void sparse_free(sparseOutput *sp);
+
+#endif //_SPARSE_H_
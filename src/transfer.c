@@ -0,0 +1,1267 @@
+#include <sys/stat.h>
+#include "transfer.h"
+#include "reader.h"
+#include "source.h"
+#include "sink.h"
+#include "tune.h"
+#include "transport.h"
+#include "journal.h"
+#include "romend.h"
+#include "verify.h"
+#include "n64crc.h"
+#include "compress.h"
+#include "sparse.h"
+
+transferOptions transfer_opts = {
+    0,    //chunkSize
+    0,    //queueDepth
+    4,    //readAhead
+    4,    //writeBehind
+    true, //autotune
+    true, //delta
+    false, //fineDelta
+    0,    //verifyPasses
+    0,    //digests
+    true, //fixChecksum
+    BYTEORDER_AUTO, //byteOrder
+    COMPRESS_AUTO, //compress
+    0,    //compressLevel
+    SPARSE_OFF, //sparse
+};
+
+transferStats *transfer_stats = NULL;
+digestResult *transfer_digest = NULL;
+
+#define UPLOAD_MAX_PARTS 3 //command, payload, padding
+
+typedef struct {
+    readerChunk *chunk; //buffered chunk, or NULL if sent from the mapping
+    uint32_t len;       //payload length
+    int config;         //tuner config it was sent with
+    double sent;        //when it was submitted
+    uint8_t cmd[CMD_HEADER_SIZE]; //command, if the payload has no room for it
+    uint8_t *swapBuf;   //payload converted from a mapping in another order
+
+    //writes making up this chunk, submitted back to back
+    int nParts;
+    uint8_t *part[UPLOAD_MAX_PARTS];
+    uint32_t partLen[UPLOAD_MAX_PARTS];
+    transportXfer *tc[UPLOAD_MAX_PARTS];
+} uploadSlot;
+
+static uint8_t zeroPad[512];
+
+typedef struct {
+    uint8_t *cmd;    //commands asking for this chunk, sent in one write
+    uint32_t cmdLen;
+    uint8_t *buf; //receive buffer reserved from the sink
+    uint32_t len; //length of the response
+    int config;   //tuner config it was sent with
+    double sent;  //when the command was submitted
+    transportXfer *tc;
+} commandSlot;
+
+
+static void settle(sixtyfourDrive *device, transportXfer **tc) {
+    //wait for an outstanding transfer so its buffer can be reused
+    if(*tc) transport_done(device, *tc);
+    *tc = NULL;
+}
+
+
+static void record_chunk(double sent) {
+    transferStats *st = transfer_stats;
+    if(!st) return;
+    if(st->nChunks < st->maxChunks) {
+        st->latency[st->nChunks] = now_seconds() - sent;
+    }
+    st->nChunks++;
+}
+
+
+static void record_retry() {
+    if(transfer_stats) transfer_stats->retries++;
+}
+
+
+static int recover(sixtyfourDrive *device, int *tries) {
+    /** After a failed chunk, back off and get back in step with the device
+     *  so the chunks in flight can be sent again from the failed one.
+     *  The wait doubles with each consecutive failure, up to a limit.
+     *  Returns 0 when ready, or -1 once TRANSFER_MAX_TRIES is used up.
+     */
+    while(1) {
+        if(++*tries >= TRANSFER_MAX_TRIES) return -1;
+        record_retry();
+        int wait = TRANSFER_BACKOFF_MS << (*tries - 1);
+        if(wait > TRANSFER_MAX_BACKOFF_MS) wait = TRANSFER_MAX_BACKOFF_MS;
+        usleep(wait * 1000);
+        if(!device_resync(device)) return 0;
+        if(verbosity > 0) fprintf(stderr, "\n ! Device not responding\n");
+    }
+}
+
+
+static void slot_submit(sixtyfourDrive *device, uploadSlot *slot) {
+    slot->sent = now_seconds();
+    for(int i=0; i<slot->nParts; i++) {
+        slot->tc[i] = transport_write_submit(device,
+            slot->part[i], slot->partLen[i]);
+    }
+}
+
+
+static int slot_wait(sixtyfourDrive *device, uploadSlot *slot) {
+    //wait for all of a chunk's writes; returns 0 if they all went through
+    int result = 0;
+    for(int i=0; i<slot->nParts; i++) {
+        int nSent = slot->tc[i]
+            ? transport_done(device, slot->tc[i]) : -1;
+        slot->tc[i] = NULL;
+        if(nSent != (int)slot->partLen[i] && !result) {
+            result = nSent < 0 ? nSent : -1;
+        }
+    }
+    return result;
+}
+
+
+static int std_enter(sixtyfourDrive *device) {
+    //enter standalone mode; returns 0 once the device has acknowledged it
+    if(verbosity > 0) printf(" * Entering standalone mode\n");
+    uint8_t response[4];
+    int n = device_send_cmd(device, DEV_CMD_STD_ENTER, 0, NULL,
+        response, sizeof(response));
+    if(n != sizeof(response) || memcmp(response, "CMP", 3)
+    || response[3] != DEV_CMD_STD_ENTER) {
+        fprintf(stderr, "device_download(): device didn't enter "
+            "standalone mode\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+static void std_leave(sixtyfourDrive *device, bool failed) {
+    //leave standalone mode; after a failure, first throw away whatever
+    //the device is still sending so it isn't taken for the acknowledgement
+    if(failed) device_resync(device);
+    if(verbosity > 0) printf(" * Leaving standalone mode\n");
+    uint8_t response[4];
+    int n = device_send_cmd(device, DEV_CMD_STD_LEAVE, 0, NULL,
+        response, sizeof(response));
+    if(n != sizeof(response) || memcmp(response, "CMP", 3)
+    || response[3] != DEV_CMD_STD_LEAVE) {
+        fprintf(stderr, "device_download(): device didn't leave "
+            "standalone mode; power cycle it before using it again\n");
+    }
+}
+
+
+static int std_read(sixtyfourDrive *device, uint32_t addr, uint8_t *buf,
+uint32_t len) {
+    //read len bytes of cartridge space with one burst; returns 0 if it all came
+    uint8_t cmd[CMD_HEADER_SIZE];
+    uint32_t params[2] = {addr | 0x10 << 24, len / 4};
+    device_build_cmd(cmd, DEV_CMD_PI_RD_BURST, 2, params);
+    if(device_write_all(device, cmd, sizeof(cmd)) != sizeof(cmd)) return -1;
+    return device_read_all(device, buf, len) == (int)len ? 0 : -1;
+}
+
+
+int transfer_check_opts(const transferOptions *opts) {
+    /** Check opts are within the limits the transfer code sizes its
+     *  buffers and queues by, saying what's wrong if not. Zero chunk size
+     *  and queue depth mean tuning them, and zero verify passes means one.
+     *  Returns 0, or -EINVAL.
+     */
+    const char *bad = NULL;
+    char why[64];
+    if(opts->chunkSize && (opts->chunkSize < 512 || (opts->chunkSize % 512)
+    || opts->chunkSize > TRANSFER_MAX_CHUNK)) {
+        bad = "chunk size";
+        snprintf(why, sizeof(why), "multiple of 512, up to %d",
+            TRANSFER_MAX_CHUNK);
+    }
+    else if(opts->queueDepth < 0 || opts->queueDepth > TRANSFER_MAX_DEPTH) {
+        bad = "queue depth";
+        snprintf(why, sizeof(why), "1 to %d", TRANSFER_MAX_DEPTH);
+    }
+    else if(opts->readAhead < 0
+    || opts->readAhead > TRANSFER_MAX_READAHEAD) {
+        bad = "read-ahead";
+        snprintf(why, sizeof(why), "0 to %d", TRANSFER_MAX_READAHEAD);
+    }
+    else if(opts->writeBehind < 1
+    || opts->writeBehind > TRANSFER_MAX_WRITEBEHIND) {
+        bad = "write-behind";
+        snprintf(why, sizeof(why), "1 to %d", TRANSFER_MAX_WRITEBEHIND);
+    }
+    else if(opts->verifyPasses < 0
+    || opts->verifyPasses > TRANSFER_MAX_PASSES) {
+        bad = "number of passes";
+        snprintf(why, sizeof(why), "1 to %d", TRANSFER_MAX_PASSES);
+    }
+    else if(opts->digests & ~DIGEST_ALL) {
+        bad = "digest list";
+        snprintf(why, sizeof(why), "crc32, md5, sha1, xxh64 or all");
+    }
+    else if(opts->byteOrder < 0 || opts->byteOrder >= BYTEORDER_LAST) {
+        bad = "byte order";
+        snprintf(why, sizeof(why), "auto, z64, v64 or n64");
+    }
+    else if(opts->compress < 0 || opts->compress >= COMPRESS_LAST
+    || opts->compressLevel < 0) {
+        bad = "compression";
+        snprintf(why, sizeof(why), "none, auto, zstd[:LEVEL] or xz[:LEVEL]");
+    }
+    else if(opts->sparse < 0 || opts->sparse >= SPARSE_LAST) {
+        bad = "sparse mode";
+        snprintf(why, sizeof(why), "off, zero or ff");
+    }
+    if(!bad) return 0;
+    fprintf(stderr, "Invalid %s (%s)\n", bad, why);
+    return -EINVAL;
+}
+
+
+static uint32_t std_burst(sixtyfourDrive *device) {
+    /** Find the largest PI_RD_BURST the firmware answers in full, doubling
+     *  from STD_MIN_BURST up to STD_MAX_BURST. Going up means at most one
+     *  unanswered burst, so at most one read timeout, is spent finding out.
+     *  A size only counts if it reads back the same start of the cartridge
+     *  as the smallest one, so firmware that wraps or pads long bursts isn't
+     *  mistaken for supporting them. The result is kept in the device for
+     *  later dumps.
+     *  Returns the burst size, or 0 if not even the smallest one works.
+     */
+    if(device->stdBurst) return device->stdBurst;
+
+    uint8_t ref[STD_MIN_BURST];
+    if(std_read(device, 0, ref, sizeof(ref))) return 0;
+
+    uint8_t *buf = (uint8_t*)malloc(STD_MAX_BURST);
+    uint32_t burst = STD_MIN_BURST;
+    while(buf && burst < STD_MAX_BURST) {
+        if(std_read(device, 0, buf, burst * 2)
+        || memcmp(buf, ref, sizeof(ref))) {
+            if(verbosity > 1) {
+                printf(" * %u byte bursts not supported\n", burst * 2);
+            }
+            if(device_resync(device)) burst = 0;
+            break;
+        }
+        burst *= 2;
+    }
+    free(buf);
+    if(verbosity > 0 && burst) {
+        printf(" * Reading the cartridge in %u byte bursts\n", burst);
+    }
+    device->stdBurst = burst;
+    return burst;
+}
+
+
+static bool is_open_bus(const uint8_t *buf, uint32_t addr, uint32_t len) {
+    //with nothing answering, the PI reads back the low half of the address
+    //of each 16-bit word
+    for(uint32_t i=0; i<len; i += 2) {
+        uint32_t a = addr + i;
+        if(buf[i] != ((a >> 8) & 0xff) || buf[i + 1] != (a & 0xff)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static int64_t std_cart_size(sixtyfourDrive *device, int64_t maxSize) {
+    /** Find how big the attached cartridge's ROM is, by sampling its start
+     *  at each power of two from STD_PROBE_MIN up. The ROM ends at the
+     *  first one that reads back as open bus, or as a mirror of the start.
+     *  A mirror also has to repeat the sample halfway there, so a ROM that
+     *  merely contains a copy of its header isn't cut short.
+     *  Returns the size, maxSize if no end was found, or -1 on error.
+     */
+    uint8_t ref[STD_MIN_BURST], buf[STD_MIN_BURST];
+    if(std_read(device, 0, ref, sizeof(ref))) return -1;
+
+    for(int64_t addr = STD_PROBE_MIN; addr < maxSize; addr *= 2) {
+        if(std_read(device, addr, buf, sizeof(buf))) return -1;
+        const char *why = NULL;
+        if(is_open_bus(buf, addr, sizeof(buf))) why = "open bus";
+        else if(!memcmp(buf, ref, sizeof(buf))) {
+            uint8_t half[STD_MIN_BURST];
+            if(std_read(device, addr / 2, half, sizeof(half))
+            || std_read(device, addr + (addr / 2), buf, sizeof(buf))) {
+                return -1;
+            }
+            if(!memcmp(buf, half, sizeof(buf))) why = "mirrored";
+        }
+        if(why) {
+            if(verbosity >= 0) {
+                printf(" * Cartridge ROM is %" PRId64 " Kbytes (%s after)\n",
+                    addr / 1024, why);
+            }
+            return addr;
+        }
+    }
+    return maxSize;
+}
+
+
+static void build_cmds(commandSlot *slot, uint32_t addr, int bank,
+uint32_t burst) {
+    //fill in the commands asking for a chunk: one DUMPRAM, or one
+    //PI_RD_BURST per burst if reading the cartridge (burst != 0)
+    if(!burst) {
+        uint32_t params[2] = {addr, (slot->len & 0xffffff) | bank << 24};
+        slot->cmdLen = device_build_cmd(slot->cmd, DEV_CMD_DUMPRAM, 2, params);
+        return;
+    }
+    slot->cmdLen = 0;
+    for(uint32_t pos = 0; pos < slot->len; pos += burst) {
+        uint32_t len = slot->len - pos;
+        if(len > burst) len = burst;
+        uint32_t params[2] = {(addr + pos) | 0x10 << 24, len / 4};
+        slot->cmdLen += device_build_cmd(slot->cmd + slot->cmdLen,
+            DEV_CMD_PI_RD_BURST, 2, params);
+    }
+}
+
+
+uint32_t transfer_chunk_size(int64_t size) {
+    //determine ideal chunk size
+    uint32_t chunkSize;
+    if(size > 16 * 1024 * 1024) chunkSize = 32;
+    else if(size > 2 * 1024 * 1024) chunkSize = 16;
+    else chunkSize = 4;
+    if(verbosity > 1) printf(" * Chunk size: %d => %d\n",
+        chunkSize, chunkSize * 128 * 1024);
+    chunkSize *= 128 * 1024; // convert to megabytes
+    if(chunkSize > size) chunkSize = size;
+    return chunkSize;
+}
+
+
+int device_upload(sixtyfourDrive *device, romSource *src, uint32_t offset,
+int bank) {
+    /** Upload file to device.
+     *  src:    File to upload, prepared by source_open().
+     *  offset: Offset to upload to.
+     *  bank:   Bank to upload to.
+     */
+    uploadRange all = {0, src->size};
+    return device_upload_ranges(device, src, offset, bank, &all, 1);
+}
+
+
+static bool needs_swap(int order) {
+    return order == BYTEORDER_V64 || order == BYTEORDER_N64;
+}
+
+
+static void show_order(int order) {
+    if(verbosity >= 0 && needs_swap(order)) {
+        printf(" * Converting from %s byte order\n", byteorder_name(order));
+    }
+}
+
+
+static int upload(sixtyfourDrive *device, romSource *src, uint32_t offset,
+int bank, const uploadRange *ranges, int nRanges, digestWorker *digest,
+n64crcState *crc) {
+    /** Upload parts of a file to device; see device_upload_ranges().
+     *  digest: If not NULL, gets a copy of each chunk read from a stream.
+     *  crc:    Likewise, for the header checksums.
+     *  A file in another byte order is converted as it goes: a stream's
+     *  chunks in place once read, and a mapping into a buffer per slot.
+     *  Chunk size and queue depth come from the tuner. Mapped
+     *  files are sent straight from the mapping, with the LOADRAM command
+     *  queued as its own write just ahead of each slice. Otherwise a reader
+     *  thread keeps transfer_opts.readAhead more chunks ready, each with room
+     *  to send the command and payload as a single write.
+     */
+
+    int64_t size = 0;
+    for(int i=0; i<nRanges; i++) size += ranges[i].len;
+    if(size <= 0) {
+        if(verbosity >= 0) printf(" * Uploading... Done.\n");
+        return 0;
+    }
+    int64_t end = offset + ranges[nRanges-1].start + ranges[nRanges-1].len;
+    if(((end + 511) & ~511) > bank_capacity[bank]) {
+        fprintf(stderr, "device_upload(): past the end of the bank "
+            "(%u Kbytes)\n", bank_capacity[bank] / 1024);
+        return -1;
+    }
+
+    //the reader's chunks are all the same size, so only a mapped file
+    //can have its chunk size tuned mid-transfer
+    bool streaming = (src->map == NULL);
+    if(streaming && (nRanges != 1 || ranges[0].start != 0)) {
+        fprintf(stderr, "device_upload(): can't skip parts of a stream\n");
+        return -1;
+    }
+    transferTuner tune;
+    tune_begin(&tune, device, "up", size, streaming);
+
+    uint32_t chunkSize;
+    int depth;
+    int config = tune_config(&tune, &chunkSize, &depth);
+    uint32_t maxChunk = tune_max_chunk(&tune);
+    uint32_t maxWrite = CMD_HEADER_SIZE + ((maxChunk + 511) & ~511);
+    int maxDepth = tune_max_depth(&tune);
+
+    //chunks in flight stay owned by us until their write completes, so
+    //the reader's ring must hold those plus the read-ahead.
+    chunkReader reader;
+    if(streaming) {
+        if(reader_start(&reader, src->file, size, maxChunk, CMD_HEADER_SIZE,
+        maxDepth + transfer_opts.readAhead)) {
+            fprintf(stderr, "device_upload(): out of memory\n");
+            return -1;
+        }
+        if(maxDepth > (int)reader.depth) maxDepth = reader.depth;
+    }
+    if(depth > maxDepth) depth = maxDepth;
+
+    uploadSlot *slots = (uploadSlot*)calloc(maxDepth, sizeof(uploadSlot));
+    if(!slots) {
+        fprintf(stderr, "device_upload(): out of memory\n");
+        if(streaming) reader_stop(&reader);
+        return -1;
+    }
+
+    //each write has to go out as one USB transfer; the transport would
+    //otherwise interleave the pieces of queued writes.
+    int result = device->transport->set_write_chunksize(device, maxWrite);
+    if(result) {
+        fprintf(stderr, "device_upload() set chunk size failed: %s\n",
+            transport_error(device));
+        goto done;
+    }
+
+    if(verbosity > 0) {
+        printf(" * Uploading %" PRId64 " Kbytes to offset 0x%06X%s\n",
+            size / 1024, offset, streaming ? "" : " (mapped)");
+        if(nRanges > 1) printf(" * ...in %d pieces\n", nRanges);
+    }
+    show_order(src->byteOrder);
+
+    {
+        int head = 0, tail = 0, inFlight = 0, tries = 0;
+        int range = 0;
+        int64_t rangePos = 0; //position within the current range
+        int64_t queuePos = 0, sentPos = 0;
+        while(sentPos < size) {
+            //keep the queue full
+            while(inFlight < depth && queuePos < size) {
+                uploadSlot *slot = &slots[head];
+                slot->config = config;
+                while(rangePos == ranges[range].len && range + 1 < nRanges) {
+                    range++;
+                    rangePos = 0;
+                }
+                int64_t pos = ranges[range].start + rangePos;
+                uint8_t *payload;
+                if(streaming) {
+                    slot->chunk = reader_acquire(&reader);
+                    if(slot->chunk->error) {
+                        fprintf(stderr, "\ndevice_upload() read failed "
+                            "(after %" PRId64 " bytes): %s\n", queuePos,
+                            strerror(slot->chunk->error));
+                        result = -1;
+                        goto done;
+                    }
+                    slot->len = slot->chunk->len;
+                    payload = slot->chunk->buf + CMD_HEADER_SIZE;
+                    if(digest) digest_feed(digest, payload, slot->len);
+                    if(src->byteOrder == BYTEORDER_AUTO) {
+                        src->byteOrder = byteorder_detect(payload, slot->len);
+                        show_order(src->byteOrder);
+                    }
+                    byteorder_convert(payload, payload, slot->len,
+                        src->byteOrder);
+                    if(crc) n64crc_feed(crc, payload, slot->len);
+                }
+                else {
+                    slot->chunk = NULL;
+                    slot->len = chunkSize;
+                    if(slot->len > ranges[range].len - rangePos) {
+                        slot->len = ranges[range].len - rangePos;
+                    }
+                    //transports only read from write buffers
+                    payload = (uint8_t*)src->map + src->start + pos;
+                    if(needs_swap(src->byteOrder)) {
+                        if(!slot->swapBuf) {
+                            slot->swapBuf = (uint8_t*)malloc(maxChunk);
+                        }
+                        if(!slot->swapBuf) {
+                            fprintf(stderr, "\ndevice_upload(): out of "
+                                "memory\n");
+                            result = -1;
+                            goto done;
+                        }
+                        byteorder_convert(slot->swapBuf, payload, slot->len,
+                            src->byteOrder);
+                        payload = slot->swapBuf;
+                    }
+                }
+
+                uint32_t padLen = (slot->len + 511) & ~511;
+                uint32_t params[2] = {offset + (uint32_t)pos,
+                    (padLen & 0xffffff) | bank << 24};
+
+                if(streaming) { //command, payload and padding in one write
+                    memset(payload + slot->len, 0, padLen - slot->len);
+                    device_build_cmd(slot->chunk->buf, DEV_CMD_LOADRAM, 2,
+                        params);
+                    slot->nParts = 1;
+                    slot->part[0] = slot->chunk->buf;
+                    slot->partLen[0] = CMD_HEADER_SIZE + padLen;
+                }
+                else {
+                    device_build_cmd(slot->cmd, DEV_CMD_LOADRAM, 2, params);
+                    slot->nParts = 2;
+                    slot->part[0] = slot->cmd;
+                    slot->partLen[0] = CMD_HEADER_SIZE;
+                    slot->part[1] = payload;
+                    slot->partLen[1] = slot->len;
+                    if(padLen > slot->len) {
+                        slot->nParts = 3;
+                        slot->part[2] = zeroPad;
+                        slot->partLen[2] = padLen - slot->len;
+                    }
+                }
+                slot_submit(device, slot);
+
+                rangePos += slot->len;
+                queuePos += slot->len;
+                head = (head + 1) % maxDepth;
+                inFlight++;
+            }
+
+            //retire the oldest chunk
+            uploadSlot *slot = &slots[tail];
+            int err = slot_wait(device, slot);
+            if(err) {
+                tune_record(&tune, slot->config, 0, true);
+                char why[128]; //recovering may overwrite the error
+                snprintf(why, sizeof(why), "%s", transport_error(device));
+
+                //the device may have seen any part of the chunks in flight,
+                //so each goes again whole, command and all; rewriting
+                //what already landed is harmless
+                for(int i=1; i<inFlight; i++) {
+                    slot_wait(device, &slots[(tail + i) % maxDepth]);
+                }
+                if(recover(device, &tries)) {
+                    fprintf(stderr, "\ndevice_upload() write failed "
+                        "(after %" PRId64 " bytes): %s\n", sentPos, why);
+                    result = err;
+                    goto done;
+                }
+                for(int i=0; i<inFlight; i++) {
+                    slot_submit(device, &slots[(tail + i) % maxDepth]);
+                }
+                continue;
+            }
+
+            tries = 0;
+            sentPos += slot->len;
+            if(streaming) reader_release(&reader);
+            tail = (tail + 1) % maxDepth;
+            inFlight--;
+
+            record_chunk(slot->sent);
+            tune_record(&tune, slot->config, slot->len, false);
+            config = tune_config(&tune, &chunkSize, &depth);
+            if(depth > maxDepth) depth = maxDepth;
+            if(verbosity >= 0) {
+                printf("\r * Uploading... %3" PRId64 "%%",
+                    (sentPos * 100) / size);
+                fflush(stdout);
+            }
+        }
+        if(verbosity >= 0) printf("\r * Uploading... Done.\n");
+    }
+
+done:
+    for(int i=0; i<maxDepth; i++) {
+        slot_wait(device, &slots[i]);
+        free(slots[i].swapBuf);
+    }
+    if(streaming) reader_stop(&reader);
+    tune_end(&tune);
+    free(slots);
+    return result;
+}
+
+
+bool transfer_fixes_checksum(const romSource *src, uint32_t offset, int bank) {
+    //whether uploading src there corrects its header checksums afterward
+    return transfer_opts.fixChecksum && offset == 0 && bank == BANK_CARTROM
+        && src->size >= N64CRC_END;
+}
+
+
+static int fix_checksum(sixtyfourDrive *device, n64crcState *crc) {
+    /** Correct the header checksums of an uploaded ROM, if they're wrong,
+     *  by sending its first 512 bytes again with the right ones.
+     *  Returns 0, or -1 if that fails.
+     */
+    uint32_t want[2], have[2];
+    if(n64crc_result(crc, want)) {
+        if(verbosity > 1) printf(" * Not checking header checksums "
+            "(unknown CIC)\n");
+        return 0;
+    }
+    n64crc_header(crc, have);
+    if(want[0] == have[0] && want[1] == have[1]) {
+        if(verbosity > 0) printf(" * Header checksums OK\n");
+        return 0;
+    }
+    if(verbosity >= 0) {
+        printf(" * Fixing header checksums: %08X %08X -> %08X %08X\n",
+            have[0], have[1], want[0], want[1]);
+    }
+
+    uint8_t buf[CMD_HEADER_SIZE + 512];
+    uint32_t params[2] = {0, 512 | BANK_CARTROM << 24};
+    device_build_cmd(buf, DEV_CMD_LOADRAM, 2, params);
+    uint8_t *header = buf + CMD_HEADER_SIZE;
+    memcpy(header, crc->head, 512);
+    n64crc_patch(header, want);
+    if(device_write_all(device, buf, sizeof(buf)) != sizeof(buf)) {
+        fprintf(stderr, "device_upload() header fix failed: %s\n",
+            transport_error(device));
+        return -1;
+    }
+    return 0;
+}
+
+
+int device_upload_ranges(sixtyfourDrive *device, romSource *src,
+uint32_t offset, int bank, const uploadRange *ranges, int nRanges) {
+    /** Upload parts of a file to device.
+     *  src:     File to upload, prepared by source_open().
+     *  offset:  Offset the start of src goes to.
+     *  bank:    Bank to upload to.
+     *  ranges:  Parts of src to send, in order. Each but the last must
+     *           start and end on a 512-byte boundary, since chunks are
+     *           padded to that. Only mapped sources can skip anything.
+     *  With transfer_digest set, the digests of the whole of src are put
+     *  there: a mapping is hashed in place alongside the upload, and a
+     *  stream from copies of its chunks as they're read.
+     *  A ROM uploaded to the start of the cartridge has its header
+     *  checksums worked out the same way, and corrected on the device
+     *  afterward if they're stale (unless transfer_opts.fixChecksum is off).
+     */
+    digestWorker digest;
+    bool hashing = transfer_digest && transfer_opts.digests;
+    if(transfer_digest) memset(transfer_digest, 0, sizeof(*transfer_digest));
+    if(hashing && digest_start(&digest, transfer_opts.digests,
+    src->map ? src->map + src->start : NULL, src->map ? src->size : 0)) {
+        fprintf(stderr, "device_upload(): can't start hashing\n");
+        return -1;
+    }
+
+    n64crcState crc;
+    bool fixing = transfer_fixes_checksum(src, offset, bank);
+    if(fixing) {
+        n64crc_init(&crc);
+        uint8_t buf[N64CRC_START];
+        for(int64_t pos = 0; src->map && pos < N64CRC_END; pos += sizeof(buf)) {
+            n64crc_feed(&crc, source_read(src, pos, sizeof(buf), buf),
+                sizeof(buf));
+        }
+    }
+
+    int result = upload(device, src, offset, bank, ranges, nRanges,
+        (hashing && !src->map) ? &digest : NULL,
+        (fixing && !src->map) ? &crc : NULL);
+    if(!result && fixing) result = fix_checksum(device, &crc);
+    if(hashing) digest_finish(&digest, -1, result ? NULL : transfer_digest);
+    return result;
+}
+
+
+static int dump_order(int bank, bool standalone) {
+    //byte order to write ROM dumps in; anything else is left alone
+    if(bank != BANK_CARTROM && !standalone) return BYTEORDER_Z64;
+    return needs_swap(transfer_opts.byteOrder) ? transfer_opts.byteOrder
+        : BYTEORDER_Z64;
+}
+
+
+static int cut_dump(FILE *file, off_t base, int64_t romSize,
+compressor *comp, sparseOutput *sparse) {
+    //cut a finished dump off where the ROM ends; compressed, that's after
+    //the frame ending there
+    if(sparse) sparse_cut(sparse, romSize);
+    int64_t keep = comp ? compress_cut(comp, romSize) : romSize;
+    if(keep < 0) return 0; //no frame ends there, so the padding stays
+    return ftruncate(fileno(file), base + keep) ? -errno : 0;
+}
+
+
+static int download(sixtyfourDrive *device, FILE *file, int64_t size,
+uint32_t offset, int bank, int64_t whole, uint32_t burst, FILE *journalFile,
+verifyPass *verify, digestWorker *digest, compressor *comp,
+sparseOutput *sparse) {
+    /** Download file from device; see device_download().
+     *  whole:  What there is to download, if size < 0.
+     *  burst:  Bytes per PI_RD_BURST if reading the attached cartridge,
+     *          which must already be in standalone mode, else 0.
+     *  verify: If not NULL, hash the data into it instead of writing it.
+     *  digest: If not NULL, gets a copy of everything in the dump,
+     *          including what a resumed one already had.
+     *  comp:   If not NULL, compress the dump with it as it's written.
+     *  sparse: If not NULL, leave holes for fill in the file with it.
+     *  Received chunks are written out by a sink thread. Each read command
+     *  is queued as soon as a receive buffer is free for it, up to the
+     *  tuner's queue depth ahead of the data being received.
+     */
+    bool standalone = (burst != 0);
+    int order = dump_order(bank, standalone);
+    const char *what = verify ? "Verifying" : "Downloading";
+    bool findEnd = false;
+    if(size < 0) {
+        size = whole;
+        if(offset < whole) size -= offset;
+        //a ROM rarely fills the bank; look for where it ends as it comes in
+        findEnd = (offset == 0 && (standalone || bank == BANK_CARTROM));
+    }
+    if(size <= 0) return 0;
+
+    //we only know the end once we've read past it, so that has to be
+    //cut off again afterward
+    struct stat st;
+    romEnd romEnd;
+    int64_t romSize = 0;
+    if(findEnd && (fstat(fileno(file), &st) || !S_ISREG(st.st_mode)
+    || romend_init(&romEnd, size))) {
+        if(verbosity > 0) {
+            printf(" * Not a regular file; downloading the whole bank\n");
+        }
+        findEnd = false;
+    }
+
+    dumpJournal journal;
+    if(journalFile) {
+        if(journal_begin(&journal, journalFile, file, bank, offset, size,
+        standalone, order)) {
+            fprintf(stderr, "device_download(): can't use journal: %s\n",
+                strerror(errno));
+            return -1;
+        }
+        if(journal.done && verbosity >= 0) {
+            printf(" * Resuming after %" PRId64 " Kbytes\n",
+                journal.done / 1024);
+        }
+        offset += journal.done;
+        size -= journal.done;
+    }
+    int64_t done = journalFile ? journal.done : 0;
+    off_t base = lseek(fileno(file), 0, SEEK_CUR) - done; //where byte 0 goes
+
+    if((findEnd || digest) && done) { //catch up on what's already there
+        uint8_t *buf = (uint8_t*)malloc(ROMEND_BLOCK);
+        for(int64_t pos = 0; buf && pos < done && !romSize;
+        pos += ROMEND_BLOCK) {
+            int64_t len = done - pos;
+            if(len > ROMEND_BLOCK) len = ROMEND_BLOCK;
+            if(pread(fileno(file), buf, len, base + pos) != len) break;
+            if(digest) digest_feed(digest, buf, len);
+            if(findEnd) romSize = romend_feed(&romEnd, buf, len);
+        }
+        free(buf);
+    }
+    if(size <= 0 || romSize) {
+        if(romSize && ftruncate(fileno(file), base + romSize)) {
+            fprintf(stderr, "device_download(): %s\n", strerror(errno));
+        }
+        if(findEnd) romend_free(&romEnd);
+        if(verbosity >= 0) printf(" * %s... Done.\n", what);
+        return 0;
+    }
+
+    transferTuner tune;
+    if(standalone) tune_fixed(&tune, size < STD_CHUNK ? size : STD_CHUNK);
+    else tune_begin(&tune, device, "down", size, false);
+
+    uint32_t chunkSize;
+    int depth;
+    int config = tune_config(&tune, &chunkSize, &depth);
+    uint32_t maxChunk = tune_max_chunk(&tune);
+    int maxDepth = tune_max_depth(&tune);
+
+    //room for the commands of every chunk, for the smallest bursts
+    uint32_t cmdSpace = standalone
+        ? CMD_HEADER_SIZE * ((maxChunk + STD_MIN_BURST - 1) / STD_MIN_BURST)
+        : CMD_HEADER_SIZE;
+    commandSlot *cmds = (commandSlot*)calloc(maxDepth, sizeof(commandSlot));
+    uint8_t *cmdBuf = (uint8_t*)malloc(maxDepth * cmdSpace);
+    for(int i=0; cmds && cmdBuf && i<maxDepth; i++) {
+        cmds[i].cmd = cmdBuf + (i * cmdSpace);
+    }
+    const sinkBackend *backend = &sink_file;
+    void *ctx = NULL;
+    if(verify) {
+        backend = &sink_verify;
+        ctx = verify;
+    }
+    else if(journalFile) {
+        backend = &sink_journal;
+        ctx = &journal;
+    }
+    else if(comp) {
+        backend = &sink_compress;
+        ctx = comp;
+    }
+    if(sparse && (verify || comp
+    || sparse_begin(sparse, fileno(file), base, base + done))) {
+        sparse = NULL; //written as usual
+    }
+    dumpSink sink;
+    if(!cmds || !cmdBuf || sink_start(&sink, file, backend, ctx, maxChunk,
+    maxDepth + transfer_opts.writeBehind, sparse)) {
+        fprintf(stderr, "device_download(): out of memory\n");
+        if(findEnd) romend_free(&romEnd);
+        free(cmdBuf);
+        free(cmds);
+        return -1;
+    }
+
+    int result = device->transport->set_read_chunksize(device, maxChunk);
+    if(result) {
+        fprintf(stderr, "device_download() set chunk size failed: %s\n",
+            transport_error(device));
+        goto done;
+    }
+
+    if(verbosity > 0) {
+        printf(" * %s %" PRId64 " Kbytes\n", what, size / 1024);
+    }
+    if(!verify && verbosity >= 0 && needs_swap(order)) {
+        printf(" * Converting to %s byte order\n", byteorder_name(order));
+    }
+    {
+        int head = 0, tail = 0, queued = 0, tries = 0;
+        int64_t cmdPos = 0, readPos = 0;
+        while(readPos < size) {
+            //queue a command for each free receive buffer
+            while(queued < depth && cmdPos < size) {
+                uint8_t *buf = sink_reserve(&sink, queued == 0);
+                if(!buf) break; //writer is behind
+
+                commandSlot *slot = &cmds[head];
+                slot->buf = buf;
+                slot->config = config;
+                slot->len = chunkSize;
+                if(slot->len > size - cmdPos) slot->len = size - cmdPos;
+
+                build_cmds(slot, offset + (uint32_t)cmdPos, bank, burst);
+                slot->sent = now_seconds();
+                slot->tc = transport_write_submit(device,
+                    slot->cmd, slot->cmdLen);
+
+                cmdPos += slot->len;
+                head = (head + 1) % maxDepth;
+                queued++;
+            }
+
+            //receive the oldest chunk
+            commandSlot *slot = &cmds[tail];
+            transportXfer *rx = transport_read_submit(device,
+                slot->buf, slot->len);
+            int nRecv = rx ? transport_done(device, rx) : -1;
+            int nCmd = slot->tc ? transport_done(device, slot->tc) : -1;
+            slot->tc = NULL;
+            if(nRecv >= 0 && nRecv < (int)slot->len
+            && nCmd == (int)slot->cmdLen) {
+                //arrived in pieces; wait for the rest
+                int n = device_read_all(device, slot->buf + nRecv,
+                    slot->len - nRecv);
+                nRecv = (n < 0) ? n : nRecv + n;
+            }
+
+            if(nRecv != (int)slot->len || nCmd != (int)slot->cmdLen) {
+                tune_record(&tune, slot->config, 0, true);
+                char why[128]; //recovering may overwrite the error
+                snprintf(why, sizeof(why), "%s", transport_error(device));
+
+                //let the rest of the queue go out, throw away whatever the
+                //device sent for it, and reissue it from this chunk
+                for(int i=1; i<queued; i++) {
+                    settle(device, &cmds[(tail + i) % maxDepth].tc);
+                }
+                if(recover(device, &tries)) {
+                    fprintf(stderr, "\ndevice_download() read failed "
+                        "(after %" PRId64 " bytes): %s\n", readPos, why);
+                    result = nRecv < 0 ? nRecv : -1;
+                    goto done;
+                }
+                for(int i=0; i<queued; i++) {
+                    commandSlot *s = &cmds[(tail + i) % maxDepth];
+                    s->sent = now_seconds();
+                    s->tc = transport_write_submit(device,
+                        s->cmd, s->cmdLen);
+                }
+                continue;
+            }
+
+            tries = 0;
+            tail = (tail + 1) % maxDepth;
+            queued--;
+            readPos += nRecv;
+            if(findEnd && !romSize) {
+                romSize = romend_feed(&romEnd, slot->buf, nRecv);
+                if(romSize) {
+                    if(verbosity >= 0) {
+                        printf("\r * ROM ends at %" PRId64 " Kbytes\n",
+                            romSize / 1024);
+                    }
+                    size = cmdPos; //just collect what's already asked for
+                }
+            }
+            byteorder_convert(slot->buf, slot->buf, nRecv, order);
+            if(digest) digest_feed(digest, slot->buf, nRecv);
+            sink_commit(&sink, nRecv);
+            if(sink.error.load()) break;
+
+            record_chunk(slot->sent);
+            tune_record(&tune, slot->config, nRecv, false);
+            config = tune_config(&tune, &chunkSize, &depth);
+            if(verbosity >= 0) {
+                printf("\r * %s... %3" PRId64 "%%", what,
+                    (readPos * 100) / size);
+                fflush(stdout);
+            }
+        }
+        if(verbosity >= 0 && readPos >= size) {
+            printf("\r * %s... Done.\n", what);
+        }
+    }
+
+done:
+    for(int i=0; i<maxDepth; i++) settle(device, &cmds[i].tc);
+    tune_end(&tune);
+
+    int err = sink_finish(&sink);
+    if(!err && romSize) err = cut_dump(file, base, romSize, comp, sparse);
+    if(err) {
+        fprintf(stderr, "\ndevice_download() write failed: %s\n",
+            strerror(-err));
+        if(!result) result = err;
+    }
+    if(findEnd) romend_free(&romEnd);
+    free(cmdBuf);
+    free(cmds);
+    return result;
+}
+
+
+static int read_block(sixtyfourDrive *device, uint32_t addr, int bank,
+uint32_t burst, uint8_t *buf, uint32_t len) {
+    //read a stretch on its own, for re-reads; returns 0 if it all came
+    int tries = 0;
+    while(1) {
+        int err = 0;
+        if(burst) {
+            for(uint32_t pos = 0; pos < len && !err; pos += burst) {
+                uint32_t n = len - pos;
+                if(n > burst) n = burst;
+                err = std_read(device, addr + pos, buf + pos, n);
+            }
+        }
+        else {
+            uint32_t params[2] = {addr, (len & 0xffffff) | bank << 24};
+            err = device_send_cmd(device, DEV_CMD_DUMPRAM, 2, params,
+                buf, len) == (int)len ? 0 : -1;
+        }
+        if(!err) return 0;
+        if(recover(device, &tries)) return -1;
+    }
+}
+
+
+static void report_unstable(int64_t start, int64_t end, int agree,
+int nReads, bool settled) {
+    if(verbosity < 0) return;
+    printf("   %08" PRIX64 "-%08" PRIX64 "  %d of %d reads agree%s\n",
+        start, end - 1, agree, nReads, settled ? "" : ", no majority");
+}
+
+
+static int verify_dump(sixtyfourDrive *device, FILE *file, off_t base,
+uint32_t offset, int bank, uint32_t burst, bool *rewritten) {
+    /** Read a finished dump transfer_opts.verifyPasses - 1 more times and
+     *  compare each VERIFY_BLOCK. A block whose reads don't all agree is
+     *  read again by itself until one version has been read more than
+     *  half the time and at least as often as there are passes, or
+     *  VERIFY_MAX_READS is reached. The winning version is written to the
+     *  file, and the unstable blocks are listed. rewritten is set if that
+     *  changed anything.
+     *  Returns 0 if every block has a majority.
+     */
+    int passes = transfer_opts.verifyPasses;
+    if(passes < 2) return 0;
+
+    struct stat st;
+    if(fstat(fileno(file), &st) || !S_ISREG(st.st_mode) || base < 0) {
+        fprintf(stderr, "device_download(): can only verify dumps to a "
+            "regular file\n");
+        return -1;
+    }
+    int64_t size = st.st_size - base;
+
+    verifyPass *pass = (verifyPass*)calloc(passes, sizeof(verifyPass));
+    uint8_t *buf = (uint8_t*)malloc(VERIFY_BLOCK);
+    int result = (pass && buf) ? 0 : -1;
+    for(int p=0; p<passes && !result; p++) {
+        result = verify_pass_init(&pass[p], size);
+    }
+    if(result) fprintf(stderr, "device_download(): out of memory\n");
+    else if(verify_pass_file(&pass[0], fileno(file), base, size)) {
+        fprintf(stderr, "device_download(): can't read back the dump: %s\n",
+            strerror(errno));
+        result = -1;
+    }
+    for(int p=1; p<passes && !result; p++) {
+        if(verbosity > 0) printf(" * Pass %d of %d\n", p + 1, passes);
+        result = download(device, file, size, offset, bank, size, burst,
+            NULL, &pass[p], NULL, NULL, NULL);
+    }
+
+    //re-read blocks that disagree, and list them, merging neighbours that
+    //came out the same
+    int nUnstable = 0, nUnsettled = 0;
+    int64_t runStart = 0, runEnd = 0;
+    int runAgree = 0, runReads = 0;
+    bool runSettled = true;
+    uint32_t nBlocks = (pass && !result) ? pass[0].nBlocks : 0;
+    for(uint32_t b=0; b<nBlocks && !result; b++) {
+        const uint8_t *hash = &pass[0].hashes[b * SHA1_SIZE];
+        int p;
+        for(p=1; p<passes; p++) {
+            if(memcmp(&pass[p].hashes[b * SHA1_SIZE], hash, SHA1_SIZE)) break;
+        }
+        if(p == passes) continue;
+
+        int64_t pos = (int64_t)b * VERIFY_BLOCK;
+        uint32_t len = (size - pos < VERIFY_BLOCK) ? size - pos : VERIFY_BLOCK;
+        verifyBlock vb;
+        memset(&vb, 0, sizeof(vb));
+        if(pread(fileno(file), buf, len, base + pos) != (ssize_t)len) {
+            fprintf(stderr, "\ndevice_download(): can't read back the "
+                "dump: %s\n", strerror(errno));
+            result = -1;
+            break;
+        }
+        verify_block_add(&vb, hash, buf, len);
+        for(p=1; p<passes; p++) {
+            verify_block_add(&vb, &pass[p].hashes[b * SHA1_SIZE], NULL, len);
+        }
+
+        int win;
+        while((win = verify_block_winner(&vb, passes)) < 0
+        && vb.nReads < VERIFY_MAX_READS) {
+            if(read_block(device, offset + (uint32_t)pos, bank, burst,
+            buf, len)) {
+                fprintf(stderr, "\ndevice_download(): re-read failed at "
+                    "%08" PRIX64 ": %s\n", (int64_t)offset + pos,
+                    transport_error(device));
+                result = -1;
+                break;
+            }
+            byteorder_convert(buf, buf, len, dump_order(bank, burst != 0));
+            verify_block_add(&vb, NULL, buf, len);
+        }
+        if(win > 0 && (!vb.data[win]
+        || pwrite(fileno(file), vb.data[win], len, base + pos)
+        != (ssize_t)len)) {
+            fprintf(stderr, "\ndevice_download(): can't write the dump: "
+                "%s\n", strerror(errno));
+            result = -1;
+        }
+        else if(win > 0) *rewritten = true;
+
+        int agree = 0;
+        for(int v=0; v<vb.nVersions; v++) {
+            if(vb.count[v] > agree) agree = vb.count[v];
+        }
+        bool settled = (win >= 0);
+        int nReads = vb.nReads;
+        verify_block_free(&vb);
+        nUnstable++;
+        if(!settled) nUnsettled++;
+
+        int64_t start = offset + pos;
+        if(runEnd == start && agree == runAgree && nReads == runReads
+        && settled == runSettled) {
+            runEnd = start + len;
+            continue;
+        }
+        if(runEnd > runStart) {
+            report_unstable(runStart, runEnd, runAgree, runReads, runSettled);
+        }
+        else if(verbosity >= 0) printf(" * Unstable blocks:\n");
+        runStart = start;
+        runEnd = start + len;
+        runAgree = agree;
+        runReads = nReads;
+        runSettled = settled;
+    }
+    if(runEnd > runStart) {
+        report_unstable(runStart, runEnd, runAgree, runReads, runSettled);
+    }
+
+    if(!result && nUnsettled) {
+        fprintf(stderr, "device_download(): %d of %u blocks have no "
+            "majority after %d reads\n", nUnsettled, nBlocks,
+            VERIFY_MAX_READS);
+        result = -1;
+    }
+    else if(!result && verbosity >= 0) {
+        if(nUnstable) {
+            printf(" * %d of %u blocks needed re-reading; each now has a "
+                "majority\n", nUnstable, nBlocks);
+        }
+        else printf(" * All %d passes agree\n", passes);
+    }
+
+    for(int p=0; pass && p<passes; p++) verify_pass_free(&pass[p]);
+    free(pass);
+    free(buf);
+    return result;
+}
+
+
+int device_download(sixtyfourDrive *device, FILE *file, int64_t size,
+uint32_t offset, int bank, bool standalone, FILE *journalFile,
+FILE *mapFile) {
+    /** Download file from device.
+     *  file:        File to write to.
+     *  size:        Size to download, or -1 for the rest of the bank.
+     *  offset:      Offset to download from.
+     *  bank:        Bank to download from.
+     *  standalone:  Standalone mode, i.e. read from attached cartridge
+     *  journalFile: Journal to resume from and record progress in, or
+     *               NULL. file must then be seekable and readable.
+     *  mapFile:     Where to list the 0xFF blocks left out of the file
+     *               with transfer_opts.sparse at SPARSE_FF, or NULL to
+     *               leave just 0x00 blocks out.
+     *  With transfer_digest set, the digests of what ends up in the file
+     *  are put there, hashed on a worker thread as the data comes in.
+     *  With transfer_opts.compress set to a format, the file gets the dump
+     *  compressed; such a dump can't be resumed or verified, since that
+     *  means reading it back.
+     */
+
+    //cartridge address space, for standalone reads
+    int64_t capacity = bank_capacity[standalone ? BANK_CARTROM : bank];
+    if(size >= 0 && offset + size > capacity) {
+        fprintf(stderr, "device_download(): past the end of the bank "
+            "(%" PRId64 " Kbytes)\n", capacity / 1024);
+        return -1;
+    }
+
+    compressor comp;
+    bool compressing = (transfer_opts.compress == COMPRESS_ZSTD
+        || transfer_opts.compress == COMPRESS_XZ);
+    if(compressing && (journalFile || transfer_opts.verifyPasses > 1)) {
+        fprintf(stderr, "device_download(): can't resume or verify a "
+            "compressed dump\n");
+        return -1;
+    }
+    if(compressing && compress_init(&comp, transfer_opts.compress,
+    transfer_opts.compressLevel)) return -1;
+
+    //leaving 0xFF out means the file no longer reads back as the dump
+    sparseOutput sparse;
+    int sparseMode = transfer_opts.sparse;
+    if(sparseMode == SPARSE_FF && !mapFile) sparseMode = SPARSE_ZERO;
+    if(sparseMode == SPARSE_FF
+    && (journalFile || transfer_opts.verifyPasses > 1)) {
+        fprintf(stderr, "device_download(): can't resume or verify a dump "
+            "with 0xFF left out\n");
+        if(compressing) compress_free(&comp);
+        return -1;
+    }
+    sparse_init(&sparse, sparseMode);
+
+    digestWorker digest;
+    bool hashing = transfer_digest && transfer_opts.digests;
+    if(transfer_digest) memset(transfer_digest, 0, sizeof(*transfer_digest));
+    if(hashing && digest_start(&digest, transfer_opts.digests, NULL, 0)) {
+        fprintf(stderr, "device_download(): can't start hashing\n");
+        if(compressing) compress_free(&comp);
+        return -1;
+    }
+
+    off_t base = lseek(fileno(file), 0, SEEK_CUR); //where byte 0 goes
+    uint32_t burst = 0;
+    int result = 0;
+    if(standalone) {
+        result = std_enter(device);
+        burst = result ? 0 : std_burst(device);
+        if(!result && size < 0) {
+            int64_t cartSize = std_cart_size(device, capacity);
+            if(cartSize < 0) burst = 0;
+            else capacity = cartSize;
+        }
+        if(!result && !burst) {
+            fprintf(stderr, "device_download(): can't read the cartridge\n");
+            result = -1;
+        }
+    }
+    if(!result) {
+        result = download(device, file, size, offset, bank, capacity, burst,
+            journalFile, NULL, hashing ? &digest : NULL,
+            compressing ? &comp : NULL,
+            sparseMode != SPARSE_OFF ? &sparse : NULL);
+    }
+    if(!result && mapFile && sparse_save_map(&sparse, mapFile)) {
+        fprintf(stderr, "device_download(): can't write 0xFF map: %s\n",
+            strerror(errno));
+        result = -1;
+    }
+
+    bool rewritten = false;
+    if(!result) {
+        result = verify_dump(device, file, base, offset, bank, burst,
+            &rewritten);
+    }
+    //even a failed attempt to enter may have got through
+    if(standalone) std_leave(device, result != 0);
+
+    //a dump cut short where the ROM ends is at a power of two the worker
+    //kept the state at; one fixed by verifying has to be hashed again
+    struct stat st;
+    int64_t length = (!fstat(fileno(file), &st) && S_ISREG(st.st_mode))
+        ? st.st_size - base : -1;
+    if(compressing) {
+        length = comp.in;
+        compress_free(&comp);
+    }
+    if(!result && sparse.holes && length >= 0 && verbosity > 0) {
+        printf(" * Sparse dump takes %" PRId64 " of %" PRId64 " Kbytes\n",
+            (int64_t)st.st_blocks / 2, length / 1024);
+    }
+    sparse_free(&sparse);
+    if(hashing) {
+        digestResult *out = (result || rewritten) ? NULL : transfer_digest;
+        if(digest_finish(&digest, length, out)) {
+            fprintf(stderr, "device_download(): no digest for %" PRId64
+                " bytes\n", length);
+        }
+        if(!result && rewritten && digest_file(fileno(file), base, length,
+        transfer_opts.digests, transfer_digest)) {
+            fprintf(stderr, "device_download(): can't read back the dump: "
+                "%s\n", strerror(errno));
+        }
+    }
+    return result;
+}
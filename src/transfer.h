@@ -0,0 +1,70 @@
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+#include "64drive.h"
+#include "source.h"
+#include "digest.h"
+
+#define CMD_HEADER_SIZE          12 //command, "CMD", two params
+#define TRANSFER_DEFAULT_DEPTH   4
+#define TRANSFER_MAX_DEPTH       64
+#define TRANSFER_MAX_READAHEAD   256
+#define TRANSFER_MAX_WRITEBEHIND 256
+#define TRANSFER_MAX_CHUNK       (8 * 1024 * 1024) //length field is 24 bits
+#define TRANSFER_MAX_TRIES       5   //consecutive failures before giving up
+#define TRANSFER_BACKOFF_MS      10  //wait after the first failure, doubling
+#define TRANSFER_MAX_BACKOFF_MS  500
+#define STD_MAX_BURST            (64 * 1024) //largest PI_RD_BURST tried
+#define STD_MIN_BURST            512 //what every firmware accepts
+#define STD_CHUNK                (256 * 1024) //bursts are batched this big
+#define TRANSFER_MAX_PASSES      5   //reads of a dump to compare
+#define STD_PROBE_MIN            (1024 * 1024) //smallest cartridge size probed
+
+typedef struct {
+    uint32_t chunkSize; //bytes per chunk, 0 to tune it
+    int queueDepth;  //number of chunks kept in flight, 0 to tune it
+    int readAhead;   //chunks read from the file ahead of those in flight
+    int writeBehind; //received chunks waiting to be written out
+    bool autotune;   //tune chunk size and queue depth per device
+    bool delta;      //only upload blocks changed since the last upload
+    bool fineDelta;  //keep a copy of the ROM to send only changed windows
+    int verifyPasses; //times to read dumps and compare, 0 or 1 for once
+    int digests;     //DIGEST_* flags of digests to compute over up/downloads
+    bool fixChecksum; //correct stale ROM header checksums when uploading
+    int byteOrder;   //BYTEORDER_* ROMs are uploaded from and dumped to
+    int compress;    //COMPRESS_* to write dumps with
+    int compressLevel; //0 for the format's default
+    int sparse;      //SPARSE_* fill to leave as holes in dumps
+} transferOptions;
+
+//filled in by up/downloads when transfer_stats is set
+typedef struct {
+    float *latency;     //seconds from submitting each chunk to its completion
+    uint32_t nChunks;   //chunks completed
+    uint32_t maxChunks; //room in latency
+    int retries;        //failed chunks that were sent again
+} transferStats;
+
+//part of a source to upload, relative to its start
+typedef struct {
+    int64_t start;
+    int64_t len;
+} uploadRange;
+
+extern transferOptions transfer_opts;
+extern transferStats *transfer_stats;
+extern digestResult *transfer_digest; //filled in by up/downloads if set
+
+uint32_t transfer_chunk_size(int64_t size);
+int transfer_check_opts(const transferOptions *opts);
+int device_upload(sixtyfourDrive *device, romSource *src, uint32_t offset,
+    int bank);
+int device_upload_ranges(sixtyfourDrive *device, romSource *src,
+    uint32_t offset, int bank, const uploadRange *ranges, int nRanges);
+bool transfer_fixes_checksum(const romSource *src, uint32_t offset,
+    int bank);
+int device_download(sixtyfourDrive *device, FILE *file, int64_t size,
+    uint32_t offset, int bank, bool standalone, FILE *journalFile,
+    FILE *mapFile);
+
+#endif //_TRANSFER_H_
@@ -0,0 +1,25 @@
+#include "transport.h"
+
+const deviceTransport *transports[] = {
+    &transport_ftdi,
+    &transport_sim,
+    &transport_usb,
+    NULL
+};
+
+
+const deviceTransport* transport_find(const char *spec, const char **args) {
+    /** Look up a transport by name.
+     *  spec: Name, optionally followed by ":" and options for it.
+     *  args: Receives the options, or "" if there are none.
+     *  Returns the transport, or NULL if there's no such transport.
+     */
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    *args = colon ? colon + 1 : "";
+    for(int i=0; transports[i]; i++) {
+        if(strlen(transports[i]->name) == len
+        && !strncmp(transports[i]->name, spec, len)) return transports[i];
+    }
+    return NULL;
+}
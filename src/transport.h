@@ -0,0 +1,74 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include "64drive.h"
+
+typedef struct transportXfer transportXfer; //an outstanding async transfer
+
+//how bytes get to and from the 64drive; all calls come from one thread
+typedef struct deviceTransport {
+    const char *name;
+    const char *descr;
+    //find and initialize the device; returns its HW version, or 0
+    int (*open)(sixtyfourDrive *device, const char *args);
+    void (*close)(sixtyfourDrive *device);
+
+    //synchronous I/O; return bytes transferred, or < 0 on error
+    int (*write)(sixtyfourDrive *device, const uint8_t *buf, int len);
+    int (*read)(sixtyfourDrive *device, uint8_t *buf, int len);
+
+    //async I/O; the buffer must stay valid until transfer_done()
+    transportXfer* (*write_submit)(sixtyfourDrive *device,
+        const uint8_t *buf, int len);
+    transportXfer* (*read_submit)(sixtyfourDrive *device,
+        uint8_t *buf, int len);
+    int (*transfer_done)(sixtyfourDrive *device, transportXfer *xfer);
+
+    int (*purge)(sixtyfourDrive *device);
+    int (*set_write_chunksize)(sixtyfourDrive *device, uint32_t size);
+    int (*set_read_chunksize)(sixtyfourDrive *device, uint32_t size);
+    const char* (*error)(sixtyfourDrive *device);
+} deviceTransport;
+
+extern const deviceTransport transport_ftdi;
+extern const deviceTransport transport_sim;
+extern const deviceTransport transport_usb;
+extern const deviceTransport *transports[];
+
+const deviceTransport* transport_find(const char *spec, const char **args);
+
+
+static inline int transport_write(sixtyfourDrive *device, const uint8_t *buf,
+int len) {
+    return device->transport->write(device, buf, len);
+}
+
+static inline int transport_read(sixtyfourDrive *device, uint8_t *buf,
+int len) {
+    return device->transport->read(device, buf, len);
+}
+
+static inline transportXfer* transport_write_submit(sixtyfourDrive *device,
+const uint8_t *buf, int len) {
+    return device->transport->write_submit(device, buf, len);
+}
+
+static inline transportXfer* transport_read_submit(sixtyfourDrive *device,
+uint8_t *buf, int len) {
+    return device->transport->read_submit(device, buf, len);
+}
+
+static inline int transport_done(sixtyfourDrive *device,
+transportXfer *xfer) {
+    return device->transport->transfer_done(device, xfer);
+}
+
+static inline int transport_purge(sixtyfourDrive *device) {
+    return device->transport->purge(device);
+}
+
+static inline const char* transport_error(sixtyfourDrive *device) {
+    return device->transport->error(device);
+}
+
+#endif //_TRANSPORT_H_
@@ -0,0 +1,169 @@
+#include "transport.h"
+
+//the real device, through libftdi
+
+#define FTDI(device) ((struct ftdi_context*)(device)->ctx)
+
+
+static void ft_get_serial(sixtyfourDrive *device) {
+    //read the USB serial number of the opened device
+    struct libusb_device_descriptor desc;
+    device->serial[0] = 0;
+    libusb_device *dev = libusb_get_device(FTDI(device)->usb_dev);
+    if(!dev || libusb_get_device_descriptor(dev, &desc)
+    || !desc.iSerialNumber) return;
+
+    int len = libusb_get_string_descriptor_ascii(FTDI(device)->usb_dev,
+        desc.iSerialNumber, (unsigned char*)device->serial,
+        sizeof(device->serial) - 1);
+    device->serial[len > 0 ? len : 0] = 0;
+}
+
+
+static int ft_find(sixtyfourDrive *device) {
+    //return device version: 2=HW2 1=HW1 0=not found
+    static struct {
+        uint16_t vid, pid;
+        int version;
+        const char *descr;
+    } devices[] = {
+        {0x0403, 0x6014, 2, "64drive USB device"},
+        {0x0403, 0x6010, 1, "64drive USB device A"},
+        {0x0403, 0x6010, 1, "64drive USB device"},
+        {0, 0, 0, NULL}
+    };
+
+    for(int i=0; devices[i].vid; i++) {
+        int err = ftdi_usb_open_desc(FTDI(device),
+            devices[i].vid, devices[i].pid, devices[i].descr, NULL);
+        if(!err) {
+            device->version = devices[i].version;
+            ft_get_serial(device);
+            return device->version;
+        }
+        if(err != -3) {
+            fprintf(stderr, "device_open(): %s\n",
+                ftdi_get_error_string(FTDI(device)));
+        }
+    }
+
+    return 0;
+}
+
+
+static int ft_setup(sixtyfourDrive *device) {
+    struct ftdi_context *ftdi = FTDI(device);
+    if(verbosity > 1) printf(" * Resetting device\n");
+    int err = ftdi_usb_reset(ftdi);
+    if(err) return fail_ftdi(ftdi, "ftdi_usb_reset");
+
+    if(device->version == 2) {
+        if(verbosity > 1) printf(" * Setting synchronous mode\n");
+
+        err = ftdi_set_bitmode(ftdi, 0xFF, BITMODE_RESET);
+        if(err) return fail_ftdi(ftdi, "ftdi_set_bitmode(BITMODE_RESET)");
+
+        err = ftdi_set_bitmode(ftdi, 0xFF, BITMODE_SYNCFF);
+        if(err) return fail_ftdi(ftdi, "ftdi_set_bitmode(BITMODE_SYNCFF)");
+    }
+    err = ftdi_set_latency_timer(ftdi, 255);
+    if(err) return fail_ftdi(ftdi, "ftdi_set_latency_timer");
+
+    if(verbosity > 1) printf(" * Purging buffers\n");
+    err = ftdi_usb_purge_buffers(ftdi);
+    if(err) return fail_ftdi(ftdi, "ftdi_usb_purge_buffers");
+
+    return EXIT_SUCCESS;
+}
+
+
+static int ft_open(sixtyfourDrive *device, const char *args) {
+    (void)args;
+    struct ftdi_context *ftdi = ftdi_new();
+    if(!ftdi) {
+        fprintf(stderr, "ftdi_new failed\n");
+        return 0;
+    }
+    device->ctx = ftdi;
+
+    if(ft_find(device) < 1 || ft_setup(device)) {
+        ftdi_free(ftdi);
+        device->ctx = NULL;
+        return 0;
+    }
+    return device->version;
+}
+
+
+static void ft_close(sixtyfourDrive *device) {
+    ftdi_usb_close(FTDI(device));
+    ftdi_free(FTDI(device));
+    device->ctx = NULL;
+}
+
+
+static int ft_write(sixtyfourDrive *device, const uint8_t *buf, int len) {
+    return ftdi_write_data(FTDI(device), buf, len);
+}
+
+
+static int ft_read(sixtyfourDrive *device, uint8_t *buf, int len) {
+    return ftdi_read_data(FTDI(device), buf, len);
+}
+
+
+static transportXfer* ft_write_submit(sixtyfourDrive *device,
+const uint8_t *buf, int len) {
+    //libftdi doesn't write through the pointer, it's just not const
+    return (transportXfer*)ftdi_write_data_submit(FTDI(device),
+        (uint8_t*)buf, len);
+}
+
+
+static transportXfer* ft_read_submit(sixtyfourDrive *device, uint8_t *buf,
+int len) {
+    return (transportXfer*)ftdi_read_data_submit(FTDI(device), buf, len);
+}
+
+
+static int ft_done(sixtyfourDrive *device, transportXfer *xfer) {
+    (void)device;
+    return ftdi_transfer_data_done((struct ftdi_transfer_control*)xfer);
+}
+
+
+static int ft_purge(sixtyfourDrive *device) {
+    return ftdi_usb_purge_buffers(FTDI(device));
+}
+
+
+static int ft_set_write_chunksize(sixtyfourDrive *device, uint32_t size) {
+    return ftdi_write_data_set_chunksize(FTDI(device), size);
+}
+
+
+static int ft_set_read_chunksize(sixtyfourDrive *device, uint32_t size) {
+    return ftdi_read_data_set_chunksize(FTDI(device), size);
+}
+
+
+static const char* ft_error(sixtyfourDrive *device) {
+    return ftdi_get_error_string(FTDI(device));
+}
+
+
+const deviceTransport transport_ftdi = {
+    "ftdi",
+    "64drive on USB (default)",
+    ft_open,
+    ft_close,
+    ft_write,
+    ft_read,
+    ft_write_submit,
+    ft_read_submit,
+    ft_done,
+    ft_purge,
+    ft_set_write_chunksize,
+    ft_set_read_chunksize,
+    ft_error,
+};
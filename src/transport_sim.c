@@ -0,0 +1,488 @@
+#include <time.h>
+#include "transport.h"
+
+/** A simulated 64drive, for testing and benchmarking without hardware.
+ *  It speaks the same command protocol against in-memory banks, and
+ *  models a shared bus with a fixed bandwidth, a delay before each
+ *  command's response, and optional short reads and failed transfers.
+ *  Options, after "sim:", comma separated:
+ *    bw=MBPS      bus bandwidth in MB/s (default 40, 0 = unlimited)
+ *    lat=US       microseconds from command to response (default 100)
+ *    short=P      probability a read returns only part of its data
+ *    fault=P      probability a transfer fails outright
+ *    timeout=MS   how long a read waits for missing data (default 500)
+ *    seed=N       random seed for short reads and faults
+ *    burst=BYTES  largest PI_RD_BURST answered (default 16384); longer
+ *                 ones are ignored, like firmware that doesn't support them
+ *    cart=BYTES   size of the cartridge ROM seen by PI reads (default: the
+ *                 whole ROM bank); past it they read back open bus
+ *    mirror=1     make PI reads past the cartridge ROM wrap around instead
+ *    flip=P       probability a PI read comes back with one bit flipped,
+ *                 like a cartridge with dirty contacts
+ */
+
+#define SIM_MAX_PARAMS 2
+
+typedef struct {
+    size_t end;   //offset in the output just past this response
+    double ready; //when it becomes available
+} simResponse;
+
+struct transportXfer {
+    int result;
+    double doneAt; //when the transfer completes
+};
+
+typedef struct {
+    //model
+    double bandwidth; //bytes per second, or 0 for no limit
+    double latency;   //seconds
+    double shortRate, faultRate;
+    double timeout;   //seconds
+    uint32_t maxBurst; //bytes
+    uint32_t cartSize; //bytes, or 0 for the whole bank
+    bool mirror;
+    double flipRate;
+    uint64_t rng;
+    char error[128];
+
+    uint8_t *banks[BANK_LAST];
+    bool standalone;
+
+    //command parser
+    uint8_t cmd[4 + (SIM_MAX_PARAMS * 4)];
+    int cmdLen, nParams;
+    uint32_t loadLeft;  //payload bytes still expected for LOADRAM
+    uint32_t loadPos;
+    int loadBank;
+
+    //responses waiting to be read
+    uint8_t *out;
+    size_t outLen, outPos, outCap;
+    simResponse *resp; //responses still (partly) unread
+    int respHead, nResp, respCap;
+
+    double busFree;  //when the bus finishes its queued transfers
+} simDevice;
+
+#define SIM(device) ((simDevice*)(device)->ctx)
+
+
+static void sleep_until(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+
+static uint64_t sim_seed(uint64_t seed) {
+    //splitmix64, so small seeds don't start the sequence near zero
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    return (seed ^ (seed >> 31)) | 1;
+}
+
+
+static double sim_random(simDevice *sim) {
+    //xorshift64*; returns [0, 1)
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return ((sim->rng * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+
+static double sim_bus(simDevice *sim, double start, size_t len) {
+    //occupy the bus for len bytes; returns when they're done
+    if(start < sim->busFree) start = sim->busFree;
+    if(sim->bandwidth > 0) start += len / sim->bandwidth;
+    sim->busFree = start;
+    return start;
+}
+
+
+static uint8_t* sim_bank(simDevice *sim, int bank) {
+    //banks are allocated on first use; calloc keeps untouched pages free
+    if(bank <= BANK_INVALID || bank >= BANK_LAST) return NULL;
+    if(!sim->banks[bank]) {
+        sim->banks[bank] = (uint8_t*)calloc(1, bank_capacity[bank]);
+    }
+    return sim->banks[bank];
+}
+
+
+static uint8_t* sim_respond(simDevice *sim, size_t len, double at) {
+    //make room for a response of len bytes, readable from time at
+    if(sim->outPos == sim->outLen) {
+        sim->outPos = sim->outLen = 0;
+        sim->respHead = sim->nResp = 0;
+    }
+    if(sim->nResp == sim->respCap) {
+        int cap = sim->respCap ? sim->respCap * 2 : 64;
+        simResponse *resp = (simResponse*)realloc(sim->resp,
+            cap * sizeof(simResponse));
+        if(!resp) return NULL;
+        sim->resp = resp;
+        sim->respCap = cap;
+    }
+    if(sim->outLen + len > sim->outCap) {
+        size_t cap = sim->outCap ? sim->outCap : 65536;
+        while(cap < sim->outLen + len) cap *= 2;
+        uint8_t *out = (uint8_t*)realloc(sim->out, cap);
+        if(!out) return NULL;
+        sim->out = out;
+        sim->outCap = cap;
+    }
+    uint8_t *buf = &sim->out[sim->outLen];
+    sim->outLen += len;
+    sim->resp[sim->nResp].end = sim->outLen;
+    sim->resp[sim->nResp].ready = at + sim->latency;
+    sim->nResp++;
+    return buf;
+}
+
+
+static void sim_read_mem(simDevice *sim, int bank, uint32_t offset,
+uint8_t *dest, uint32_t len) {
+    //out of range reads return zeros
+    uint8_t *mem = sim_bank(sim, bank);
+    uint32_t size = (bank > BANK_INVALID && bank < BANK_LAST)
+        ? bank_capacity[bank] : 0;
+    uint32_t n = (mem && offset < size) ? size - offset : 0;
+    if(n > len) n = len;
+    if(n) memcpy(dest, mem + offset, n);
+    memset(dest + n, 0, len - n);
+}
+
+
+static void sim_read_cart(simDevice *sim, uint32_t addr, uint8_t *dest,
+uint32_t len) {
+    //read cartridge space through the PI
+    if(!sim->cartSize) {
+        sim_read_mem(sim, BANK_CARTROM, addr, dest, len);
+        return;
+    }
+    for(uint32_t i=0; i<len; i += 2) {
+        uint32_t a = addr + i;
+        if(a >= sim->cartSize && !sim->mirror) { //open bus
+            dest[i] = (a >> 8) & 0xff;
+            if(i + 1 < len) dest[i + 1] = a & 0xff;
+        }
+        else {
+            sim_read_mem(sim, BANK_CARTROM, a % sim->cartSize, dest + i,
+                (i + 1 < len) ? 2 : 1);
+        }
+    }
+}
+
+
+static int sim_n_params(uint8_t cmd) {
+    switch(cmd) {
+        case DEV_CMD_GETVER:
+        case DEV_CMD_STD_ENTER:
+        case DEV_CMD_STD_LEAVE:
+            return 0;
+        case DEV_CMD_SETSAVE:
+        case DEV_CMD_SETCIC:
+        case DEV_CMD_PI_RD_32:
+            return 1;
+        case DEV_CMD_LOADRAM:
+        case DEV_CMD_DUMPRAM:
+        case DEV_CMD_PI_WR_32:
+        case DEV_CMD_PI_RD_BURST:
+            return 2;
+        default: return -1;
+    }
+}
+
+
+static void sim_command(simDevice *sim, double at) {
+    //run the command in sim->cmd, received at time at
+    uint32_t param[SIM_MAX_PARAMS];
+    for(int i=0; i<sim->nParams; i++) {
+        uint32_t p;
+        memcpy(&p, &sim->cmd[4 + (i * 4)], sizeof(p));
+        param[i] = swap_endian(p);
+    }
+
+    switch(sim->cmd[0]) {
+        case DEV_CMD_GETVER: {
+            static const uint8_t ver[8] = {'S', 'I', 'M', 0, 'U','D','E','V'};
+            uint8_t *resp = sim_respond(sim, sizeof(ver), at);
+            if(resp) memcpy(resp, ver, sizeof(ver));
+            break;
+        }
+
+        case DEV_CMD_LOADRAM:
+            sim->loadPos = param[0];
+            sim->loadLeft = param[1] & 0xffffff;
+            sim->loadBank = param[1] >> 24;
+            break;
+
+        case DEV_CMD_DUMPRAM: {
+            uint32_t len = param[1] & 0xffffff;
+            uint8_t *resp = sim_respond(sim, len, at);
+            if(resp) sim_read_mem(sim, param[1] >> 24, param[0], resp, len);
+            break;
+        }
+
+        case DEV_CMD_STD_ENTER:
+        case DEV_CMD_STD_LEAVE: { //acknowledged with "CMP" and the command
+            sim->standalone = (sim->cmd[0] == DEV_CMD_STD_ENTER);
+            uint8_t *resp = sim_respond(sim, 4, at);
+            if(resp) {
+                memcpy(resp, "CMP", 3);
+                resp[3] = sim->cmd[0];
+            }
+            break;
+        }
+
+        case DEV_CMD_PI_RD_32:
+        case DEV_CMD_PI_RD_BURST: {
+            //cartridge space reads back the ROM bank
+            uint32_t len = (sim->cmd[0] == DEV_CMD_PI_RD_32)
+                ? 4 : param[1] * 4;
+            uint32_t addr = (param[0] & 0x0fffffff);
+            if(len > sim->maxBurst) break;
+            uint8_t *resp = sim_respond(sim, len, at);
+            if(resp) sim_read_cart(sim, addr, resp, len);
+            if(resp && len && sim_random(sim) < sim->flipRate) {
+                uint32_t bit = (uint32_t)(sim_random(sim) * len * 8);
+                resp[bit / 8] ^= 1 << (bit % 8);
+            }
+            break;
+        }
+
+        default: break; //accepted and ignored
+    }
+}
+
+
+static void sim_input(simDevice *sim, const uint8_t *buf, size_t len,
+double at) {
+    //feed bytes from the host through the command parser
+    while(len > 0) {
+        if(sim->loadLeft) { //LOADRAM payload
+            uint32_t n = (len < sim->loadLeft) ? len : sim->loadLeft;
+            uint8_t *mem = sim_bank(sim, sim->loadBank);
+            uint32_t size = mem ? bank_capacity[sim->loadBank] : 0;
+            if(sim->loadPos < size) {
+                uint32_t m = size - sim->loadPos;
+                memcpy(mem + sim->loadPos, buf, (n < m) ? n : m);
+            }
+            sim->loadPos += n;
+            sim->loadLeft -= n;
+            buf += n;
+            len -= n;
+            continue;
+        }
+
+        sim->cmd[sim->cmdLen++] = *buf++;
+        len--;
+        if(sim->cmdLen == 4) {
+            sim->nParams = sim_n_params(sim->cmd[0]);
+            if(memcmp(&sim->cmd[1], "CMD", 3) || sim->nParams < 0) {
+                //out of sync; slide along looking for a command
+                memmove(sim->cmd, &sim->cmd[1], 3);
+                sim->cmdLen = 3;
+                continue;
+            }
+        }
+        if(sim->cmdLen >= 4 && sim->cmdLen == 4 + (sim->nParams * 4)) {
+            sim_command(sim, at);
+            sim->cmdLen = 0;
+        }
+    }
+}
+
+
+static transportXfer* sim_write_submit(sixtyfourDrive *device,
+const uint8_t *buf, int len) {
+    simDevice *sim = SIM(device);
+    transportXfer *xfer = (transportXfer*)malloc(sizeof(transportXfer));
+    if(!xfer) return NULL;
+
+    double now = now_seconds();
+    if(sim_random(sim) < sim->faultRate) {
+        strcpy(sim->error, "simulated write failure");
+        xfer->result = -1;
+        xfer->doneAt = now;
+        return xfer;
+    }
+    xfer->doneAt = sim_bus(sim, now, len);
+    xfer->result = len;
+    sim_input(sim, buf, len, xfer->doneAt);
+    return xfer;
+}
+
+
+static transportXfer* sim_read_submit(sixtyfourDrive *device, uint8_t *buf,
+int len) {
+    simDevice *sim = SIM(device);
+    transportXfer *xfer = (transportXfer*)malloc(sizeof(transportXfer));
+    if(!xfer) return NULL;
+
+    double start = now_seconds();
+    if(sim_random(sim) < sim->faultRate) {
+        strcpy(sim->error, "simulated read failure");
+        xfer->result = -1;
+        xfer->doneAt = start;
+        return xfer;
+    }
+
+    //everything the host has sent is already answered, so whatever isn't
+    //queued now never arrives; the read waits out its timeout
+    size_t avail = sim->outLen - sim->outPos;
+    size_t n = ((size_t)len < avail) ? len : avail;
+    bool timedOut = (n < (size_t)len);
+    if(n > 1 && sim_random(sim) < sim->shortRate) {
+        n = 1 + (size_t)(sim_random(sim) * (n - 1));
+    }
+
+    if(n) { //wait for the response holding the last byte
+        int i = sim->respHead;
+        while(sim->resp[i].end < sim->outPos + n) i++;
+        if(start < sim->resp[i].ready) start = sim->resp[i].ready;
+    }
+    memcpy(buf, &sim->out[sim->outPos], n);
+    sim->outPos += n;
+    while(sim->respHead < sim->nResp
+    && sim->resp[sim->respHead].end <= sim->outPos) sim->respHead++;
+    xfer->result = n;
+    xfer->doneAt = sim_bus(sim, start, n);
+    if(timedOut) xfer->doneAt += sim->timeout;
+    return xfer;
+}
+
+
+static int sim_done(sixtyfourDrive *device, transportXfer *xfer) {
+    (void)device;
+    if(!xfer) return -1;
+    sleep_until(xfer->doneAt);
+    int result = xfer->result;
+    free(xfer);
+    return result;
+}
+
+
+static int sim_write(sixtyfourDrive *device, const uint8_t *buf, int len) {
+    return sim_done(device, sim_write_submit(device, buf, len));
+}
+
+
+static int sim_read(sixtyfourDrive *device, uint8_t *buf, int len) {
+    return sim_done(device, sim_read_submit(device, buf, len));
+}
+
+
+static int sim_purge(sixtyfourDrive *device) {
+    simDevice *sim = SIM(device);
+    sim->outPos = sim->outLen = 0;
+    sim->respHead = sim->nResp = 0;
+    sim->cmdLen = 0;
+    sim->loadLeft = 0;
+    return 0;
+}
+
+
+static int sim_set_chunksize(sixtyfourDrive *device, uint32_t size) {
+    (void)device;
+    (void)size;
+    return 0;
+}
+
+
+static const char* sim_error(sixtyfourDrive *device) {
+    return SIM(device)->error;
+}
+
+
+static int sim_parse_args(simDevice *sim, const char *args) {
+    char buf[256];
+    if(strlen(args) >= sizeof(buf)) {
+        fprintf(stderr, "Simulator options too long\n");
+        return -1;
+    }
+    strcpy(buf, args);
+
+    char *save = NULL;
+    for(char *opt = strtok_r(buf, ",", &save); opt;
+    opt = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(opt, '=');
+        if(!val) {
+            fprintf(stderr, "Simulator option \"%s\" needs a value\n", opt);
+            return -1;
+        }
+        *val++ = 0;
+        double v = strtod(val, NULL);
+        if(!strcmp(opt, "bw")) sim->bandwidth = v * 1024 * 1024;
+        else if(!strcmp(opt, "lat")) sim->latency = v / 1e6;
+        else if(!strcmp(opt, "short")) sim->shortRate = v;
+        else if(!strcmp(opt, "fault")) sim->faultRate = v;
+        else if(!strcmp(opt, "timeout")) sim->timeout = v / 1e3;
+        else if(!strcmp(opt, "burst")) sim->maxBurst = v;
+        else if(!strcmp(opt, "cart")) sim->cartSize = v;
+        else if(!strcmp(opt, "mirror")) sim->mirror = (v != 0);
+        else if(!strcmp(opt, "flip")) sim->flipRate = v;
+        else if(!strcmp(opt, "seed")) sim->rng = sim_seed(strtoull(val, NULL, 0));
+        else {
+            fprintf(stderr, "Unknown simulator option \"%s\"\n", opt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int sim_open(sixtyfourDrive *device, const char *args) {
+    simDevice *sim = (simDevice*)calloc(1, sizeof(simDevice));
+    if(!sim) return 0;
+    sim->bandwidth = 40 * 1024 * 1024;
+    sim->latency = 100 / 1e6;
+    sim->timeout = 0.5;
+    sim->maxBurst = 16 * 1024;
+    sim->rng = sim_seed(0);
+    strcpy(sim->error, "no error");
+    if(sim_parse_args(sim, args)) {
+        free(sim);
+        return 0;
+    }
+
+    device->ctx = sim;
+    device->version = 2;
+    strcpy(device->serial, "sim");
+    if(verbosity > 1) {
+        printf(" * Simulating 64drive at %.1f MB/s, %.0f us latency\n",
+            sim->bandwidth / (1024 * 1024), sim->latency * 1e6);
+    }
+    return device->version;
+}
+
+
+static void sim_close(sixtyfourDrive *device) {
+    simDevice *sim = SIM(device);
+    for(int i=0; i<BANK_LAST; i++) free(sim->banks[i]);
+    free(sim->out);
+    free(sim->resp);
+    free(sim);
+    device->ctx = NULL;
+}
+
+
+const deviceTransport transport_sim = {
+    "sim",
+    "simulated 64drive in memory",
+    sim_open,
+    sim_close,
+    sim_write,
+    sim_read,
+    sim_write_submit,
+    sim_read_submit,
+    sim_done,
+    sim_purge,
+    sim_set_chunksize,
+    sim_set_chunksize,
+    sim_error,
+};
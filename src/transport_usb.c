@@ -0,0 +1,542 @@
+#include <pthread.h>
+#include <time.h>
+#include "transport.h"
+
+/** The real device, with bulk transfers queued through libusb directly
+ *  instead of libftdi's transfer functions, which wait on each piece.
+ *  libftdi still finds the device and sets up bitmode and latency.
+ *  Each up/download is split across up to DEPTH URBs in flight per
+ *  direction, completed by an event thread. Writes go straight from the
+ *  caller's buffer; reads land in preallocated buffers, and the two
+ *  status bytes the FTDI chip puts at the start of every packet are
+ *  stripped as they're copied out.
+ *  Options, after "usb:", comma separated:
+ *    depth=N      URBs in flight per direction (default 8)
+ *    urb=KB       size of each URB (default 64)
+ *    timeout=MS   how long a read waits without data (default 5000)
+ */
+
+#define USB_DEFAULT_DEPTH 8
+#define USB_MAX_DEPTH     64
+#define USB_DEFAULT_URB   (64 * 1024)
+#define USB_MAX_URB       (1024 * 1024)
+#define USB_STATUS_BYTES  2 //at the start of every packet read
+
+#define USB(device) ((usbContext*)(device)->ctx)
+
+struct transportXfer {
+    uint8_t *buf;
+    int len;
+    int queued;   //bytes handed to URBs so far (writes)
+    int done;     //bytes completed
+    int inFlight; //URBs carrying part of this (writes)
+    int error;    //libusb error or transfer status, once failed
+    bool isRead;
+    bool finished;
+    double lastProgress;
+    struct transportXfer *next;
+};
+
+typedef struct {
+    struct libusb_transfer *transfer;
+    uint8_t *buf;         //read buffer
+    transportXfer *xfer;  //write this URB is part of
+    bool busy;
+    struct usbContext *usb;
+} usbUrb;
+
+typedef struct usbContext {
+    struct ftdi_context *ftdi;
+    int depth, urbSize;
+    double timeout; //seconds
+    char error[128];
+
+    pthread_t thread;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //signalled when anything completes
+
+    usbUrb *writeUrbs, *readUrbs;
+    int writesInFlight, readsInFlight;
+
+    //outstanding transfers, oldest first
+    transportXfer *writes, *reads;
+    int64_t readWanted; //bytes the queued reads still need
+
+    //data that arrived beyond what the queued reads asked for
+    uint8_t *spare;
+    int spareLen, spareCap;
+} usbContext;
+
+
+static void usb_unlink(transportXfer **list, transportXfer *xfer) {
+    for(; *list; list = &(*list)->next) {
+        if(*list == xfer) {
+            *list = xfer->next;
+            return;
+        }
+    }
+}
+
+
+static void usb_append(transportXfer **list, transportXfer *xfer) {
+    while(*list) list = &(*list)->next;
+    *list = xfer;
+}
+
+
+static void usb_finish(usbContext *usb, transportXfer *xfer, int error) {
+    //call with the lock held
+    if(xfer->finished) return;
+    if(error && !xfer->error) xfer->error = error;
+    xfer->finished = true;
+    if(xfer->isRead) {
+        usb->readWanted -= xfer->len - xfer->done;
+        usb_unlink(&usb->reads, xfer);
+    }
+    else usb_unlink(&usb->writes, xfer);
+    pthread_cond_broadcast(&usb->cond);
+}
+
+
+static void usb_write_callback(struct libusb_transfer *transfer);
+static void usb_read_callback(struct libusb_transfer *transfer);
+
+
+static void usb_pump(usbContext *usb) {
+    /** Keep URBs queued for whatever's outstanding.
+     *  Call with the lock held.
+     */
+    struct ftdi_context *ftdi = usb->ftdi;
+
+    for(int i=0; i<usb->depth; i++) {
+        usbUrb *urb = &usb->writeUrbs[i];
+        if(urb->busy) continue;
+        transportXfer *xfer = usb->writes;
+        while(xfer && (xfer->error || xfer->queued == xfer->len)) {
+            xfer = xfer->next;
+        }
+        if(!xfer) break;
+
+        int len = xfer->len - xfer->queued;
+        if(len > usb->urbSize) len = usb->urbSize;
+        libusb_fill_bulk_transfer(urb->transfer, ftdi->usb_dev, ftdi->in_ep,
+            xfer->buf + xfer->queued, len, usb_write_callback, urb,
+            ftdi->usb_write_timeout);
+        int err = libusb_submit_transfer(urb->transfer);
+        if(err) {
+            xfer->error = err;
+            if(!xfer->inFlight) usb_finish(usb, xfer, err);
+            continue;
+        }
+        urb->busy = true;
+        urb->xfer = xfer;
+        xfer->queued += len;
+        xfer->inFlight++;
+        usb->writesInFlight++;
+    }
+
+    //each packet brings at most this much data
+    int64_t perUrb = (usb->urbSize / ftdi->max_packet_size)
+        * (ftdi->max_packet_size - USB_STATUS_BYTES);
+    for(int i=0; i<usb->depth; i++) {
+        usbUrb *urb = &usb->readUrbs[i];
+        if(urb->busy) continue;
+        if(usb->readWanted <= usb->readsInFlight * perUrb) break;
+
+        libusb_fill_bulk_transfer(urb->transfer, ftdi->usb_dev, ftdi->out_ep,
+            urb->buf, usb->urbSize, usb_read_callback, urb,
+            ftdi->usb_read_timeout);
+        int err = libusb_submit_transfer(urb->transfer);
+        if(err) {
+            if(usb->reads) usb_finish(usb, usb->reads, err);
+            break;
+        }
+        urb->busy = true;
+        usb->readsInFlight++;
+    }
+}
+
+
+static void usb_write_callback(struct libusb_transfer *transfer) {
+    usbUrb *urb = (usbUrb*)transfer->user_data;
+    usbContext *usb = urb->usb;
+    pthread_mutex_lock(&usb->lock);
+
+    transportXfer *xfer = urb->xfer;
+    urb->busy = false;
+    urb->xfer = NULL;
+    usb->writesInFlight--;
+    xfer->inFlight--;
+    xfer->done += transfer->actual_length;
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED
+    || transfer->actual_length < transfer->length) {
+        if(!xfer->error) xfer->error = LIBUSB_ERROR_IO;
+    }
+    if(!xfer->inFlight && (xfer->error || xfer->done == xfer->len)) {
+        usb_finish(usb, xfer, 0);
+    }
+
+    usb_pump(usb);
+    pthread_cond_broadcast(&usb->cond);
+    pthread_mutex_unlock(&usb->lock);
+}
+
+
+static void usb_deliver(usbContext *usb, const uint8_t *data, int len) {
+    //hand received data to the oldest reads, keeping any excess
+    //call with the lock held
+    while(len > 0 && usb->reads) {
+        transportXfer *xfer = usb->reads;
+        int n = xfer->len - xfer->done;
+        if(n > len) n = len;
+        memcpy(xfer->buf + xfer->done, data, n);
+        xfer->done += n;
+        xfer->lastProgress = now_seconds();
+        usb->readWanted -= n;
+        data += n;
+        len -= n;
+        if(xfer->done == xfer->len) usb_finish(usb, xfer, 0);
+    }
+    if(len <= 0) return;
+
+    if(usb->spareLen + len > usb->spareCap) {
+        int cap = usb->spareLen + len + usb->urbSize;
+        uint8_t *spare = (uint8_t*)realloc(usb->spare, cap);
+        if(!spare) return; //lost; the next read will time out
+        usb->spare = spare;
+        usb->spareCap = cap;
+    }
+    memcpy(usb->spare + usb->spareLen, data, len);
+    usb->spareLen += len;
+}
+
+
+static void usb_read_callback(struct libusb_transfer *transfer) {
+    usbUrb *urb = (usbUrb*)transfer->user_data;
+    usbContext *usb = urb->usb;
+    pthread_mutex_lock(&usb->lock);
+
+    urb->busy = false;
+    usb->readsInFlight--;
+    int mps = usb->ftdi->max_packet_size;
+    if(transfer->status == LIBUSB_TRANSFER_COMPLETED
+    || transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        for(int pos=0; pos < transfer->actual_length; pos += mps) {
+            int len = transfer->actual_length - pos;
+            if(len > mps) len = mps;
+            if(len <= USB_STATUS_BYTES) continue;
+            usb_deliver(usb, urb->buf + pos + USB_STATUS_BYTES,
+                len - USB_STATUS_BYTES);
+        }
+    }
+    else if(transfer->status != LIBUSB_TRANSFER_CANCELLED && usb->reads) {
+        usb_finish(usb, usb->reads, LIBUSB_ERROR_IO);
+    }
+
+    usb_pump(usb);
+    pthread_cond_broadcast(&usb->cond);
+    pthread_mutex_unlock(&usb->lock);
+}
+
+
+static void* usb_events(void *arg) {
+    usbContext *usb = (usbContext*)arg;
+    while(!usb->stop) {
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(usb->ftdi->usb_ctx, &tv,
+            &usb->stop);
+    }
+    return NULL;
+}
+
+
+static void usb_cancel_all(usbContext *usb) {
+    /** Cancel every URB and fail every outstanding transfer.
+     *  Call with the lock held; returns once the URBs are back.
+     */
+    for(int i=0; i<usb->depth; i++) {
+        if(usb->writeUrbs[i].busy) {
+            libusb_cancel_transfer(usb->writeUrbs[i].transfer);
+        }
+        if(usb->readUrbs[i].busy) {
+            libusb_cancel_transfer(usb->readUrbs[i].transfer);
+        }
+    }
+    while(usb->reads) usb_finish(usb, usb->reads, LIBUSB_ERROR_INTERRUPTED);
+    while(usb->writes) {
+        usb_finish(usb, usb->writes, LIBUSB_ERROR_INTERRUPTED);
+    }
+    while(usb->writesInFlight || usb->readsInFlight) {
+        pthread_cond_wait(&usb->cond, &usb->lock);
+    }
+    usb->readWanted = 0;
+    usb->spareLen = 0;
+}
+
+
+static int usb_parse_args(usbContext *usb, const char *args) {
+    char buf[256];
+    if(strlen(args) >= sizeof(buf)) {
+        fprintf(stderr, "USB transport options too long\n");
+        return -1;
+    }
+    strcpy(buf, args);
+
+    char *save = NULL;
+    for(char *opt = strtok_r(buf, ",", &save); opt;
+    opt = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(opt, '=');
+        if(!val) {
+            fprintf(stderr, "USB transport option \"%s\" needs a value\n",
+                opt);
+            return -1;
+        }
+        *val++ = 0;
+        long v = strtol(val, NULL, 0);
+        if(!strcmp(opt, "depth")) {
+            if(v < 1 || v > USB_MAX_DEPTH) {
+                fprintf(stderr, "USB depth must be 1 to %d\n", USB_MAX_DEPTH);
+                return -1;
+            }
+            usb->depth = v;
+        }
+        else if(!strcmp(opt, "urb")) {
+            if(v < 1 || v * 1024 > USB_MAX_URB) {
+                fprintf(stderr, "USB URB size must be 1 to %d KB\n",
+                    USB_MAX_URB / 1024);
+                return -1;
+            }
+            usb->urbSize = v * 1024;
+        }
+        else if(!strcmp(opt, "timeout")) usb->timeout = v / 1e3;
+        else {
+            fprintf(stderr, "Unknown USB transport option \"%s\"\n", opt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static void usb_free(usbContext *usb) {
+    for(int i=0; i<usb->depth; i++) {
+        if(usb->writeUrbs) libusb_free_transfer(usb->writeUrbs[i].transfer);
+        if(usb->readUrbs) {
+            libusb_free_transfer(usb->readUrbs[i].transfer);
+            free(usb->readUrbs[i].buf);
+        }
+    }
+    free(usb->writeUrbs);
+    free(usb->readUrbs);
+    free(usb->spare);
+    pthread_mutex_destroy(&usb->lock);
+    pthread_cond_destroy(&usb->cond);
+    free(usb);
+}
+
+
+static int usb_alloc_urbs(usbContext *usb) {
+    usb->writeUrbs = (usbUrb*)calloc(usb->depth, sizeof(usbUrb));
+    usb->readUrbs = (usbUrb*)calloc(usb->depth, sizeof(usbUrb));
+    if(!usb->writeUrbs || !usb->readUrbs) return -1;
+    for(int i=0; i<usb->depth; i++) {
+        usb->writeUrbs[i].usb = usb;
+        usb->readUrbs[i].usb = usb;
+        usb->writeUrbs[i].transfer = libusb_alloc_transfer(0);
+        usb->readUrbs[i].transfer = libusb_alloc_transfer(0);
+        usb->readUrbs[i].buf = (uint8_t*)malloc(usb->urbSize);
+        if(!usb->writeUrbs[i].transfer || !usb->readUrbs[i].transfer
+        || !usb->readUrbs[i].buf) return -1;
+    }
+    return 0;
+}
+
+
+static int usb_open(sixtyfourDrive *device, const char *args) {
+    usbContext *usb = (usbContext*)calloc(1, sizeof(usbContext));
+    if(!usb) return 0;
+    pthread_mutex_init(&usb->lock, NULL);
+    pthread_cond_init(&usb->cond, NULL);
+    usb->depth = USB_DEFAULT_DEPTH;
+    usb->urbSize = USB_DEFAULT_URB;
+    usb->timeout = 5;
+    strcpy(usb->error, "no error");
+    if(usb_parse_args(usb, args)) {
+        usb_free(usb);
+        return 0;
+    }
+
+    //let libftdi find the device and put it in sync FIFO mode
+    if(!transport_ftdi.open(device, "")) {
+        usb_free(usb);
+        return 0;
+    }
+    usb->ftdi = (struct ftdi_context*)device->ctx;
+
+    //read URBs must be whole packets, or the status bytes get out of step
+    int mps = usb->ftdi->max_packet_size;
+    usb->urbSize = ((usb->urbSize + mps - 1) / mps) * mps;
+    if(usb_alloc_urbs(usb)
+    || pthread_create(&usb->thread, NULL, usb_events, usb)) {
+        fprintf(stderr, "Can't set up USB transfers\n");
+        transport_ftdi.close(device);
+        usb_free(usb);
+        return 0;
+    }
+
+    device->ctx = usb;
+    if(verbosity > 1) {
+        printf(" * Using %d x %d KB bulk transfers\n", usb->depth,
+            usb->urbSize / 1024);
+    }
+    return device->version;
+}
+
+
+static void usb_close(sixtyfourDrive *device) {
+    usbContext *usb = USB(device);
+    pthread_mutex_lock(&usb->lock);
+    usb_cancel_all(usb);
+    pthread_mutex_unlock(&usb->lock);
+    usb->stop = 1;
+    pthread_join(usb->thread, NULL);
+
+    device->ctx = usb->ftdi;
+    transport_ftdi.close(device);
+    usb_free(usb);
+}
+
+
+static transportXfer* usb_submit(sixtyfourDrive *device, uint8_t *buf,
+int len, bool isRead) {
+    usbContext *usb = USB(device);
+    transportXfer *xfer = (transportXfer*)calloc(1, sizeof(transportXfer));
+    if(!xfer) {
+        strcpy(usb->error, "out of memory");
+        return NULL;
+    }
+    xfer->buf = buf;
+    xfer->len = len;
+    xfer->isRead = isRead;
+    xfer->lastProgress = now_seconds();
+
+    pthread_mutex_lock(&usb->lock);
+    if(isRead && usb->spareLen) { //already have some of it
+        int n = (usb->spareLen < len) ? usb->spareLen : len;
+        memcpy(buf, usb->spare, n);
+        memmove(usb->spare, usb->spare + n, usb->spareLen - n);
+        usb->spareLen -= n;
+        xfer->done = n;
+    }
+    if(xfer->done == len) xfer->finished = true;
+    else {
+        usb_append(isRead ? &usb->reads : &usb->writes, xfer);
+        if(isRead) usb->readWanted += len - xfer->done;
+        usb_pump(usb);
+    }
+    pthread_mutex_unlock(&usb->lock);
+    return xfer;
+}
+
+
+static transportXfer* usb_write_submit(sixtyfourDrive *device,
+const uint8_t *buf, int len) {
+    //libusb doesn't write through the pointer for OUT transfers
+    return usb_submit(device, (uint8_t*)buf, len, false);
+}
+
+
+static transportXfer* usb_read_submit(sixtyfourDrive *device, uint8_t *buf,
+int len) {
+    return usb_submit(device, buf, len, true);
+}
+
+
+static int usb_done(sixtyfourDrive *device, transportXfer *xfer) {
+    usbContext *usb = USB(device);
+    pthread_mutex_lock(&usb->lock);
+    //wait for its URBs too, since they point at it
+    while(!xfer->finished || xfer->inFlight) {
+        //reads only time out once data stops arriving
+        if(xfer->isRead && !xfer->finished && usb->reads == xfer
+        && now_seconds() - xfer->lastProgress > usb->timeout) {
+            usb_finish(usb, xfer, LIBUSB_ERROR_TIMEOUT);
+            break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000 * 1000;
+        if(ts.tv_nsec >= 1000 * 1000 * 1000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        pthread_cond_timedwait(&usb->cond, &usb->lock, &ts);
+    }
+
+    int result = xfer->done;
+    if(xfer->error && (!xfer->isRead || !xfer->done)) {
+        snprintf(usb->error, sizeof(usb->error), "USB %s failed: %s",
+            xfer->isRead ? "read" : "write", libusb_error_name(xfer->error));
+        result = -1;
+    }
+    pthread_mutex_unlock(&usb->lock);
+    free(xfer);
+    return result;
+}
+
+
+static int usb_write(sixtyfourDrive *device, const uint8_t *buf, int len) {
+    transportXfer *xfer = usb_write_submit(device, buf, len);
+    return xfer ? usb_done(device, xfer) : -1;
+}
+
+
+static int usb_read(sixtyfourDrive *device, uint8_t *buf, int len) {
+    transportXfer *xfer = usb_read_submit(device, buf, len);
+    return xfer ? usb_done(device, xfer) : -1;
+}
+
+
+static int usb_purge(sixtyfourDrive *device) {
+    usbContext *usb = USB(device);
+    pthread_mutex_lock(&usb->lock);
+    usb_cancel_all(usb);
+    pthread_mutex_unlock(&usb->lock);
+    int err = ftdi_usb_purge_buffers(usb->ftdi);
+    if(err) {
+        snprintf(usb->error, sizeof(usb->error), "%s",
+            ftdi_get_error_string(usb->ftdi));
+    }
+    return err;
+}
+
+
+static int usb_set_chunksize(sixtyfourDrive *device, uint32_t size) {
+    //URB size is fixed when opening; chunks are just split across them
+    (void)device;
+    (void)size;
+    return 0;
+}
+
+
+static const char* usb_error(sixtyfourDrive *device) {
+    return USB(device)->error;
+}
+
+
+const deviceTransport transport_usb = {
+    "usb",
+    "64drive on USB, with queued libusb bulk transfers",
+    usb_open,
+    usb_close,
+    usb_write,
+    usb_read,
+    usb_write_submit,
+    usb_read_submit,
+    usb_done,
+    usb_purge,
+    usb_set_chunksize,
+    usb_set_chunksize,
+    usb_error,
+};
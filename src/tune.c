@@ -0,0 +1,357 @@
+#include <ctype.h>
+#include "tune.h"
+#include "paths.h"
+#include "transfer.h"
+
+static const uint32_t tuneChunks[TUNE_N_CHUNKS] = {
+    256 * 1024, 512 * 1024, 1024 * 1024, 2048 * 1024, 4096 * 1024};
+static const int tuneDepths[TUNE_N_DEPTHS] = {1, 2, 4, 8};
+
+#define CONFIG(chunk, depth) ((chunk) * TUNE_N_DEPTHS + (depth))
+#define CHUNK_OF(config)     ((config) / TUNE_N_DEPTHS)
+#define DEPTH_OF(config)     ((config) % TUNE_N_DEPTHS)
+#define DEFAULT_DEPTH_IDX    2 //4 chunks in flight
+
+
+static bool allowed(transferTuner *tune, int config) {
+    int c = CHUNK_OF(config);
+    if(c > tune->maxChunkIdx) return false;
+    if(tune->chunkIdx >= 0 && c != tune->chunkIdx) return false;
+    return true;
+}
+
+
+static int best_config(transferTuner *tune) {
+    //best measured config that doesn't fail too often
+    int best = -1;
+    double bestScore = 0;
+    for(int i=0; i<TUNE_N_CONFIGS; i++) {
+        tuneStat *st = &tune->stats[i];
+        if(!allowed(tune, i) || !st->samples) continue;
+        if(st->errRate > TUNE_MAX_ERRORS) continue;
+        double score = st->mbps * (1.0 - st->errRate);
+        if(score > bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    if(best >= 0) return best;
+
+    int config = tune->defaultConfig;
+    if(tune->chunkIdx >= 0) config = CONFIG(tune->chunkIdx, DEPTH_OF(config));
+    return config;
+}
+
+
+static void make_key(transferTuner *tune, sixtyfourDrive *device) {
+    char variant[4];
+    for(int i=0; i<3; i++) {
+        char c = device->variant[i];
+        variant[i] = isgraph((unsigned char)c) ? c : '_';
+    }
+    variant[3] = 0;
+
+    snprintf(tune->key, sizeof(tune->key), "%s:HW%d:%s",
+        device->serial[0] ? device->serial : "unknown",
+        device->version, variant);
+    for(char *c = tune->key; *c; c++) {
+        if(!isgraph((unsigned char)*c)) *c = '_';
+    }
+}
+
+
+static void load_profile(transferTuner *tune) {
+    char path[4096];
+    if(user_file_path(path, sizeof(path), false, TUNE_PROFILE_FILE)) return;
+    FILE *file = fopen(path, "r");
+    if(!file) return;
+
+    char line[512];
+    while(fgets(line, sizeof(line), file)) {
+        char key[160], dir[8];
+        unsigned chunkKB;
+        int depth, samples;
+        double mbps, errRate;
+        if(line[0] == '#') continue;
+        if(sscanf(line, "%159s %7s %u %d %lf %lf %d", key, dir, &chunkKB,
+        &depth, &mbps, &errRate, &samples) != 7) continue;
+        if(strcmp(key, tune->key) || strcmp(dir, tune->dir)) continue;
+
+        for(int c=0; c<TUNE_N_CHUNKS; c++) {
+            for(int d=0; d<TUNE_N_DEPTHS; d++) {
+                if(tuneChunks[c] != chunkKB * 1024
+                || tuneDepths[d] != depth) continue;
+                tuneStat *st = &tune->stats[CONFIG(c, d)];
+                st->mbps = mbps;
+                st->errRate = errRate;
+                st->samples = samples;
+            }
+        }
+    }
+    fclose(file);
+}
+
+
+static void save_profile(transferTuner *tune) {
+    //rewrite the profile file, replacing only our own lines
+    char path[4096], tmpPath[4200];
+    if(user_file_path(path, sizeof(path), false, TUNE_PROFILE_FILE)) return;
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+
+    FILE *out = fopen(tmpPath, "w");
+    if(!out) {
+        if(verbosity > 0) {
+            fprintf(stderr, " ! Can't save transfer profile %s: %s\n",
+                tmpPath, strerror(errno));
+        }
+        return;
+    }
+    fprintf(out, "# 64drive transfer profiles\n"
+        "# device direction chunkKB depth MB/s errorRate samples\n");
+
+    FILE *in = fopen(path, "r");
+    if(in) {
+        char line[512];
+        while(fgets(line, sizeof(line), in)) {
+            char key[160], dir[8];
+            if(line[0] == '#') continue;
+            if(sscanf(line, "%159s %7s", key, dir) == 2
+            && !strcmp(key, tune->key) && !strcmp(dir, tune->dir)) continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    for(int i=0; i<TUNE_N_CONFIGS; i++) {
+        tuneStat *st = &tune->stats[i];
+        if(!st->samples) continue;
+        fprintf(out, "%s %s %u %d %.2f %.4f %d\n", tune->key, tune->dir,
+            tuneChunks[CHUNK_OF(i)] / 1024, tuneDepths[DEPTH_OF(i)],
+            st->mbps, st->errRate, st->samples);
+    }
+
+    if(fclose(out) || rename(tmpPath, path)) {
+        fprintf(stderr, " ! Can't save transfer profile %s: %s\n",
+            path, strerror(errno));
+        unlink(tmpPath);
+    }
+}
+
+
+static void next_trial(transferTuner *tune) {
+    tune->warm = false;
+    tune->measured = 0;
+    tune->errors = 0;
+    tune->bytes = 0;
+
+    if(tune->nTrials == 0 && tune->depthSweep) {
+        //chunk sizes are done; now try other depths with the best one
+        tune->depthSweep = false;
+        int best = best_config(tune);
+        for(int d=0; d<TUNE_N_DEPTHS; d++) {
+            int config = CONFIG(CHUNK_OF(best), d);
+            if(config != best && allowed(tune, config)) {
+                tune->trials[tune->nTrials++] = config;
+            }
+        }
+    }
+
+    if(tune->nTrials > 0) {
+        tune->current = tune->trials[0];
+        tune->nTrials--;
+        memmove(&tune->trials[0], &tune->trials[1],
+            tune->nTrials * sizeof(int));
+    }
+    else tune->current = best_config(tune);
+}
+
+
+static void finish_trial(transferTuner *tune, double now) {
+    double elapsed = now - tune->start;
+    if(tune->measured == 0 || elapsed <= 0) return;
+
+    tuneStat *st = &tune->stats[tune->current];
+    double mbps = (tune->bytes / elapsed) / (1024 * 1024);
+    double errRate = (double)tune->errors / (tune->measured + tune->errors);
+    if(st->samples) { //smooth across runs and windows
+        st->mbps    = (st->mbps    * 0.7) + (mbps    * 0.3);
+        st->errRate = (st->errRate * 0.7) + (errRate * 0.3);
+    }
+    else {
+        st->mbps    = mbps;
+        st->errRate = errRate;
+    }
+    st->samples += tune->measured;
+    tune->dirty = true;
+
+    if(verbosity > 1) {
+        printf("\n * Tuning %s: %uK x %d: %.2f MB/s, %d errors\n", tune->dir,
+            tuneChunks[CHUNK_OF(tune->current)] / 1024,
+            tuneDepths[DEPTH_OF(tune->current)], mbps, tune->errors);
+    }
+}
+
+
+void tune_begin(transferTuner *tune, sixtyfourDrive *device, const char *dir,
+int64_t size, bool lockChunk) {
+    /** Pick transfer parameters for an up/download.
+     *  dir:       "up" or "down".
+     *  size:      Transfer size.
+     *  lockChunk: The chunk size can't change during the transfer.
+     *  Starts from the best config measured on this device before. Large
+     *  transfers also spend a few chunks trying configs next to it (or,
+     *  for a new device, sweep chunk sizes and then depths) so the
+     *  profile keeps converging.
+     */
+    memset(tune, 0, sizeof(*tune));
+    tune->dir = dir;
+    tune->chunkIdx = -1;
+    if(transfer_opts.chunkSize) {
+        tune->fixedChunk = transfer_opts.chunkSize;
+        if(tune->fixedChunk > size) tune->fixedChunk = size;
+    }
+    else tune->fixedChunk = transfer_chunk_size(size);
+
+    //an explicit chunk size or queue depth means the user is tuning by hand
+    tune->enabled = transfer_opts.autotune && !transfer_opts.queueDepth
+        && !transfer_opts.chunkSize && size >= tuneChunks[0];
+    if(!tune->enabled) return;
+
+    tune->maxChunkIdx = 0;
+    tune->defaultConfig = CONFIG(0, DEFAULT_DEPTH_IDX);
+    for(int c=0; c<TUNE_N_CHUNKS; c++) {
+        if(tuneChunks[c] <= size) tune->maxChunkIdx = c;
+        if(tuneChunks[c] == tune->fixedChunk) {
+            tune->defaultConfig = CONFIG(c, DEFAULT_DEPTH_IDX);
+        }
+    }
+
+    make_key(tune, device);
+    load_profile(tune);
+
+    int best = best_config(tune);
+    if(lockChunk) tune->chunkIdx = CHUNK_OF(best);
+
+    if(size >= TUNE_MIN_SIZE) {
+        bool known = false;
+        for(int i=0; i<TUNE_N_CONFIGS; i++) {
+            if(allowed(tune, i) && tune->stats[i].samples) known = true;
+        }
+
+        if(!known) { //sweep chunk sizes, then depths
+            for(int c=0; c<TUNE_N_CHUNKS; c++) {
+                int config = CONFIG(c, DEPTH_OF(best));
+                if(allowed(tune, config)) {
+                    tune->trials[tune->nTrials++] = config;
+                }
+            }
+            tune->depthSweep = true;
+        }
+        else { //try the least measured neighbour of the best config
+            int c = CHUNK_OF(best), d = DEPTH_OF(best);
+            int neighbours[4] = {
+                CONFIG(c - 1, d), CONFIG(c + 1, d),
+                CONFIG(c, d - 1), CONFIG(c, d + 1)};
+            bool valid[4] = {c > 0, c + 1 < TUNE_N_CHUNKS,
+                d > 0, d + 1 < TUNE_N_DEPTHS};
+            int pick = -1;
+            for(int i=0; i<4; i++) {
+                if(!valid[i] || !allowed(tune, neighbours[i])) continue;
+                if(pick < 0 || tune->stats[neighbours[i]].samples
+                < tune->stats[pick].samples) pick = neighbours[i];
+            }
+            if(pick >= 0) tune->trials[tune->nTrials++] = pick;
+        }
+    }
+    next_trial(tune);
+
+    if(verbosity > 0) {
+        tuneStat *st = &tune->stats[best];
+        printf(" * Tuned %s: %uK chunks x %d", dir,
+            tuneChunks[CHUNK_OF(best)] / 1024, tuneDepths[DEPTH_OF(best)]);
+        if(st->samples) printf(" (%.2f MB/s)", st->mbps);
+        printf("%s\n", tune->nTrials || tune->current != best ?
+            ", exploring" : "");
+    }
+}
+
+
+void tune_fixed(transferTuner *tune, uint32_t chunkSize) {
+    //set up a tuner that always uses chunkSize and the default depth
+    memset(tune, 0, sizeof(*tune));
+    tune->enabled = false;
+    tune->fixedChunk = chunkSize;
+}
+
+
+int tune_config(transferTuner *tune, uint32_t *chunkSize, int *depth) {
+    /** Get the chunk size and queue depth for the next chunk.
+     *  Returns the config id to pass to tune_record() for the chunk.
+     */
+    if(!tune->enabled) {
+        *chunkSize = tune->fixedChunk;
+        *depth = transfer_opts.queueDepth ?
+            transfer_opts.queueDepth : TRANSFER_DEFAULT_DEPTH;
+        return -1;
+    }
+    *chunkSize = tuneChunks[CHUNK_OF(tune->current)];
+    *depth = tuneDepths[DEPTH_OF(tune->current)];
+    return tune->current;
+}
+
+
+uint32_t tune_max_chunk(transferTuner *tune) {
+    //largest chunk size tune_config() may return
+    if(!tune->enabled) return tune->fixedChunk;
+    if(tune->chunkIdx >= 0) return tuneChunks[tune->chunkIdx];
+    return tuneChunks[tune->maxChunkIdx];
+}
+
+
+int tune_max_depth(transferTuner *tune) {
+    //largest queue depth tune_config() may return
+    if(!tune->enabled) {
+        return transfer_opts.queueDepth ?
+            transfer_opts.queueDepth : TRANSFER_DEFAULT_DEPTH;
+    }
+    return tuneDepths[TUNE_N_DEPTHS - 1];
+}
+
+
+void tune_record(transferTuner *tune, int config, uint32_t bytes,
+bool failed) {
+    /** Record a chunk being retired.
+     *  config: Config the chunk was sent with.
+     *  bytes:  Chunk length.
+     *  failed: The chunk failed and will be retried.
+     *  Throughput is measured between completions of the current config's
+     *  chunks, so chunks of the previous config still draining from the
+     *  queue and the first chunk after a change don't count.
+     */
+    if(!tune->enabled || config != tune->current) return;
+
+    double now = now_seconds();
+    if(!tune->warm) {
+        tune->warm = true;
+        tune->start = now;
+        return;
+    }
+
+    if(failed) tune->errors++;
+    else {
+        tune->bytes += bytes;
+        tune->measured++;
+    }
+
+    if(tune->measured + tune->errors >= TUNE_TRIAL_CHUNKS) {
+        finish_trial(tune, now);
+        next_trial(tune);
+    }
+}
+
+
+void tune_end(transferTuner *tune) {
+    if(!tune->enabled) return;
+    if(tune->warm) finish_trial(tune, now_seconds());
+    if(tune->dirty) save_profile(tune);
+}
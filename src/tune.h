@@ -0,0 +1,52 @@
+#ifndef _TUNE_H_
+#define _TUNE_H_
+
+#include "64drive.h"
+
+#define TUNE_N_CHUNKS      5 //chunk sizes tried, 256K to 4M
+#define TUNE_N_DEPTHS      4 //queue depths tried, 1 to 8
+#define TUNE_N_CONFIGS     (TUNE_N_CHUNKS * TUNE_N_DEPTHS)
+#define TUNE_TRIAL_CHUNKS  4 //chunks measured per trial
+#define TUNE_MIN_SIZE      (8 * 1024 * 1024) //smaller transfers don't explore
+#define TUNE_MAX_ERRORS    0.05 //configs failing more often are avoided
+#define TUNE_PROFILE_FILE  "profiles"
+
+typedef struct {
+    double mbps;    //smoothed throughput
+    double errRate; //smoothed fraction of chunks that failed
+    int samples;    //chunks measured over all runs
+} tuneStat;
+
+typedef struct {
+    bool enabled;
+    bool dirty;
+    char key[160];   //device serial, HW version and variant
+    const char *dir; //"up" or "down"
+    tuneStat stats[TUNE_N_CONFIGS];
+
+    uint32_t fixedChunk; //chunk size when not tuning
+    int maxChunkIdx;     //largest chunk size not bigger than the transfer
+    int defaultConfig;   //used until something has been measured
+    int chunkIdx;        //-1, or the only chunk size that may be used
+    int current;         //config used for new chunks
+    int trials[TUNE_N_CONFIGS]; //configs still to try this run
+    int nTrials;
+    bool depthSweep;     //sweep depths once chunk sizes have been tried
+
+    //measurement of the current config
+    bool warm;
+    int measured, errors;
+    uint64_t bytes;
+    double start;
+} transferTuner;
+
+void tune_begin(transferTuner *tune, sixtyfourDrive *device, const char *dir,
+    int64_t size, bool lockChunk);
+void tune_fixed(transferTuner *tune, uint32_t chunkSize);
+int tune_config(transferTuner *tune, uint32_t *chunkSize, int *depth);
+uint32_t tune_max_chunk(transferTuner *tune);
+int tune_max_depth(transferTuner *tune);
+void tune_record(transferTuner *tune, int config, uint32_t bytes, bool failed);
+void tune_end(transferTuner *tune);
+
+#endif //_TUNE_H_
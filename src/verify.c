@@ -0,0 +1,138 @@
+#include "verify.h"
+
+/** Multi-pass dumps: each pass is reduced to a SHA-1 per VERIFY_BLOCK,
+ *  and blocks whose hashes don't all agree are read again by themselves,
+ *  tallying each version seen, until one of them has a clear majority.
+ */
+
+
+int verify_pass_init(verifyPass *pass, int64_t size) {
+    memset(pass, 0, sizeof(*pass));
+    pass->nBlocks = (size + VERIFY_BLOCK - 1) / VERIFY_BLOCK;
+    pass->hashes = (uint8_t*)calloc(pass->nBlocks ? pass->nBlocks : 1,
+        SHA1_SIZE);
+    if(!pass->hashes) return -1;
+    sha1_init(&pass->hash);
+    return 0;
+}
+
+
+void verify_pass_free(verifyPass *pass) {
+    free(pass->hashes);
+    pass->hashes = NULL;
+}
+
+
+void verify_pass_feed(verifyPass *pass, const uint8_t *data, uint32_t len) {
+    //hash the next len bytes of the pass
+    while(len > 0) {
+        uint32_t n = VERIFY_BLOCK - (pass->pos % VERIFY_BLOCK);
+        if(n > len) n = len;
+        sha1_update(&pass->hash, data, n);
+        pass->pos += n;
+        data += n;
+        len -= n;
+        if(!(pass->pos % VERIFY_BLOCK)) {
+            uint32_t b = (pass->pos / VERIFY_BLOCK) - 1;
+            if(b < pass->nBlocks) {
+                sha1_final(&pass->hash, &pass->hashes[b * SHA1_SIZE]);
+            }
+            sha1_init(&pass->hash);
+        }
+    }
+}
+
+
+void verify_pass_end(verifyPass *pass) {
+    //finish the last block, if it's a partial one
+    uint32_t b = pass->pos / VERIFY_BLOCK;
+    if((pass->pos % VERIFY_BLOCK) && b < pass->nBlocks) {
+        sha1_final(&pass->hash, &pass->hashes[b * SHA1_SIZE]);
+    }
+    sha1_init(&pass->hash);
+}
+
+
+int verify_pass_file(verifyPass *pass, int fd, off_t base, int64_t size) {
+    //hash what's already in a file, starting at base
+    uint8_t *buf = (uint8_t*)malloc(VERIFY_BLOCK);
+    if(!buf) return -1;
+    int result = 0;
+    for(int64_t pos = 0; pos < size; pos += VERIFY_BLOCK) {
+        int64_t len = size - pos;
+        if(len > VERIFY_BLOCK) len = VERIFY_BLOCK;
+        if(pread(fd, buf, len, base + pos) != len) {
+            result = -1;
+            break;
+        }
+        verify_pass_feed(pass, buf, len);
+    }
+    verify_pass_end(pass);
+    free(buf);
+    return result;
+}
+
+
+void verify_block_add(verifyBlock *vb, const uint8_t *hash,
+const uint8_t *data, uint32_t len) {
+    /** Count one read of a block.
+     *  hash: Its SHA-1, or NULL to hash data.
+     *  data: Its contents, or NULL if only the hash is known.
+     */
+    uint8_t h[SHA1_SIZE];
+    if(!hash) {
+        sha1(data, len, h);
+        hash = h;
+    }
+
+    int v;
+    for(v=0; v<vb->nVersions; v++) {
+        if(!memcmp(vb->hash[v], hash, SHA1_SIZE)) break;
+    }
+    if(v == vb->nVersions) {
+        if(v == VERIFY_MAX_READS) return; //can't happen; reads are limited
+        memcpy(vb->hash[v], hash, SHA1_SIZE);
+        vb->count[v] = 0;
+        vb->data[v] = NULL;
+        vb->nVersions++;
+    }
+    if(data && !vb->data[v]) {
+        vb->data[v] = (uint8_t*)malloc(len);
+        if(vb->data[v]) memcpy(vb->data[v], data, len);
+    }
+    vb->count[v]++;
+    vb->nReads++;
+}
+
+
+int verify_block_winner(verifyBlock *vb, int minCount) {
+    //the version read more than half the time and at least minCount times,
+    //or -1 if none has been yet
+    for(int v=0; v<vb->nVersions; v++) {
+        if(vb->count[v] >= minCount && vb->count[v] * 2 > vb->nReads) {
+            return v;
+        }
+    }
+    return -1;
+}
+
+
+void verify_block_free(verifyBlock *vb) {
+    for(int v=0; v<vb->nVersions; v++) free(vb->data[v]);
+    vb->nVersions = 0;
+}
+
+
+static int verify_write(dumpSink *sink, const uint8_t *data, uint32_t len) {
+    verify_pass_feed((verifyPass*)sink->ctx, data, len);
+    return 0;
+}
+
+
+static int verify_finish(dumpSink *sink) {
+    verify_pass_end((verifyPass*)sink->ctx);
+    return 0;
+}
+
+//hashes a pass instead of writing it anywhere
+const sinkBackend sink_verify = {"verify", NULL, verify_write, verify_finish};
@@ -0,0 +1,41 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include "64drive.h"
+#include "hash.h"
+#include "sink.h"
+
+#define VERIFY_BLOCK     (64 * 1024) //granularity of comparisons and re-reads
+#define VERIFY_MAX_READS 9 //reads of a block that disagrees before giving up
+
+//hashes of each block of one read of a dump
+typedef struct {
+    int64_t pos;      //bytes seen so far
+    uint32_t nBlocks;
+    uint8_t *hashes;  //SHA-1 of each block
+    sha1Context hash; //of the block being fed
+} verifyPass;
+
+//the different versions of one block read so far
+typedef struct {
+    int nReads;
+    int nVersions;
+    int count[VERIFY_MAX_READS]; //times each version was read
+    uint8_t hash[VERIFY_MAX_READS][SHA1_SIZE];
+    uint8_t *data[VERIFY_MAX_READS]; //contents of each version, if known
+} verifyBlock;
+
+int verify_pass_init(verifyPass *pass, int64_t size);
+void verify_pass_feed(verifyPass *pass, const uint8_t *data, uint32_t len);
+void verify_pass_end(verifyPass *pass);
+int verify_pass_file(verifyPass *pass, int fd, off_t base, int64_t size);
+void verify_pass_free(verifyPass *pass);
+
+void verify_block_add(verifyBlock *vb, const uint8_t *hash,
+    const uint8_t *data, uint32_t len);
+int verify_block_winner(verifyBlock *vb, int minCount);
+void verify_block_free(verifyBlock *vb);
+
+extern const sinkBackend sink_verify;
+
+#endif //_VERIFY_H_
@@ -0,0 +1,115 @@
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "watch.h"
+
+static volatile sig_atomic_t quit = 0;
+
+
+static void on_signal(int sig) {
+    (void)sig;
+    quit = 1;
+}
+
+
+static bool file_present(const char *path) {
+    struct stat st;
+    return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+
+int watch_file(const char *path, watchCallback upload, void *arg) {
+    /** Upload path now and again each time it's rewritten, until
+     *  interrupted.
+     *  We watch the directory rather than the file, so a build that writes
+     *  a new file and renames it over the old one is seen too. Uploads
+     *  wait until there have been no writes for WATCH_DEBOUNCE_MS, so a
+     *  file being written in several steps goes up once, complete.
+     */
+    char dirBuf[4096], nameBuf[4096];
+    if(strlen(path) >= sizeof(dirBuf)) {
+        fprintf(stderr, "Path too long: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(dirBuf, path);
+    strcpy(nameBuf, path);
+    const char *dir = dirname(dirBuf), *name = basename(nameBuf);
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if(fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MODIFY
+    | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM) < 0) {
+        fprintf(stderr, "Can't watch %s: %s\n", dir, strerror(errno));
+        if(fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; //no SA_RESTART, so poll() returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    bool pending = file_present(path); //upload what's there to start with
+    double lastEvent = 0;
+    if(verbosity >= 0) printf(" * Watching %s (^C to stop)\n", path);
+
+    while(!quit) {
+        int timeout = -1;
+        if(pending) {
+            timeout = (int)((lastEvent + WATCH_DEBOUNCE_MS / 1000.0
+                - now_seconds()) * 1000) + 1;
+            if(timeout < 0) timeout = 0;
+        }
+        fflush(stdout);
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int n = poll(&pfd, 1, timeout);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            break;
+        }
+
+        if(n == 0) { //quiet long enough
+            pending = false;
+            if(!file_present(path)) continue; //deleted again meanwhile
+            if(verbosity >= 0) printf(" * %s changed\n", path);
+            upload(path, arg);
+            continue;
+        }
+
+        char buf[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if(len < 0) {
+            if(errno == EINTR || errno == EAGAIN) continue;
+            fprintf(stderr, "inotify: %s\n", strerror(errno));
+            break;
+        }
+        for(char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if(ev->mask & IN_Q_OVERFLOW) { //lost events; assume the worst
+                pending = true;
+                lastEvent = now_seconds();
+            }
+            if(!ev->len || strcmp(ev->name, name)) continue;
+
+            if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                //being replaced; wait for the new one
+                if(verbosity > 1) printf(" * %s went away\n", path);
+                pending = false;
+            }
+            else {
+                pending = true;
+                lastEvent = now_seconds();
+            }
+        }
+    }
+
+    if(verbosity >= 0) printf(" * Stopped watching %s\n", path);
+    close(fd);
+    return EXIT_SUCCESS;
+}
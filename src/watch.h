@@ -0,0 +1,13 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include "64drive.h"
+
+#define WATCH_DEBOUNCE_MS 250 //quiet time after the last write before uploading
+
+//called with the watched path each time it should be uploaded
+typedef int (*watchCallback)(const char *path, void *arg);
+
+int watch_file(const char *path, watchCallback upload, void *arg);
+
+#endif //_WATCH_H_